@@ -0,0 +1,15 @@
+# Replays test-input/replay.txt headless against generated files, sizes as args (e.g. 1M 1G 10G)
+set -e
+mkdir -p build
+gcc code/kilo.c -o build/kilo-bench -O2 -g -pthread -lz -ldl
+for size in ${@:-1M 100M 1G}; do
+    input=build/bench-$size.txt
+    yes "$(printf '2021-10-09 12:00:00\tINFO\tworker-3 finished request 4711 in 42ms')" | head -c $size > $input
+    rm -f $input.kiloidx
+    build/kilo-bench --replay=test-input/replay.txt --size=50x200 $input
+    # Batches read compressed files through the stream and save them back compressed
+    gzip -c $input > $input.gz
+    echo "save" | timeout 600 build/kilo-bench --batch $input.gz
+    zcat $input.gz | cmp - $input
+    rm -f $input $input.kiloidx $input.gz
+done
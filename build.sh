@@ -1,2 +1,2 @@
-gcc code/kilo.c -o build/kilo -g
+gcc code/kilo.c -o build/kilo -g -pthread -lz -ldl
 echo done
@@ -9,17 +9,36 @@
 #include <stdlib.h>
 #include <string.h>
 #include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include <termios.h>
 #include <unistd.h>
 #include <stdint.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <time.h>
+#include <limits.h>
+#include <libgen.h>
+#include <sys/uio.h>
+#include <sys/resource.h>
+#include <sys/inotify.h>
+#include <dlfcn.h>
+#include <zlib.h>
+
+#if defined(__x86_64__)
+#include <immintrin.h>
+#endif
 
 typedef int32_t i32;
 typedef int64_t i64;
 typedef uint64_t u32;
 typedef uint64_t u64;
+typedef uint8_t u8;
 typedef int32_t b32;
 typedef ssize_t isize;
 typedef size_t usize;
+typedef double f64;
 
 #define true 1
 #define false 0
@@ -31,17 +50,314 @@ typedef size_t usize;
 
 #define CTRL_KEY(k) ((k) & 0x1f)
 
+// NOTE(sen) Every allocation in this file goes through these so the replay harness can count them
+global u64 ALLOCATION_COUNT;
+
+function void*
+countedMalloc(usize size) {
+    __atomic_add_fetch(&ALLOCATION_COUNT, 1, __ATOMIC_RELAXED);
+    return malloc(size);
+}
+
+function void*
+countedCalloc(usize count, usize size) {
+    __atomic_add_fetch(&ALLOCATION_COUNT, 1, __ATOMIC_RELAXED);
+    return calloc(count, size);
+}
+
+function void*
+countedRealloc(void* ptr, usize size) {
+    __atomic_add_fetch(&ALLOCATION_COUNT, 1, __ATOMIC_RELAXED);
+    return realloc(ptr, size);
+}
+
+#define malloc(size) countedMalloc(size)
+#define calloc(count, size) countedCalloc(count, size)
+#define realloc(ptr, size) countedRealloc(ptr, size)
+
+// NOTE(sen) Timing of the main loop phases and the edit paths. Off unless asked for, then every
+// scope costs two clock reads. Frames are traced only when there is somewhere to write them.
+typedef enum ProfileScope {
+    ProfileScope_Rows,
+    ProfileScope_Render,
+    ProfileScope_Write,
+    ProfileScope_Input,
+    ProfileScope_Keys,
+    ProfileScope_InsertChar,
+    ProfileScope_InsertText,
+    ProfileScope_RenderChars,
+    ProfileScope_Count,
+    ProfileScope_Frame = ProfileScope_Count, // NOTE(sen) Trace counters, not a timed scope
+} ProfileScope;
+
+global char* PROFILE_SCOPE_NAMES[ProfileScope_Count] = {
+    "rows", "render", "write", "input", "keys", "insertChar", "insertText", "renderChars",
+};
+
+#define PROFILE_MAX_EVENTS (1 << 20)
+
+typedef struct ProfileEvent {
+    ProfileScope scope;
+    u64 start; // NOTE(sen) Nanoseconds
+    u64 duration;
+    u64 counters[3]; // NOTE(sen) Frame events only, same order as in `ProfileFrame`
+} ProfileEvent;
+
+typedef struct ProfileFrame {
+    u64 nanoseconds[ProfileScope_Count];
+    u64 bytesWritten;
+    u64 allocations;
+    u64 appendReallocs;
+} ProfileFrame;
+
+typedef struct Profiler {
+    b32 enabled;
+    // NOTE(sen) Counted whether enabled or not, it's one add
+    u64 bytesWritten;
+    u64 appendReallocs;
+    ProfileFrame frame; // NOTE(sen) Being measured
+    ProfileFrame lastFrame; // NOTE(sen) Shown in the status bar
+    ProfileFrame frameStartCounters;
+    char* traceFilename;
+    ProfileEvent* events;
+    i32 nEvents;
+    i32 eventsCap;
+} Profiler;
+
+global Profiler PROFILER;
+
+function u64
+profileNow() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    u64 result = (u64)ts.tv_sec * 1000000000 + ts.tv_nsec;
+    return result;
+}
+
+function ProfileEvent*
+profileAddEvent(ProfileScope scope, u64 start, u64 duration) {
+    ProfileEvent* result = 0;
+    if (PROFILER.traceFilename && PROFILER.nEvents < PROFILE_MAX_EVENTS) {
+        if (PROFILER.nEvents == PROFILER.eventsCap) {
+            PROFILER.eventsCap = PROFILER.eventsCap ? PROFILER.eventsCap * 2 : 4096;
+            PROFILER.events = realloc(PROFILER.events, PROFILER.eventsCap * sizeof(ProfileEvent));
+        }
+        result = PROFILER.events + PROFILER.nEvents++;
+        *result = (ProfileEvent) {scope, start, duration, {}};
+    }
+    return result;
+}
+
+function void
+profileRecord(ProfileScope scope, u64 start) {
+    u64 duration = profileNow() - start;
+    PROFILER.frame.nanoseconds[scope] += duration;
+    profileAddEvent(scope, start, duration);
+}
+
+// NOTE(sen) Scopes are main thread only. A scope that began while disabled isn't recorded.
+#define PROFILE_BEGIN(name) u64 profileStart##name = PROFILER.enabled ? profileNow() : 0
+#define PROFILE_END(name) if (profileStart##name) { profileRecord(ProfileScope_##name, profileStart##name); }
+
+function void
+profileFrameBegin() {
+    ProfileFrame* frame = &PROFILER.frame;
+    ProfileFrame* counters = &PROFILER.frameStartCounters;
+    u64 allocations = __atomic_load_n(&ALLOCATION_COUNT, __ATOMIC_RELAXED);
+    frame->bytesWritten = PROFILER.bytesWritten - counters->bytesWritten;
+    frame->allocations = allocations - counters->allocations;
+    frame->appendReallocs = PROFILER.appendReallocs - counters->appendReallocs;
+    if (PROFILER.enabled) {
+        ProfileEvent* event = profileAddEvent(ProfileScope_Frame, profileNow(), 0);
+        if (event) {
+            event->counters[0] = frame->bytesWritten;
+            event->counters[1] = frame->allocations;
+            event->counters[2] = frame->appendReallocs;
+        }
+    }
+    PROFILER.lastFrame = *frame;
+    *frame = (ProfileFrame) {};
+    counters->bytesWritten = PROFILER.bytesWritten;
+    counters->allocations = allocations;
+    counters->appendReallocs = PROFILER.appendReallocs;
+}
+
+// NOTE(sen) What the last frame spent where, for the status bar
+function i32
+profileOverlay(char* buf, i32 cap) {
+    ProfileFrame* frame = &PROFILER.lastFrame;
+    i32 len = 0;
+    for (i32 scope = 0; scope < ProfileScope_Count && len < cap; scope++) {
+        if (frame->nanoseconds[scope] > 0) {
+            len += snprintf(
+                buf + len, cap - len, "%s %.2f ", PROFILE_SCOPE_NAMES[scope], (f64)frame->nanoseconds[scope] / 1e6
+            );
+        }
+    }
+    if (len < cap) {
+        len += snprintf(
+            buf + len, cap - len, "ms %luB %lu allocs %lu reallocs |", frame->bytesWritten,
+            frame->allocations, frame->appendReallocs
+        );
+    }
+    if (len > cap - 1) {
+        len = cap - 1;
+    }
+    return len;
+}
+
+// NOTE(sen) Chrome trace event format, load in chrome://tracing or Perfetto
+function void
+profileWriteTrace() {
+    FILE* file = fopen(PROFILER.traceFilename, "w");
+    if (file) {
+        u64 origin = PROFILER.nEvents > 0 ? PROFILER.events[0].start : 0;
+        fprintf(file, "{\"traceEvents\":[\n");
+        for (i32 eventIndex = 0; eventIndex < PROFILER.nEvents; eventIndex++) {
+            ProfileEvent* event = PROFILER.events + eventIndex;
+            f64 ts = (f64)(event->start - origin) / 1000.0;
+            char* separator = eventIndex + 1 < PROFILER.nEvents ? "," : "";
+            if (event->scope == ProfileScope_Frame) {
+                fprintf(
+                    file,
+                    "{\"name\":\"frame\",\"ph\":\"C\",\"ts\":%.3f,\"pid\":1,\"tid\":1,"
+                    "\"args\":{\"bytesWritten\":%lu,\"allocations\":%lu,\"appendReallocs\":%lu}}%s\n",
+                    ts, event->counters[0], event->counters[1], event->counters[2], separator
+                );
+            } else {
+                fprintf(
+                    file, "{\"name\":\"%s\",\"ph\":\"X\",\"ts\":%.3f,\"dur\":%.3f,\"pid\":1,\"tid\":1}%s\n",
+                    PROFILE_SCOPE_NAMES[event->scope], ts, (f64)event->duration / 1000.0, separator
+                );
+            }
+        }
+        fprintf(file, "],\"displayTimeUnit\":\"ms\"}\n");
+        fclose(file);
+    }
+}
+
 global char* KILO_VERSION = "0.0.1";
 
 global struct termios OG_TERMINAL_SETTINGS;
 
+// NOTE(sen) Characters with a movable hole in them so that edits near the hole are cheap
+typedef struct GapBuffer {
+    char* buf;
+    i32 cap;
+    i32 gapStart;
+    i32 gapEnd;
+    b32 borrowed; // NOTE(sen) `buf` is memory we don't own (the file contents), copy before editing
+} GapBuffer;
+
+// NOTE(sen) Text of edited rows is carved out of slabs in power-of-two size classes, freed text goes
+// on the free list of its class. Longer rows get an allocation of their own.
+#define TEXT_SLAB_BYTES (1 << 20)
+#define TEXT_MIN_CLASS_BYTES 16
+#define TEXT_N_CLASSES 9 // NOTE(sen) Up to 4KB
+
+typedef struct TextPool {
+    char* freeLists[TEXT_N_CLASSES]; // NOTE(sen) Free text starts with a pointer to the next
+    char* slab;
+    usize slabUsed;
+} TextPool;
+
+global TextPool TEXT_POOL;
+
+// NOTE(sen) Render characters are only built for rows that have tabs or UTF-8 and only when they
+// are needed. Plain ASCII rows without tabs render straight from `fileChars`. Rows are kept small
+// (40 bytes), loaded blocks have one per line.
 typedef struct Row {
-    i32 charsSize;
-    char* fileChars;
-    i32 renderSize;
-    char* renderChars;
+    GapBuffer fileChars;
+    i32 width; // NOTE(sen) Render columns, -1 until worked out again after an edit
+    u8 hlEndState; // NOTE(sen) Highlight lexer state at the end of the row, 0 until lexed
+    u8 hasColumns; // NOTE(sen) Which of `renderTag` and `columns` is in use
+    u8 nonAscii; // NOTE(sen) Has bytes above 0x7f, only up to date when `width` is known
+    union {
+        u32 renderTag; // NOTE(sen) Render cache entry of the row, 0 if nothing is cached
+        struct ColumnIndex* columns; // NOTE(sen) Only for long rows that aren't plain ASCII, they skip the render cache
+    };
 } Row;
 
+// NOTE(sen) Long rows remember their render column every so often so that mapping between file
+// offsets and render columns only scans from the closest checkpoint
+#define COLUMN_INDEX_MIN_BYTES 4096
+#define COLUMN_CHECKPOINT_BYTES 1024
+
+typedef struct ColumnCheckpoint {
+    i32 fileX;
+    i32 renderX;
+} ColumnCheckpoint;
+
+typedef struct ColumnIndex {
+    i32 nCheckpoints;
+    i32 cap;
+    ColumnCheckpoint* checkpoints; // NOTE(sen) Sorted, the first one is always (0, 0)
+} ColumnIndex;
+
+typedef struct RenderCacheEntry {
+    u32 tag;
+    i32 len;
+    i32 cap;
+    char* chars;
+    u8* hl; // NOTE(sen) Highlight of every render character when `hlStartState` isn't 0
+    i32 hlStartState;
+} RenderCacheEntry;
+
+// NOTE(sen) Bounded set of render rows, entries are reused round-robin
+typedef struct RenderCache {
+    i32 nEntries;
+    RenderCacheEntry* entries;
+    i32 nextEvict;
+} RenderCache;
+
+// NOTE(sen) Every this many lines the line index remembers where the line starts. Rows are
+// loaded from the mapping in blocks of this many lines.
+#define LINE_INDEX_STRIDE 1024
+
+// NOTE(sen) Indexes of files at least this big are saved next to them for the next time
+#define LINE_INDEX_SIDECAR_MIN_BYTES (64 << 20)
+#define LINE_INDEX_SIDECAR_MAGIC "KILOIDX1"
+
+typedef struct LineIndexSidecarHeader {
+    char magic[8];
+    u64 fileSize;
+    i64 mtimeSec;
+    i64 mtimeNsec;
+    u64 stride;
+    i64 nLines;
+    i64 nCheckpoints;
+} LineIndexSidecarHeader;
+
+// NOTE(sen) Built on its own thread. `offsets[k]` is where line `k * LINE_INDEX_STRIDE` starts,
+// the first `nCheckpoints` of them can be read by other threads.
+typedef struct LineIndex {
+    char* base;
+    usize size;
+    struct timespec mtime;
+    char sidecarFilename[PATH_MAX + 16];
+    usize* offsets;
+    i64 offsetsCap;
+    i64 nCheckpoints;
+    i64 nLines; // NOTE(sen) Only valid once complete
+    b32 complete;
+    pthread_t thread;
+    pthread_mutex_t mutex;
+    pthread_cond_t progress;
+} LineIndex;
+
+// NOTE(sen) Rows are kept in blocks. A block from the line index that hasn't been looked at yet is
+// only a range of the mapping holding `nRows` lines.
+typedef struct RowBlock {
+    b32 loaded;
+    usize mapStart;
+    usize mapEnd;
+    i32 nRows;
+    i32 rowsCap;
+    Row* rows;
+    i32 screenLines; // NOTE(sen) What the block counts for in `wrapTree`
+    b32 screenLinesKnown; // NOTE(sen) Otherwise `screenLines` is just the row count
+} RowBlock;
+
 typedef struct EditorState {
     i32 userMessageLen;
     char userMessage[128];
@@ -54,16 +370,457 @@ typedef struct EditorState {
     i32 screenCols;
     i32 rowOffset;
     i32 colOffset;
+    i32 wrapOffset; // NOTE(sen) Screen lines of row `rowOffset` above the screen when wrapping
+    // NOTE(sen) Row counts of the blocks are kept in a Fenwick tree (`blockTree`, 1-based) so that
+    // finding the block of a row is O(log n)
     i32 nRows;
-    Row* rows;
+    RowBlock* blocks;
+    i32 nBlocks;
+    i32 blocksCap;
+    i32* blockTree;
+    // NOTE(sen) Soft wrap, a row takes `width / wrapCols + 1` screen lines. Screen lines of the
+    // blocks are kept in `wrapTree` the same way, a block counts one line per row until something
+    // measures it and goes back to that when its rows change.
+    b32 wrap;
+    i32 wrapCols;
+    i32* wrapTree;
+    // NOTE(sen) Read-only mapping of the opened file, blocks are made from it as the index grows
+    char* mapBase;
+    usize mapSize;
+    LineIndex lineIndex;
+    i64 checkpointsUsed;
+    usize blocksMapEnd; // NOTE(sen) Everything in the mapping before this is in a block
+    char* readChars; // NOTE(sen) Contents of a file that couldn't be mapped, its rows borrow from it
+    usize readSize;
+    struct Stream* stream; // NOTE(sen) Stands in for the line index when the input is a pipe
+    RenderCache renderCache;
+    b32 highlight;
+    i32 newlineLen; // NOTE(sen) 2 if the first line ends in \r\n, 0 until a line has ended
+    b32 noFinalNewline; // NOTE(sen) The last line of the file doesn't end in a newline
 } EditorState;
 
+// NOTE(sen) Grows geometrically and is never cleared, buffers that are reused every frame stop
+// reallocating once they have held the biggest frame
 typedef struct AppendBuffer {
     char* buf;
     i32 len;
+    i32 cap;
 } AppendBuffer;
 
+// NOTE(sen) What the terminal is currently showing, one entry per screen line (text rows, then
+// status bar, then user message)
+typedef struct ScreenShadow {
+    b32 valid;
+    i32 nLines;
+    AppendBuffer* lines;
+    i32 rowOffset;
+    i32 colOffset;
+    i32 wrapOffset;
+    i32 lastFrameBytes;
+} ScreenShadow;
+
+// NOTE(sen) Compressed input is recognised by its first bytes and saved back the same way
+typedef enum Compression {
+    Compression_None,
+    Compression_Gzip,
+    Compression_Zstd,
+} Compression;
+
+// NOTE(sen) libzstd is loaded when it's first needed, there's no header for it to build against.
+// These are the parts of its streaming API that get used.
+#define ZSTD_E_CONTINUE 0
+#define ZSTD_E_END 2
+
+typedef struct ZstdInBuffer {
+    const void* src;
+    usize size;
+    usize pos;
+} ZstdInBuffer;
+
+typedef struct ZstdOutBuffer {
+    void* dst;
+    usize size;
+    usize pos;
+} ZstdOutBuffer;
+
+typedef struct ZstdLibrary {
+    b32 loaded;
+    void* (*createDCtx)(void);
+    usize (*freeDCtx)(void* dctx);
+    usize (*decompressStream)(void* dctx, ZstdOutBuffer* output, ZstdInBuffer* input);
+    void* (*createCCtx)(void);
+    usize (*freeCCtx)(void* cctx);
+    usize (*compressStream2)(void* cctx, ZstdOutBuffer* output, ZstdInBuffer* input, i32 endOp);
+    unsigned (*isError)(size_t code); // NOTE(sen) Declared as in zstd.h, `u32` is 64 bits here
+    const char* (*getErrorName)(usize code);
+} ZstdLibrary;
+
+global ZstdLibrary ZSTD;
+global pthread_once_t ZSTD_ONCE = PTHREAD_ONCE_INIT;
+
+// NOTE(sen) Contiguous piece of the document to be written out
+typedef struct SaveSegment {
+    char* chars;
+    usize len;
+} SaveSegment;
+
+// NOTE(sen) A save runs on its own thread from a snapshot of the document. Unedited rows are
+// written straight from the file mapping, edited rows are copied into `ownedChars` when the
+// snapshot is taken.
+typedef struct SaveJob {
+    b32 running;
+    pthread_t thread;
+    char filename[PATH_MAX];
+    char tempFilename[PATH_MAX + 16];
+    SaveSegment* segments;
+    i32 nSegments;
+    i32 segmentsCap;
+    char* ownedChars;
+    Compression compression; // NOTE(sen) Written out the way the file was read
+    usize totalBytes;
+    usize bytesWritten; // NOTE(sen) Updated by the save thread
+    b32 finished; // NOTE(sen) Set by the save thread
+    i32 error; // NOTE(sen) errno of the first failure, 0 on success
+    f64 startTime;
+    f64 endTime; // NOTE(sen) Set by the save thread
+} SaveJob;
+
+// NOTE(sen) Frames are drawn at most this often for keys that come in faster than that and for lines
+// appended while following or reading a pipe
+#define FRAME_SECONDS (1.0 / 60)
+
+// NOTE(sen) Following (--follow) watches the file and adds whatever gets appended to it as new rows.
+// The file is read rather than mapped so that it can be truncated under us, rows borrow from the
+// chunks that were read.
+typedef struct Follow {
+    b32 active;
+    i32 fd;
+    usize offset; // NOTE(sen) How much of the file has been read
+    b32 lastLineOpen; // NOTE(sen) The file doesn't end in a newline (yet)
+    i32 inotifyFd;
+    i32 fileWatch;
+    i32 dirWatch; // NOTE(sen) For a new file turning up under the name after a rotation, -1 if none
+    char basename[NAME_MAX + 1];
+    char** chunks;
+    i32 nChunks;
+    i32 chunksCap;
+    b32 changed; // NOTE(sen) Something was added since the last frame
+    f64 lastFrameTime;
+} Follow;
+
+// NOTE(sen) Piped input is kept in memory up to this much, after that all of it goes to a temp file
+#define STREAM_MEMORY_BYTES (64 << 20)
+#define STREAM_RESERVE_BYTES ((usize)1 << 40)
+#define STREAM_READ_BYTES (1 << 20)
+#define STREAM_INPUT_BYTES (256 << 10)
+
+// NOTE(sen) Input from a pipe (`-` or anything else that isn't a regular file) or a compressed
+// file, read on its own thread into one reserved range of addresses that stands in for the file
+// mapping. The first `STREAM_MEMORY_BYTES` are anonymous memory. Past that they are written to an
+// unlinked temp file that gets mapped over the whole range, so the page cache holds what has been
+// read and can drop it. Decompressed bytes stay there, so going back to any of them is free.
+typedef struct Stream {
+    i32 fd;
+    b32 regularFile; // NOTE(sen) A compressed file, it ends so it can be waited for, and it can be saved
+    Compression compression;
+    char* input; // NOTE(sen) Read but not decompressed yet, or the first bytes that were looked at
+    usize inputLen;
+    usize inputPos;
+    b32 inFrame; // NOTE(sen) Part way through a gzip member or zstd frame
+    z_stream zlib;
+    void* zstd;
+    char* base;
+    usize size; // NOTE(sen) Updated by the read thread
+    b32 ended; // NOTE(sen) Set by the read thread
+    char error[64]; // NOTE(sen) What stopped the reading, empty at the end of the input
+    b32 errorShown;
+    usize sizeSeen; // NOTE(sen) What the rows were last made from
+    i32 spillFd; // NOTE(sen) -1 while everything is in memory
+    i32 wakeFds[2]; // NOTE(sen) The read thread writes to this whenever there is more
+    f64 lastFrameTime;
+    pthread_t thread;
+    pthread_mutex_t mutex;
+    pthread_cond_t progress;
+} Stream;
+
+typedef void (*TaskFunction)(void* task);
+
+// NOTE(sen) Fixed set of threads that run batches of tasks, the calling thread helps out and
+// `poolRun` returns once every task in the batch is done
+typedef struct WorkerPool {
+    i32 nThreads;
+    pthread_t* threads;
+    pthread_mutex_t mutex;
+    pthread_cond_t workAvailable;
+    pthread_cond_t workDone;
+    TaskFunction taskFunction;
+    char* tasks;
+    usize taskSize;
+    i32 nTasks;
+    i32 nextTask;
+    i32 nTasksDone;
+} WorkerPool;
+
+global WorkerPool WORKER_POOL;
+
+// NOTE(sen) Below this much to scan a search doesn't bother with other threads
+#define FIND_PARALLEL_MIN_BYTES (1 << 20)
+
+// NOTE(sen) A piece of a search, either rows of a loaded block or raw bytes of unloaded blocks
+typedef struct FindTask {
+    char* needle;
+    i32 needleLen;
+    i32 taskIndex;
+    i32* firstFoundTask; // NOTE(sen) Shared between the pieces, lowest piece with a match so far
+    Row* rows;
+    i32 nRows;
+    i32 firstRow;
+    char* bytes;
+    usize bytesLen;
+    i32 blockStart;
+    i32 blockEnd;
+    b32 found;
+    i32 matchRow;
+    i32 matchX;
+    char* matchByte;
+} FindTask;
+
+// NOTE(sen) Files that can't be mapped are read whole and split into rows in pieces of at least this
+#define LOAD_PARALLEL_MIN_BYTES (1 << 20)
+
+// NOTE(sen) A piece of a file being split into rows. Pieces are moved to start right after a
+// newline so that each holds whole lines, `firstRow` is the row of its first line.
+typedef struct LoadTask {
+    char* chars;
+    usize len;
+    usize start;
+    usize end;
+    i64 firstRow;
+    i64 nRows;
+    RowBlock* blocks;
+} LoadTask;
+
+typedef struct GotoLineState {
+    b32 active;
+    char digits[12];
+    i32 nDigits;
+} GotoLineState;
+
+typedef struct FindState {
+    b32 active;
+    char query[64];
+    i32 queryLen;
+    // NOTE(sen) Where to go back to when the search is cancelled
+    i32 savedCursorY;
+    i32 savedCursorFileX;
+    i32 savedRowOffset;
+    i32 savedColOffset;
+    i32 savedWrapOffset;
+    b32 found;
+} FindState;
+
+// NOTE(sen) Replace-all patterns are compiled once to a DFA so matching never backtracks. The
+// pattern is parsed into a Thompson NFA first, its nodes are in an array and point to each other by index.
+typedef enum RegexNodeKind {
+    RegexNodeKind_Empty,
+    RegexNodeKind_Bytes,
+    RegexNodeKind_Split,
+    RegexNodeKind_LineStart,
+    RegexNodeKind_LineEnd,
+    RegexNodeKind_Match,
+} RegexNodeKind;
+
+typedef struct RegexNode {
+    RegexNodeKind kind;
+    i32 out;
+    i32 out1; // NOTE(sen) Second way out of a split
+    u64 bytes[4]; // NOTE(sen) What a `Bytes` node takes, one bit per byte value
+} RegexNode;
+
+// NOTE(sen) Piece of the NFA with one way in and one way out, the `out` of `end` is left for the caller
+typedef struct RegexFragment {
+    i32 start;
+    i32 end;
+} RegexFragment;
+
+typedef struct RegexParser {
+    char* pattern;
+    i32 len;
+    i32 at;
+    RegexNode* nodes;
+    i32 nNodes;
+    i32 nodesCap;
+    char* error;
+    b32 reverse; // NOTE(sen) Build the NFA for the pattern read backwards
+} RegexParser;
+
+#define REGEX_MAX_DFA_STATES 4096
+#define REGEX_ACCEPT 1 // NOTE(sen) A match ends in the state
+#define REGEX_ACCEPT_AT_END 2 // NOTE(sen) A match ends in the state if it's also the end of the row
+
+// NOTE(sen) State 0 is dead, nothing gets out of it. Once built, states are numbered so that the
+// ones where a match ends come last and are stored premultiplied by `nClasses`, so following a
+// byte is one lookup and checking for a match is one compare.
+typedef struct RegexDfa {
+    i32 nStates;
+    i32* next; // NOTE(sen) One per byte class for every state
+    u8* accept;
+    i32 firstAccept;
+    i32 startLine; // NOTE(sen) Start at the start of a row, where `^` matches
+    i32 startMid;
+} RegexDfa;
+
+// NOTE(sen) Bytes that the pattern doesn't tell apart share a class
+typedef struct Regex {
+    u8 byteClass[256];
+    i32 nClasses;
+    RegexDfa anchored; // NOTE(sen) Matches that start where matching starts
+    RegexDfa search; // NOTE(sen) Matches that start anywhere, stops where the first one ends
+    RegexDfa reverse; // NOTE(sen) The pattern backwards run back from the end of a row, accepts where a match starts
+} Regex;
+
+// NOTE(sen) State sets of the DFA being built are kept in `sets` and found again through `table`
+typedef struct RegexBuilder {
+    RegexNode* nodes;
+    i32 nNodes;
+    i32 start;
+    i32* marks;
+    i32 generation;
+    i32* stack;
+    i32* seeds;
+    i32* closure;
+    i32* endClosure;
+    i32* sets;
+    usize setsLen;
+    usize setsCap;
+    usize* setStarts; // NOTE(sen) Set of state k is [setStarts[k], setStarts[k + 1])
+    i32* table;
+} RegexBuilder;
+
+// NOTE(sen) Rows of one block to replace matches in, either loaded rows or the block's lines in
+// the mapping. Every row with a match gets a `ReplaceEdit` in `edits`.
+typedef struct ReplaceTask {
+    Regex* regex;
+    char* replacement;
+    i32 replacementLen;
+    Row* rows;
+    i32 nRows;
+    char* bytes;
+    char* bytesEnd;
+    i32 firstRow;
+    char* edits;
+    usize editsLen;
+    usize editsCap;
+    i32 nMatches;
+    u64* starts; // NOTE(sen) Bit per position of the row being replaced in, set where a match starts
+    i32 startsCap;
+} ReplaceTask;
+
+// NOTE(sen) Characters [x, endX) of the row become the `len` characters that follow the edit
+typedef struct ReplaceEdit {
+    i32 row;
+    i32 x;
+    i32 endX;
+    i32 len;
+} ReplaceEdit;
+
+typedef struct ReplaceState {
+    b32 active;
+    b32 compiled; // NOTE(sen) The pattern is done, now asking for the replacement
+    char pattern[64];
+    i32 patternLen;
+    char replacement[64];
+    i32 replacementLen;
+    char* error;
+    Regex regex;
+} ReplaceState;
+
+// NOTE(sen) Edits are journaled as the text that went in or came out between two positions,
+// newlines in the text are row breaks. `end` is where the text ends once it's in the file.
+typedef enum UndoKind {
+    UndoKind_Insert,
+    UndoKind_Delete,
+} UndoKind;
+
+typedef struct UndoRecord {
+    UndoKind kind;
+    i32 y;
+    i32 x;
+    i32 endY;
+    i32 endX;
+    i32 textLen;
+    b32 joined; // NOTE(sen) Undone and redone together with the record before it
+    // NOTE(sen) Followed by the text and then the size of the whole record so the journal can be
+    // walked backwards
+} UndoRecord;
+
+// NOTE(sen) Records are packed into chunks, a chunk is only ever freed as a whole
+#define UNDO_CHUNK_BYTES (64 << 10)
+#define UNDO_DEFAULT_MAX_BYTES (64 << 20)
+
+// NOTE(sen) Typing and backspacing runs merge into one record up to this much text
+#define UNDO_COALESCE_MAX 4096
+
+typedef struct UndoChunk {
+    struct UndoChunk* prev;
+    struct UndoChunk* next;
+    usize cap;
+    usize used;
+    char data[];
+} UndoChunk;
+
+// NOTE(sen) Records before (`current`, `offset`) are applied, the ones after it can be redone
+typedef struct UndoJournal {
+    UndoChunk* first;
+    UndoChunk* current;
+    usize offset;
+    usize bytes;
+    usize maxBytes; // NOTE(sen) The oldest steps go first once the journal is bigger than this
+    b32 sealed; // NOTE(sen) The next record must not merge into the last one
+} UndoJournal;
+
+// NOTE(sen) Unsaved edits are appended to a swap file next to the document so that they survive a
+// crash. Records are the `UndoRecord` header followed by the text, collected in memory and written
+// out together at most every `SWAP_COMMIT_SECONDS`.
+#define SWAP_MAGIC "KILOSWP2"
+#define SWAP_COMMIT_SECONDS 1.0
+
+// NOTE(sen) The edits only apply to the version of the document the header describes
+typedef struct SwapHeader {
+    char magic[8];
+    u64 fileSize;
+    i64 mtimeSec;
+    i64 mtimeNsec;
+} SwapHeader;
+
+typedef struct SwapFile {
+    b32 enabled;
+    i32 fd; // NOTE(sen) -1 until the first commit
+    char filename[PATH_MAX + 16];
+    SwapHeader header;
+    AppendBuffer pending;
+    f64 pendingSince;
+    usize committedBytes; // NOTE(sen) Of records, after the header
+    usize saveMark; // NOTE(sen) Records before this are in the save that's running
+} SwapFile;
+
+// NOTE(sen) Swap file of the buffer being edited
+global SwapFile* SWAP_FILE;
+
+// NOTE(sen) One per file on the command line. Everything about a document lives here so that
+// switching buffers only changes which one the main loop looks at. Row text of all of them comes
+// from `TEXT_POOL`.
+typedef struct Buffer {
+    EditorState state;
+    UndoJournal undo;
+    SwapFile swap;
+    SaveJob save;
+    char* filename;
+    usize fileSize;
+} Buffer;
+
 enum EditorKey {
+    Key_None = 0,
     Key_Backspace = 127,
     Key_ArrowLeft = 1000,
     Key_ArrowRight,
@@ -74,137 +831,5709 @@ enum EditorKey {
     Key_Home,
     Key_End,
     Key_Delete,
+    Key_Paste, // NOTE(sen) The pasted text is in `InputState.paste`
+};
+
+typedef struct EscapeSequence {
+    char* chars;
+    i32 key;
+} EscapeSequence;
+
+global EscapeSequence ESCAPE_SEQUENCES[] = {
+    {"\x1b[A", Key_ArrowUp},
+    {"\x1b[B", Key_ArrowDown},
+    {"\x1b[C", Key_ArrowRight},
+    {"\x1b[D", Key_ArrowLeft},
+    {"\x1bOA", Key_ArrowUp},
+    {"\x1bOB", Key_ArrowDown},
+    {"\x1bOC", Key_ArrowRight},
+    {"\x1bOD", Key_ArrowLeft},
+    {"\x1b[H", Key_Home},
+    {"\x1b[F", Key_End},
+    {"\x1bOH", Key_Home},
+    {"\x1bOF", Key_End},
+    {"\x1b[1~", Key_Home},
+    {"\x1b[7~", Key_Home},
+    {"\x1b[4~", Key_End},
+    {"\x1b[8~", Key_End},
+    {"\x1b[3~", Key_Delete},
+    {"\x1b[5~", Key_PageUp},
+    {"\x1b[6~", Key_PageDown},
+    {"\x1b[200~", Key_Paste},
+};
+
+global char* PASTE_END = "\x1b[201~";
+
+// NOTE(sen) How long to wait for the rest of an escape sequence before deciding it's a lone escape
+#define ESCAPE_TIMEOUT_MS 50
+
+typedef struct InputState {
+    char buf[4096];
+    i32 len;
+    i32 pos;
+    b32 inPaste;
+    AppendBuffer paste;
+    b32 replaying; // NOTE(sen) Bytes come from a replay script, nothing more will arrive mid-batch
+} InputState;
+
+// NOTE(sen) Headless runs replay a script of keys and time every frame, see `replayLoad` for the
+// script format. Frames are grouped by the script command that caused them.
+#define REPLAY_MAX_GROUPS 64
+
+typedef struct ReplayGroup {
+    char label[32];
+    f64* latencies; // NOTE(sen) Seconds from the keys arriving to their frame being written
+    i32 nLatencies;
+    i32 latenciesCap;
+    u64 frameBytes;
+    u64 allocations;
+} ReplayGroup;
+
+typedef struct ReplayEvent {
+    i32 group;
+    i32 bytesStart;
+    i32 bytesLen;
+    b32 paste; // NOTE(sen) The bytes are pasted text rather than keys
+} ReplayEvent;
+
+typedef struct Replay {
+    b32 active;
+    ReplayGroup groups[REPLAY_MAX_GROUPS];
+    i32 nGroups;
+    ReplayEvent* events;
+    i32 nEvents;
+    i32 eventsCap;
+    i32 nextEvent;
+    AppendBuffer bytes;
+    i32 timedGroup; // NOTE(sen) Group of the frame being timed, -1 if there isn't one
+    f64 timedStart;
+    u64 timedAllocations;
+    i32 nSaves;
+    f64 saveSeconds;
+    usize saveBytes;
+} Replay;
+
+function void
+die(char* message) {
+    write(STDOUT_FILENO, "\x1b[2J", 4);
+    write(STDOUT_FILENO, "\x1b[H", 3);
+    perror(message);
+    printf("\r");
+    exit(1);
+}
+
+function f64
+getTimeSeconds() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    f64 result = (f64)ts.tv_sec + (f64)ts.tv_nsec / 1e9;
+    return result;
+}
+
+// NOTE(sen) Makes room for `len` more bytes, false if that couldn't be allocated
+function b32
+abReserve(AppendBuffer* ab, i32 len) {
+    b32 result = ab->len + len <= ab->cap;
+    if (!result) {
+        i32 cap = ab->cap ? ab->cap : 256;
+        while (cap < ab->len + len) {
+            cap = cap <= INT32_MAX / 2 ? cap * 2 : ab->len + len;
+        }
+        PROFILER.appendReallocs++;
+        char* new = realloc(ab->buf, cap);
+        if (new) {
+            ab->buf = new;
+            ab->cap = cap;
+            result = true;
+        }
+    }
+    return result;
+}
+
+function void
+abAppend(AppendBuffer* ab, char* string, i32 len) {
+    if (len > 0 && abReserve(ab, len)) {
+        memcpy(ab->buf + ab->len, string, len);
+        ab->len += len;
+    }
+}
+
+// NOTE(sen) `count` copies of `c`, for padding
+function void
+abAppendFill(AppendBuffer* ab, char c, i32 count) {
+    if (count > 0 && abReserve(ab, count)) {
+        memset(ab->buf + ab->len, c, count);
+        ab->len += count;
+    }
+}
+
+function void
+abReset(AppendBuffer* ab) {
+    ab->len = 0;
+}
+
+function void
+abSet(AppendBuffer* ab, AppendBuffer* source) {
+    abReset(ab);
+    abAppend(ab, source->buf, source->len);
+}
+
+function b32
+abEqual(AppendBuffer* ab1, AppendBuffer* ab2) {
+    b32 result = ab1->len == ab2->len && memcmp(ab1->buf, ab2->buf, ab1->len) == 0;
+    return result;
+}
+
+function i32
+clamp(i32 value, i32 min, i32 max) {
+    i32 result = value;
+    if (value < min) {
+        result = min;
+    } else if (value > max) {
+        result = max;
+    }
+    return result;
+}
+
+function i32
+gbLen(GapBuffer* gb) {
+    i32 result = gb->cap - (gb->gapEnd - gb->gapStart);
+    return result;
+}
+
+function char
+gbAt(GapBuffer* gb, i32 index) {
+    assert(index >= 0 && index < gbLen(gb));
+    char result = index < gb->gapStart ? gb->buf[index] : gb->buf[index + gb->gapEnd - gb->gapStart];
+    return result;
+}
+
+function GapBuffer
+gbBorrow(char* chars, i32 len) {
+    GapBuffer result = {.buf = chars, .cap = len, .gapStart = len, .gapEnd = len, .borrowed = true};
+    return result;
+}
+
+// NOTE(sen) Smallest size class that holds `size`, `TEXT_N_CLASSES` if none does
+function i32
+textSizeClass(i32 size) {
+    i32 result = 0;
+    while (result < TEXT_N_CLASSES && (TEXT_MIN_CLASS_BYTES << result) < size) {
+        result++;
+    }
+    return result;
+}
+
+// NOTE(sen) At least `size` bytes of row text, `cap` is how much there really is
+function char*
+textAlloc(i32 size, i32* cap) {
+    TextPool* pool = &TEXT_POOL;
+    i32 sizeClass = textSizeClass(size);
+    char* result;
+    if (sizeClass < TEXT_N_CLASSES) {
+        *cap = TEXT_MIN_CLASS_BYTES << sizeClass;
+        result = pool->freeLists[sizeClass];
+        if (result) {
+            pool->freeLists[sizeClass] = *(char**)result;
+        } else {
+            if (!pool->slab || pool->slabUsed + *cap > TEXT_SLAB_BYTES) {
+                // NOTE(sen) What's left of the old slab is too small for this class and stays unused
+                pool->slab = malloc(TEXT_SLAB_BYTES);
+                pool->slabUsed = 0;
+            }
+            result = pool->slab + pool->slabUsed;
+            pool->slabUsed += *cap;
+        }
+    } else {
+        *cap = size;
+        result = malloc(size);
+    }
+    return result;
+}
+
+function void
+textFree(char* text, i32 cap) {
+    i32 sizeClass = textSizeClass(cap);
+    if (sizeClass < TEXT_N_CLASSES && (TEXT_MIN_CLASS_BYTES << sizeClass) == cap) {
+        *(char**)text = TEXT_POOL.freeLists[sizeClass];
+        TEXT_POOL.freeLists[sizeClass] = text;
+    } else {
+        free(text);
+    }
+}
+
+// NOTE(sen) Make sure the gap can hold `extra` more characters, copies borrowed buffers
+function void
+gbReserve(GapBuffer* gb, i32 extra) {
+    i32 gapLen = gb->gapEnd - gb->gapStart;
+    if (gapLen < extra || gb->borrowed) {
+        i32 len = gbLen(gb);
+        i32 newCap = gb->cap * 2;
+        if (newCap < len + extra + 16) {
+            newCap = len + extra + 16;
+        }
+        char* newBuf = textAlloc(newCap, &newCap);
+        i32 tailLen = gb->cap - gb->gapEnd;
+        memcpy(newBuf, gb->buf, gb->gapStart);
+        memcpy(newBuf + newCap - tailLen, gb->buf + gb->gapEnd, tailLen);
+        if (!gb->borrowed && gb->buf) {
+            textFree(gb->buf, gb->cap);
+        }
+        gb->buf = newBuf;
+        gb->gapEnd = newCap - tailLen;
+        gb->cap = newCap;
+        gb->borrowed = false;
+    }
+}
+
+function void
+gbMoveGap(GapBuffer* gb, i32 offset) {
+    assert(offset >= 0 && offset <= gbLen(gb));
+    if (offset != gb->gapStart) {
+        gbReserve(gb, 0);
+        if (offset < gb->gapStart) {
+            i32 moveLen = gb->gapStart - offset;
+            memmove(gb->buf + gb->gapEnd - moveLen, gb->buf + offset, moveLen);
+            gb->gapStart -= moveLen;
+            gb->gapEnd -= moveLen;
+        } else {
+            i32 moveLen = offset - gb->gapStart;
+            memmove(gb->buf + gb->gapStart, gb->buf + gb->gapEnd, moveLen);
+            gb->gapStart += moveLen;
+            gb->gapEnd += moveLen;
+        }
+    }
+}
+
+// NOTE(sen) Opens `len` characters at `offset` and returns them for the caller to fill
+function char*
+gbInsertSpace(GapBuffer* gb, i32 offset, i32 len) {
+    gbReserve(gb, len);
+    gbMoveGap(gb, offset);
+    char* result = gb->buf + gb->gapStart;
+    gb->gapStart += len;
+    return result;
+}
+
+function void
+gbInsert(GapBuffer* gb, i32 offset, char* chars, i32 len) {
+    char* dest = gbInsertSpace(gb, offset, len);
+    memcpy(dest, chars, len);
+}
+
+function void
+gbDelete(GapBuffer* gb, i32 offset, i32 len) {
+    assert(offset >= 0 && offset + len <= gbLen(gb));
+    gbMoveGap(gb, offset);
+    gb->gapEnd += len;
+}
+
+// NOTE(sen) Moves the gap out of the way so that the characters are one contiguous block
+function char*
+gbContiguous(GapBuffer* gb) {
+    gbMoveGap(gb, gbLen(gb));
+    char* result = gb->buf;
+    return result;
+}
+
+function void
+gbFree(GapBuffer* gb) {
+    if (!gb->borrowed && gb->buf) {
+        textFree(gb->buf, gb->cap);
+    }
+    memset(gb, 0, sizeof(GapBuffer));
+}
+
+function i32
+gbCountChar(GapBuffer* gb, i32 from, i32 to, char ch) {
+    i32 result = 0;
+    for (i32 segment = 0; segment < 2; segment++) {
+        // NOTE(sen) Logical range of the segment and where it starts in `buf`
+        i32 segmentStart = segment == 0 ? 0 : gb->gapStart;
+        i32 segmentEnd = segment == 0 ? gb->gapStart : gbLen(gb);
+        char* segmentChars = segment == 0 ? gb->buf : gb->buf + gb->gapEnd - gb->gapStart;
+        i32 rangeStart = from > segmentStart ? from : segmentStart;
+        i32 rangeEnd = to < segmentEnd ? to : segmentEnd;
+        if (rangeStart < rangeEnd) {
+            char* chars = segmentChars + rangeStart;
+            char* end = segmentChars + rangeEnd;
+            while ((chars = memchr(chars, ch, end - chars))) {
+                result++;
+                chars++;
+            }
+        }
+    }
+    return result;
+}
+
+// NOTE(sen) Rows are UTF-8. Bytes that don't decode are characters of their own, one column wide.
+#define UTF8_INVALID 0xFFFFFFFF
+
+// NOTE(sen) Sorted ranges of codepoints that take up no columns (combining marks, joiners) and two
+// columns (East Asian wide and fullwidth, emoji), a small version of `wcwidth` that doesn't depend on
+// the locale
+global u32 ZERO_WIDTH_RANGES[][2] = {
+    {0x0300, 0x036F}, {0x0483, 0x0489}, {0x0591, 0x05BD}, {0x05BF, 0x05BF}, {0x05C1, 0x05C2},
+    {0x05C4, 0x05C5}, {0x05C7, 0x05C7}, {0x0610, 0x061A}, {0x064B, 0x065F}, {0x0670, 0x0670},
+    {0x06D6, 0x06DC}, {0x06DF, 0x06E4}, {0x06E7, 0x06E8}, {0x06EA, 0x06ED}, {0x0711, 0x0711},
+    {0x0730, 0x074A}, {0x07A6, 0x07B0}, {0x07EB, 0x07F3}, {0x0816, 0x082D}, {0x0900, 0x0902},
+    {0x093A, 0x093A}, {0x093C, 0x093C}, {0x0941, 0x0948}, {0x094D, 0x094D}, {0x0951, 0x0957},
+    {0x0962, 0x0963}, {0x0981, 0x0981}, {0x09BC, 0x09BC}, {0x09C1, 0x09C4}, {0x09CD, 0x09CD},
+    {0x0A01, 0x0A02}, {0x0A3C, 0x0A3C}, {0x0A41, 0x0A51}, {0x0A70, 0x0A71}, {0x0E31, 0x0E31},
+    {0x0E34, 0x0E3A}, {0x0E47, 0x0E4E}, {0x0EB1, 0x0EB1}, {0x0EB4, 0x0EBC}, {0x0EC8, 0x0ECD},
+    {0x0F18, 0x0F19}, {0x0F35, 0x0F35}, {0x0F37, 0x0F37}, {0x0F39, 0x0F39}, {0x0F71, 0x0F7E},
+    {0x0F80, 0x0F84}, {0x1160, 0x11FF}, {0x135D, 0x135F}, {0x1712, 0x1714}, {0x17B4, 0x17B5},
+    {0x17B7, 0x17BD}, {0x17C6, 0x17C6}, {0x17C9, 0x17D3}, {0x180B, 0x180F}, {0x1AB0, 0x1AFF},
+    {0x1DC0, 0x1DFF}, {0x200B, 0x200F}, {0x202A, 0x202E}, {0x2060, 0x2064}, {0x20D0, 0x20FF},
+    {0x302A, 0x302D}, {0x3099, 0x309A}, {0xFE00, 0xFE0F}, {0xFE20, 0xFE2F}, {0xFEFF, 0xFEFF},
+    {0x1D167, 0x1D169}, {0x1D173, 0x1D182}, {0xE0001, 0xE0001}, {0xE0020, 0xE007F}, {0xE0100, 0xE01EF},
 };
 
-function void
-die(char* message) {
-    write(STDOUT_FILENO, "\x1b[2J", 4);
-    write(STDOUT_FILENO, "\x1b[H", 3);
-    perror(message);
-    printf("\r");
-    exit(1);
+global u32 DOUBLE_WIDTH_RANGES[][2] = {
+    {0x1100, 0x115F}, {0x231A, 0x231B}, {0x2329, 0x232A}, {0x23E9, 0x23EC}, {0x23F0, 0x23F0},
+    {0x23F3, 0x23F3}, {0x25FD, 0x25FE}, {0x2614, 0x2615}, {0x2648, 0x2653}, {0x267F, 0x267F},
+    {0x2693, 0x2693}, {0x26A1, 0x26A1}, {0x26AA, 0x26AB}, {0x26BD, 0x26BE}, {0x26C4, 0x26C5},
+    {0x26CE, 0x26CE}, {0x26D4, 0x26D4}, {0x26EA, 0x26EA}, {0x26F2, 0x26F3}, {0x26F5, 0x26F5},
+    {0x26FA, 0x26FA}, {0x26FD, 0x26FD}, {0x2705, 0x2705}, {0x270A, 0x270B}, {0x2728, 0x2728},
+    {0x274C, 0x274C}, {0x274E, 0x274E}, {0x2753, 0x2755}, {0x2757, 0x2757}, {0x2795, 0x2797},
+    {0x27B0, 0x27B0}, {0x27BF, 0x27BF}, {0x2B1B, 0x2B1C}, {0x2B50, 0x2B50}, {0x2B55, 0x2B55},
+    {0x2E80, 0x303E}, {0x3041, 0x33FF}, {0x3400, 0x4DBF}, {0x4E00, 0x9FFF}, {0xA000, 0xA4CF},
+    {0xA960, 0xA97F}, {0xAC00, 0xD7A3}, {0xF900, 0xFAFF}, {0xFE10, 0xFE19}, {0xFE30, 0xFE6F},
+    {0xFF00, 0xFF60}, {0xFFE0, 0xFFE6}, {0x16FE0, 0x16FE4}, {0x17000, 0x18CFF}, {0x1B000, 0x1B2FF},
+    {0x1F004, 0x1F004}, {0x1F0CF, 0x1F0CF}, {0x1F18E, 0x1F18E}, {0x1F191, 0x1F19A}, {0x1F200, 0x1F251},
+    {0x1F300, 0x1F64F}, {0x1F680, 0x1F6FF}, {0x1F7E0, 0x1F7EB}, {0x1F90C, 0x1F9FF}, {0x1FA70, 0x1FAFF},
+    {0x20000, 0x2FFFD}, {0x30000, 0x3FFFD},
+};
+
+function b32
+codepointInRanges(u32 codepoint, u32 (*ranges)[2], i32 nRanges) {
+    i32 low = 0;
+    i32 high = nRanges - 1;
+    b32 result = false;
+    while (low <= high && !result) {
+        i32 mid = (low + high) / 2;
+        if (codepoint < ranges[mid][0]) {
+            high = mid - 1;
+        } else if (codepoint > ranges[mid][1]) {
+            low = mid + 1;
+        } else {
+            result = true;
+        }
+    }
+    return result;
+}
+
+// NOTE(sen) Columns a character takes up, `codepoint` is `UTF8_INVALID` for bytes that didn't decode
+function i32
+charWidth(u32 codepoint, char tabChar, i32 replacementsPerTab) {
+    i32 result = 1;
+    if (codepoint == (u8)tabChar) {
+        result = replacementsPerTab;
+    } else if (codepoint < 0x300 || codepoint == UTF8_INVALID) {
+        result = 1;
+    } else if (codepointInRanges(codepoint, ZERO_WIDTH_RANGES, sizeof(ZERO_WIDTH_RANGES) / sizeof(ZERO_WIDTH_RANGES[0]))) {
+        result = 0;
+    } else if (codepointInRanges(codepoint, DOUBLE_WIDTH_RANGES, sizeof(DOUBLE_WIDTH_RANGES) / sizeof(DOUBLE_WIDTH_RANGES[0]))) {
+        result = 2;
+    }
+    return result;
+}
+
+// NOTE(sen) Decode the character at `chars`, returns how many bytes it takes. Overlong forms,
+// surrogates and sequences cut short by `len` are invalid.
+function i32
+utf8Decode(char* chars, i32 len, u32* codepoint) {
+    u8 lead = (u8)chars[0];
+    i32 result = 1;
+    *codepoint = lead;
+    if (lead >= 0x80) {
+        i32 seqLen = lead >= 0xC2 && lead <= 0xDF ? 2 : lead >= 0xE0 && lead <= 0xEF ? 3 : lead >= 0xF0 && lead <= 0xF4 ? 4 : 0;
+        u32 value = lead & (0x7F >> seqLen);
+        b32 valid = seqLen > 0 && seqLen <= len;
+        for (i32 byteIndex = 1; byteIndex < seqLen && valid; byteIndex++) {
+            u8 next = (u8)chars[byteIndex];
+            valid = (next & 0xC0) == 0x80;
+            value = (value << 6) | (next & 0x3F);
+        }
+        u32 minValue = seqLen == 2 ? 0x80 : seqLen == 3 ? 0x800 : 0x10000;
+        valid = valid && value >= minValue && value <= 0x10FFFF && !(value >= 0xD800 && value <= 0xDFFF);
+        if (valid) {
+            result = seqLen;
+            // NOTE(sen) C1 controls would be taken as escapes by some terminals, treat them like invalid bytes
+            *codepoint = value >= 0xA0 ? value : UTF8_INVALID;
+        } else {
+            *codepoint = UTF8_INVALID;
+        }
+    }
+    return result;
+}
+
+// NOTE(sen) ASCII rows map bytes to columns one to one so most of the UTF-8 handling is skipped for
+// them. Checked a block at a time.
+function b32
+textIsAscii(char* chars, usize len) {
+    usize pos = 0;
+    b32 result = true;
+#if defined(__x86_64__)
+    for (; pos + 64 <= len && result; pos += 64) {
+        __m128i block = _mm_or_si128(
+            _mm_or_si128(_mm_loadu_si128((__m128i*)(chars + pos)), _mm_loadu_si128((__m128i*)(chars + pos + 16))),
+            _mm_or_si128(_mm_loadu_si128((__m128i*)(chars + pos + 32)), _mm_loadu_si128((__m128i*)(chars + pos + 48)))
+        );
+        result = _mm_movemask_epi8(block) == 0;
+    }
+    for (; pos + 16 <= len && result; pos += 16) {
+        result = _mm_movemask_epi8(_mm_loadu_si128((__m128i*)(chars + pos))) == 0;
+    }
+#else
+    for (; pos + 8 <= len && result; pos += 8) {
+        u64 block;
+        memcpy(&block, chars + pos, 8);
+        result = (block & 0x8080808080808080ull) == 0;
+    }
+#endif
+    for (; pos < len && result; pos++) {
+        result = (u8)chars[pos] < 0x80;
+    }
+    return result;
+}
+
+function b32
+gbIsAscii(GapBuffer* gb, i32 from, i32 to) {
+    b32 result = true;
+    if (from < gb->gapStart) {
+        i32 frontEnd = to < gb->gapStart ? to : gb->gapStart;
+        result = textIsAscii(gb->buf + from, frontEnd - from);
+        from = frontEnd;
+    }
+    if (result && from < to) {
+        result = textIsAscii(gb->buf + from + gb->gapEnd - gb->gapStart, to - from);
+    }
+    return result;
+}
+
+// NOTE(sen) `utf8Decode` on the character at `at`, which doesn't go past `end`
+function i32
+gbDecode(GapBuffer* gb, i32 at, i32 end, u32* codepoint) {
+    assert(at >= 0 && at < end && end <= gbLen(gb));
+    i32 result;
+    i32 segmentEnd = at < gb->gapStart ? gb->gapStart : gbLen(gb);
+    char* chars = at < gb->gapStart ? gb->buf + at : gb->buf + at + gb->gapEnd - gb->gapStart;
+    i32 maxLen = end - at < 4 ? end - at : 4;
+    if ((u8)*chars < 0x80) {
+        *codepoint = (u8)*chars;
+        result = 1;
+    } else if (segmentEnd - at >= maxLen) {
+        result = utf8Decode(chars, maxLen, codepoint);
+    } else {
+        // NOTE(sen) The character goes over the gap
+        char joined[4];
+        for (i32 byteIndex = 0; byteIndex < maxLen; byteIndex++) {
+            joined[byteIndex] = gbAt(gb, at + byteIndex);
+        }
+        result = utf8Decode(joined, maxLen, codepoint);
+    }
+    return result;
+}
+
+// NOTE(sen) Start of the character that ends at `at`
+function i32
+gbCharStart(GapBuffer* gb, i32 at) {
+    assert(at > 0);
+    i32 result = at - 1;
+    while (result > 0 && at - result < 4 && ((u8)gbAt(gb, result) & 0xC0) == 0x80) {
+        result--;
+    }
+    u32 codepoint;
+    if (gbDecode(gb, result, at, &codepoint) != at - result) {
+        result = at - 1;
+    }
+    return result;
+}
+
+function void
+rowFreeColumns(Row* row) {
+    if (row->hasColumns) {
+        free(row->columns->checkpoints);
+        free(row->columns);
+        row->hasColumns = false;
+        row->columns = 0;
+    }
+}
+
+function void
+rowFree(Row* row) {
+    gbFree(&row->fileChars);
+    rowFreeColumns(row);
+}
+
+function void
+abAppendGap(AppendBuffer* ab, GapBuffer* gb, i32 start, i32 len) {
+    assert(start >= 0 && start + len <= gbLen(gb));
+    if (start < gb->gapStart) {
+        i32 frontLen = gb->gapStart - start;
+        if (frontLen > len) {
+            frontLen = len;
+        }
+        abAppend(ab, gb->buf + start, frontLen);
+        start += frontLen;
+        len -= frontLen;
+    }
+    if (len > 0) {
+        abAppend(ab, gb->buf + start + gb->gapEnd - gb->gapStart, len);
+    }
+}
+
+function void
+shadowInit(ScreenShadow* shadow, i32 nLines) {
+    shadow->lines = calloc(nLines, sizeof(AppendBuffer));
+    shadow->nLines = nLines;
+    shadow->valid = false;
+}
+
+// NOTE(sen) Mirror a terminal scroll of the first `nTextLines` lines by `scrollBy` (positive moves
+// content up), lines that come into view are blank
+function void
+shadowScrollText(ScreenShadow* shadow, i32 nTextLines, i32 scrollBy) {
+    assert(abs(scrollBy) < nTextLines);
+    AppendBuffer* lines = shadow->lines;
+    if (scrollBy > 0) {
+        for (i32 lineIndex = 0; lineIndex < nTextLines; lineIndex++) {
+            if (lineIndex + scrollBy < nTextLines) {
+                AppendBuffer temp = lines[lineIndex];
+                lines[lineIndex] = lines[lineIndex + scrollBy];
+                lines[lineIndex + scrollBy] = temp;
+            } else {
+                abReset(lines + lineIndex);
+            }
+        }
+    } else {
+        for (i32 lineIndex = nTextLines - 1; lineIndex >= 0; lineIndex--) {
+            if (lineIndex + scrollBy >= 0) {
+                AppendBuffer temp = lines[lineIndex];
+                lines[lineIndex] = lines[lineIndex + scrollBy];
+                lines[lineIndex + scrollBy] = temp;
+            } else {
+                abReset(lines + lineIndex);
+            }
+        }
+    }
+}
+
+// NOTE(sen) Only emit the line if the terminal isn't showing it already
+function void
+shadowEmitLine(ScreenShadow* shadow, AppendBuffer* out, i32 lineIndex, AppendBuffer* line) {
+    AppendBuffer* shown = shadow->lines + lineIndex;
+    if (!abEqual(shown, line)) {
+        char buf[32];
+        i32 bufLen = snprintf(buf, sizeof(buf), "\x1b[%d;1H", lineIndex + 1);
+        abAppend(out, buf, bufLen);
+        abAppend(out, line->buf, line->len);
+        abAppend(out, "\x1b[K", 3); // NOTE(sen) Clear the rest of the line
+        abSet(shown, line);
+    }
+}
+
+// NOTE(sen) Fenwick trees over the blocks, `tree[1..n]` starts out holding each block's own value
+function void
+fenwickBuild(i32* tree, i32 n) {
+    for (i32 treeIndex = 1; treeIndex <= n; treeIndex++) {
+        i32 parent = treeIndex + (treeIndex & -treeIndex);
+        if (parent <= n) {
+            tree[parent] += tree[treeIndex];
+        }
+    }
+}
+
+function void
+fenwickAdd(i32* tree, i32 n, i32 blockIndex, i32 delta) {
+    for (i32 treeIndex = blockIndex + 1; treeIndex <= n; treeIndex += treeIndex & -treeIndex) {
+        tree[treeIndex] += delta;
+    }
+}
+
+// NOTE(sen) Sum of the first `count` blocks
+function i32
+fenwickPrefix(i32* tree, i32 count) {
+    i32 result = 0;
+    for (i32 treeIndex = count; treeIndex > 0; treeIndex -= treeIndex & -treeIndex) {
+        result += tree[treeIndex];
+    }
+    return result;
+}
+
+// NOTE(sen) Block that `value` falls in and the sum of the blocks before it
+function i32
+fenwickFind(i32* tree, i32 n, i32 value, i32* before) {
+    i32 blockIndex = 0;
+    i32 remaining = value;
+    i32 step = 1;
+    while (step * 2 <= n) {
+        step *= 2;
+    }
+    for (; step > 0 && n > 0; step /= 2) {
+        if (blockIndex + step <= n && tree[blockIndex + step] <= remaining) {
+            blockIndex += step;
+            remaining -= tree[blockIndex];
+        }
+    }
+    *before = value - remaining;
+    return blockIndex;
+}
+
+function void
+rebuildBlockTree(EditorState* state) {
+    for (i32 treeIndex = 1; treeIndex <= state->nBlocks; treeIndex++) {
+        RowBlock* block = state->blocks + treeIndex - 1;
+        if (!block->screenLinesKnown) {
+            block->screenLines = block->nRows;
+        }
+        state->blockTree[treeIndex] = block->nRows;
+        state->wrapTree[treeIndex] = block->screenLines;
+    }
+    fenwickBuild(state->blockTree, state->nBlocks);
+    fenwickBuild(state->wrapTree, state->nBlocks);
+}
+
+// NOTE(sen) Back to counting one screen line per row
+function void
+wrapForgetBlock(EditorState* state, i32 blockIndex) {
+    RowBlock* block = state->blocks + blockIndex;
+    fenwickAdd(state->wrapTree, state->nBlocks, blockIndex, block->nRows - block->screenLines);
+    block->screenLines = block->nRows;
+    block->screenLinesKnown = false;
+}
+
+function void
+blockTreeAdd(EditorState* state, i32 blockIndex, i32 delta) {
+    fenwickAdd(state->blockTree, state->nBlocks, blockIndex, delta);
+    wrapForgetBlock(state, blockIndex);
+}
+
+// NOTE(sen) Number of rows in the first `nBlocks` blocks
+function i32
+blockTreePrefix(EditorState* state, i32 nBlocks) {
+    i32 result = fenwickPrefix(state->blockTree, nBlocks);
+    return result;
+}
+
+// NOTE(sen) Block that holds row `index` and the index of that block's first row
+function i32
+findRowBlock(EditorState* state, i32 index, i32* firstRow) {
+    i32 blockIndex = fenwickFind(state->blockTree, state->nBlocks, index, firstRow);
+    return blockIndex;
+}
+
+function void
+reserveBlocks(EditorState* state, i32 nBlocks) {
+    if (nBlocks > state->blocksCap) {
+        state->blocksCap = state->blocksCap * 2 > nBlocks ? state->blocksCap * 2 : nBlocks + 64;
+        state->blocks = realloc(state->blocks, state->blocksCap * sizeof(RowBlock));
+        state->blockTree = realloc(state->blockTree, (state->blocksCap + 1) * sizeof(i32));
+        state->wrapTree = realloc(state->wrapTree, (state->blocksCap + 1) * sizeof(i32));
+    }
+}
+
+// NOTE(sen) Adds an empty block at the end
+function RowBlock*
+appendBlock(EditorState* state) {
+    reserveBlocks(state, state->nBlocks + 1);
+    i32 treeIndex = ++state->nBlocks;
+    state->blockTree[treeIndex] =
+        blockTreePrefix(state, treeIndex - 1) - blockTreePrefix(state, treeIndex - (treeIndex & -treeIndex));
+    state->wrapTree[treeIndex] =
+        fenwickPrefix(state->wrapTree, treeIndex - 1) - fenwickPrefix(state->wrapTree, treeIndex - (treeIndex & -treeIndex));
+    RowBlock* block = state->blocks + treeIndex - 1;
+    memset(block, 0, sizeof(RowBlock));
+    return block;
+}
+
+// NOTE(sen) Adds an empty block at `blockIndex`
+function RowBlock*
+insertBlock(EditorState* state, i32 blockIndex) {
+    RowBlock* block;
+    if (blockIndex == state->nBlocks) {
+        block = appendBlock(state);
+    } else {
+        reserveBlocks(state, state->nBlocks + 1);
+        block = state->blocks + blockIndex;
+        memmove(block + 1, block, (state->nBlocks - blockIndex) * sizeof(RowBlock));
+        memset(block, 0, sizeof(RowBlock));
+        state->nBlocks++;
+        rebuildBlockTree(state);
+    }
+    return block;
+}
+
+// NOTE(sen) Point `nRows` rows at the lines from `lineStart` on, returns where the next line starts
+function char*
+borrowLines(Row* rows, i32 nRows, char* lineStart, char* end) {
+    for (i32 rowIndex = 0; rowIndex < nRows; rowIndex++) {
+        char* newline = memchr(lineStart, '\n', end - lineStart);
+        i32 linelen = (newline ? newline : end) - lineStart;
+        // NOTE(sen) Trim the final newline
+        while (linelen > 0 && lineStart[linelen - 1] == '\r') {
+            --linelen;
+        }
+        Row* row = rows + rowIndex;
+        row->fileChars = gbBorrow(lineStart, linelen);
+        row->width = -1;
+        lineStart = newline ? newline + 1 : end;
+    }
+    return lineStart;
+}
+
+// NOTE(sen) Rows lose their \r, edited ones are saved with the line ending of the first line.
+// `chars` is the next piece of the file, so the last piece decides whether the file ends in a newline.
+function void
+noteNewline(EditorState* state, char* chars, usize len) {
+    if (state->newlineLen == 0) {
+        char* newline = memchr(chars, '\n', len);
+        if (newline) {
+            state->newlineLen = newline > chars && newline[-1] == '\r' ? 2 : 1;
+        }
+    }
+    if (len > 0) {
+        state->noFinalNewline = chars[len - 1] != '\n';
+    }
+}
+
+function void
+loadRowBlock(EditorState* state, RowBlock* block) {
+    if (!block->loaded) {
+        block->rowsCap = block->nRows > 16 ? block->nRows : 16;
+        block->rows = calloc(block->rowsCap, sizeof(Row));
+        borrowLines(block->rows, block->nRows, state->mapBase + block->mapStart, state->mapBase + block->mapEnd);
+        block->loaded = true;
+    }
+}
+
+function Row*
+getRow(EditorState* state, i32 index) {
+    assert(index >= 0 && index < state->nRows);
+    i32 firstRow;
+    RowBlock* block = state->blocks + findRowBlock(state, index, &firstRow);
+    loadRowBlock(state, block);
+    Row* result = block->rows + index - firstRow;
+    return result;
+}
+
+// NOTE(sen) Blocks that grow past this from edits are split in two
+#define ROW_BLOCK_MAX_ROWS (4 * LINE_INDEX_STRIDE)
+
+function void
+splitRowBlock(EditorState* state, i32 blockIndex) {
+    RowBlock* block = state->blocks + blockIndex;
+    i32 nKeep = block->nRows / 2;
+    i32 nMove = block->nRows - nKeep;
+    Row* movedRows = malloc(nMove * sizeof(Row));
+    memcpy(movedRows, block->rows + nKeep, nMove * sizeof(Row));
+    block->nRows = nKeep;
+    blockTreeAdd(state, blockIndex, -nMove);
+    RowBlock* newBlock = insertBlock(state, blockIndex + 1);
+    newBlock->loaded = true;
+    newBlock->rows = movedRows;
+    newBlock->nRows = nMove;
+    newBlock->rowsCap = nMove;
+    blockTreeAdd(state, blockIndex + 1, nMove);
+}
+
+// NOTE(sen) Only the rows of one block move
+function Row*
+insertRow(EditorState* state, i32 index) {
+    assert(index >= 0 && index <= state->nRows);
+    i32 firstRow;
+    i32 blockIndex;
+    if (index < state->nRows) {
+        blockIndex = findRowBlock(state, index, &firstRow);
+    } else if (state->nBlocks > 0) {
+        blockIndex = state->nBlocks - 1;
+        firstRow = state->nRows - state->blocks[blockIndex].nRows;
+    } else {
+        appendBlock(state)->loaded = true;
+        blockIndex = 0;
+        firstRow = 0;
+    }
+    RowBlock* block = state->blocks + blockIndex;
+    loadRowBlock(state, block);
+    if (block->nRows == block->rowsCap) {
+        block->rowsCap = block->rowsCap * 2 > 16 ? block->rowsCap * 2 : 16;
+        block->rows = realloc(block->rows, block->rowsCap * sizeof(Row));
+    }
+    i32 rowInBlock = index - firstRow;
+    memmove(block->rows + rowInBlock + 1, block->rows + rowInBlock, (block->nRows - rowInBlock) * sizeof(Row));
+    memset(block->rows + rowInBlock, 0, sizeof(Row));
+    block->nRows++;
+    state->nRows++;
+    blockTreeAdd(state, blockIndex, 1);
+    if (block->nRows > ROW_BLOCK_MAX_ROWS) {
+        splitRowBlock(state, blockIndex);
+    }
+    Row* result = getRow(state, index);
+    return result;
+}
+
+function void
+deleteRow(EditorState* state, i32 index) {
+    i32 firstRow;
+    i32 blockIndex = findRowBlock(state, index, &firstRow);
+    RowBlock* block = state->blocks + blockIndex;
+    loadRowBlock(state, block);
+    i32 rowInBlock = index - firstRow;
+    rowFree(block->rows + rowInBlock);
+    memmove(block->rows + rowInBlock, block->rows + rowInBlock + 1, (block->nRows - rowInBlock - 1) * sizeof(Row));
+    block->nRows--;
+    state->nRows--;
+    blockTreeAdd(state, blockIndex, -1);
+}
+
+// NOTE(sen) Like `deleteRow` for a run of rows, the rows of each block they are in move once
+function void
+deleteRows(EditorState* state, i32 index, i32 count) {
+    while (count > 0) {
+        i32 firstRow;
+        i32 blockIndex = findRowBlock(state, index, &firstRow);
+        RowBlock* block = state->blocks + blockIndex;
+        i32 rowInBlock = index - firstRow;
+        i32 nDelete = block->nRows - rowInBlock < count ? block->nRows - rowInBlock : count;
+        if (!block->loaded && nDelete == block->nRows) {
+            // NOTE(sen) Whole blocks nobody looked at are emptied without making their rows, an
+            // empty range doesn't join up with the blocks around it in the mapping
+            block->mapStart = block->mapEnd;
+        } else {
+            loadRowBlock(state, block);
+            for (i32 rowIndex = rowInBlock; rowIndex < rowInBlock + nDelete; rowIndex++) {
+                rowFree(block->rows + rowIndex);
+            }
+            memmove(
+                block->rows + rowInBlock, block->rows + rowInBlock + nDelete,
+                (block->nRows - rowInBlock - nDelete) * sizeof(Row)
+            );
+        }
+        block->nRows -= nDelete;
+        state->nRows -= nDelete;
+        blockTreeAdd(state, blockIndex, -nDelete);
+        count -= nDelete;
+    }
+}
+
+// NOTE(sen) Call after every edit to the row's characters
+function void
+rowCharsChanged(Row* row) {
+    if (!row->hasColumns) {
+        row->renderTag = 0;
+    }
+}
+
+// NOTE(sen) Columns of the character at `at`, `charLen` is how many bytes it takes
+function i32
+gbCharWidth(GapBuffer* gb, i32 at, char tabChar, i32 replacementsPerTab, i32* charLen) {
+    u32 codepoint;
+    *charLen = gbDecode(gb, at, gbLen(gb), &codepoint);
+    i32 result = charWidth(codepoint, tabChar, replacementsPerTab);
+    return result;
+}
+
+// NOTE(sen) `from` has to be a character boundary
+function i32
+gbRenderWidth(GapBuffer* gb, i32 from, i32 to, char tabChar, i32 replacementsPerTab) {
+    i32 result = 0;
+    if (gbIsAscii(gb, from, to)) {
+        result = to - from + gbCountChar(gb, from, to, tabChar) * (replacementsPerTab - 1);
+    } else {
+        for (i32 at = from; at < to;) {
+            u32 codepoint;
+            at += gbDecode(gb, at, to, &codepoint);
+            result += charWidth(codepoint, tabChar, replacementsPerTab);
+        }
+    }
+    return result;
+}
+
+// NOTE(sen) Last checkpoint at or before `target`, a file offset or a render column
+function i32
+columnCheckpointBefore(ColumnIndex* index, i32 target, b32 byRender) {
+    i32 low = 0;
+    i32 high = index->nCheckpoints - 1;
+    while (low < high) {
+        i32 mid = (low + high + 1) / 2;
+        ColumnCheckpoint* checkpoint = index->checkpoints + mid;
+        if ((byRender ? checkpoint->renderX : checkpoint->fileX) <= target) {
+            low = mid;
+        } else {
+            high = mid - 1;
+        }
+    }
+    return low;
+}
+
+// NOTE(sen) Put checkpoints between checkpoint `after` and `untilFileX` so that no two are more
+// than twice the spacing apart
+function void
+columnIndexFill(ColumnIndex* index, GapBuffer* gb, i32 after, i32 untilFileX, char tabChar, i32 replacementsPerTab) {
+    i32 gap = untilFileX - index->checkpoints[after].fileX;
+    i32 nNew = gap > COLUMN_CHECKPOINT_BYTES * 2 ? (gap - 1) / COLUMN_CHECKPOINT_BYTES : 0;
+    if (nNew > 0) {
+        if (index->nCheckpoints + nNew > index->cap) {
+            index->cap = (index->nCheckpoints + nNew) * 2;
+            index->checkpoints = realloc(index->checkpoints, index->cap * sizeof(ColumnCheckpoint));
+        }
+        ColumnCheckpoint* checkpoints = index->checkpoints;
+        memmove(
+            checkpoints + after + 1 + nNew, checkpoints + after + 1,
+            (index->nCheckpoints - after - 1) * sizeof(ColumnCheckpoint)
+        );
+        index->nCheckpoints += nNew;
+        for (i32 newIndex = after + 1; newIndex <= after + nNew; newIndex++) {
+            ColumnCheckpoint prev = checkpoints[newIndex - 1];
+            i32 fileX = prev.fileX + COLUMN_CHECKPOINT_BYTES;
+            // NOTE(sen) Checkpoints go on character boundaries. A fourth continuation byte in a
+            // row can't be inside a character so it's a boundary too.
+            i32 boundary = fileX;
+            while (boundary > fileX - 3 && ((u8)gbAt(gb, boundary) & 0xC0) == 0x80) {
+                boundary--;
+            }
+            if (((u8)gbAt(gb, boundary) & 0xC0) != 0x80) {
+                fileX = boundary;
+            }
+            checkpoints[newIndex].fileX = fileX;
+            checkpoints[newIndex].renderX = prev.renderX + gbRenderWidth(gb, prev.fileX, fileX, tabChar, replacementsPerTab);
+        }
+    }
+}
+
+function void
+rowBuildColumnIndex(Row* row, char tabChar, i32 replacementsPerTab) {
+    ColumnIndex* index = calloc(1, sizeof(ColumnIndex));
+    index->cap = gbLen(&row->fileChars) / COLUMN_CHECKPOINT_BYTES + 16;
+    index->checkpoints = malloc(index->cap * sizeof(ColumnCheckpoint));
+    index->checkpoints[0] = (ColumnCheckpoint) {0, 0};
+    index->nCheckpoints = 1;
+    columnIndexFill(index, &row->fileChars, 0, gbLen(&row->fileChars), tabChar, replacementsPerTab);
+    row->hasColumns = true;
+    row->columns = index;
+}
+
+// NOTE(sen) Rows remember their width until they are edited, so only edited rows with tabs or
+// UTF-8 are measured again. Long UTF-8 rows get their column index on the way and are measured
+// from its last checkpoint.
+function i32
+rowRenderSize(Row* row, char tabChar, i32 replacementsPerTab) {
+    if (row->width < 0) {
+        i32 len = gbLen(&row->fileChars);
+        if (!row->hasColumns) {
+            row->nonAscii = !gbIsAscii(&row->fileChars, 0, len);
+            if (row->nonAscii && len >= COLUMN_INDEX_MIN_BYTES) {
+                rowBuildColumnIndex(row, tabChar, replacementsPerTab);
+            }
+        }
+        if (row->hasColumns) {
+            ColumnIndex* index = row->columns;
+            ColumnCheckpoint last = index->checkpoints[index->nCheckpoints - 1];
+            row->width = last.renderX + gbRenderWidth(&row->fileChars, last.fileX, len, tabChar, replacementsPerTab);
+        } else {
+            row->width = gbRenderWidth(&row->fileChars, 0, len, tabChar, replacementsPerTab);
+        }
+    }
+    return row->width;
+}
+
+// NOTE(sen) Plain rows are ASCII without tabs, their file offsets are their render columns
+function b32
+rowPlain(Row* row, char tabChar, i32 replacementsPerTab) {
+    b32 result = rowRenderSize(row, tabChar, replacementsPerTab) == gbLen(&row->fileChars) && !row->nonAscii;
+    return result;
+}
+
+// NOTE(sen) Plain rows map file offsets to render columns directly and short rows are cheap to
+// scan, so only long rows with tabs or UTF-8 get an index
+function ColumnIndex*
+rowColumnIndex(Row* row, char tabChar, i32 replacementsPerTab) {
+    if (!row->hasColumns && gbLen(&row->fileChars) >= COLUMN_INDEX_MIN_BYTES && !rowPlain(row, tabChar, replacementsPerTab)) {
+        rowBuildColumnIndex(row, tabChar, replacementsPerTab);
+    }
+    ColumnIndex* result = row->hasColumns ? row->columns : 0;
+    return result;
+}
+
+// NOTE(sen) `removedLen` characters at `offset` were replaced by `insertedLen` new ones. The
+// bytes of a UTF-8 character can arrive in separate edits, so instead of adding up the widths of
+// what was removed and inserted the row is measured again up to the first checkpoint after the edit.
+function void
+columnIndexSplice(Row* row, i32 offset, i32 removedLen, i32 insertedLen, char tabChar, i32 replacementsPerTab) {
+    if (row->hasColumns) {
+        ColumnIndex* index = row->columns;
+        i32 first = columnCheckpointBefore(index, offset, false) + 1;
+        i32 kept = first;
+        i32 renderShift = 0;
+        for (i32 checkpointIndex = first; checkpointIndex < index->nCheckpoints; checkpointIndex++) {
+            ColumnCheckpoint checkpoint = index->checkpoints[checkpointIndex];
+            if (checkpoint.fileX > offset + removedLen) {
+                checkpoint.fileX += insertedLen - removedLen;
+                if (kept == first) {
+                    ColumnCheckpoint prev = index->checkpoints[first - 1];
+                    i32 renderX = prev.renderX
+                        + gbRenderWidth(&row->fileChars, prev.fileX, checkpoint.fileX, tabChar, replacementsPerTab);
+                    renderShift = renderX - checkpoint.renderX;
+                }
+                checkpoint.renderX += renderShift;
+                index->checkpoints[kept++] = checkpoint;
+            }
+        }
+        index->nCheckpoints = kept;
+        i32 untilFileX = first < index->nCheckpoints ? index->checkpoints[first].fileX : gbLen(&row->fileChars);
+        columnIndexFill(index, &row->fileChars, first - 1, untilFileX, tabChar, replacementsPerTab);
+    }
+}
+
+// NOTE(sen) Edits to a row's characters go through these so its width, column index and render
+// cache entry stay right. ASCII edits to ASCII rows keep the width up to date, anything else makes
+// the row get measured again.
+function void
+rowInsert(Row* row, i32 offset, char* chars, i32 len, char tabChar, i32 replacementsPerTab) {
+    gbInsert(&row->fileChars, offset, chars, len);
+    if (row->width >= 0 && !row->nonAscii && textIsAscii(chars, len)) {
+        row->width += len + gbCountChar(&row->fileChars, offset, offset + len, tabChar) * (replacementsPerTab - 1);
+    } else {
+        row->width = -1;
+    }
+    columnIndexSplice(row, offset, 0, len, tabChar, replacementsPerTab);
+    rowCharsChanged(row);
+}
+
+function void
+rowDelete(Row* row, i32 offset, i32 len, char tabChar, i32 replacementsPerTab) {
+    if (row->width >= 0 && !row->nonAscii) {
+        row->width -= len + gbCountChar(&row->fileChars, offset, offset + len, tabChar) * (replacementsPerTab - 1);
+    } else {
+        row->width = -1;
+    }
+    gbDelete(&row->fileChars, offset, len);
+    columnIndexSplice(row, offset, len, 0, tabChar, replacementsPerTab);
+    rowCharsChanged(row);
+}
+
+// NOTE(sen) Replace `len` characters at `offset` by building the row's characters again in one go,
+// for edits that touch many places in the row at once. The width and column index are redone too.
+function void
+rowReplace(Row* row, i32 offset, i32 len, char* chars, i32 charsLen, char tabChar, i32 replacementsPerTab) {
+    GapBuffer* gb = &row->fileChars;
+    i32 oldLen = gbLen(gb);
+    char* old = gbContiguous(gb);
+    i32 newLen = oldLen - len + charsLen;
+    i32 cap;
+    char* buf = textAlloc(newLen + 16, &cap);
+    memcpy(buf, old, offset);
+    memcpy(buf + offset, chars, charsLen);
+    memcpy(buf + offset + charsLen, old + offset + len, oldLen - offset - len);
+    gbFree(gb);
+    *gb = (GapBuffer) {.buf = buf, .cap = cap, .gapStart = newLen, .gapEnd = cap};
+    rowFreeColumns(row);
+    row->renderTag = 0;
+    row->width = -1;
+    rowRenderSize(row, tabChar, replacementsPerTab);
+}
+
+// NOTE(sen) The character boundary at or before `target`, a file offset or a render column.
+// Scans from the closest checkpoint on long rows.
+function ColumnCheckpoint
+rowSeekColumn(Row* row, i32 target, b32 byRender, char tabChar, i32 replacementsPerTab) {
+    ColumnCheckpoint result = {0, 0};
+    i32 len = gbLen(&row->fileChars);
+    if (rowPlain(row, tabChar, replacementsPerTab)) {
+        result.fileX = clamp(target, 0, len);
+        result.renderX = result.fileX;
+    } else {
+        ColumnIndex* index = rowColumnIndex(row, tabChar, replacementsPerTab);
+        if (index) {
+            result = index->checkpoints[columnCheckpointBefore(index, target, byRender)];
+        }
+        while (result.fileX < len) {
+            i32 charLen;
+            i32 width = gbCharWidth(&row->fileChars, result.fileX, tabChar, replacementsPerTab, &charLen);
+            if ((byRender ? result.renderX + width : result.fileX + charLen) > target) {
+                break;
+            }
+            result.fileX += charLen;
+            result.renderX += width;
+        }
+    }
+    return result;
+}
+
+// NOTE(sen) Closest character boundary to where the cursor was, the later one on ties
+function void
+makeCursorXValidAfterRowChange(EditorState* state, char tabChar, i32 replacementsPerTab) {
+    ColumnCheckpoint closest = {0, 0};
+    if (state->cursorY < state->nRows) {
+        Row* row = getRow(state, state->cursorY);
+        closest = rowSeekColumn(row, state->cursorRenderX, true, tabChar, replacementsPerTab);
+        if (closest.fileX < gbLen(&row->fileChars)) {
+            i32 charLen;
+            i32 nextRenderX = closest.renderX
+                + gbCharWidth(&row->fileChars, closest.fileX, tabChar, replacementsPerTab, &charLen);
+            if (nextRenderX - state->cursorRenderX <= state->cursorRenderX - closest.renderX) {
+                closest.fileX += charLen;
+                closest.renderX = nextRenderX;
+            }
+        }
+    }
+    state->cursorRenderX = closest.renderX;
+    state->cursorFileX = closest.fileX;
+}
+
+function void
+renderCacheInit(RenderCache* cache, i32 nEntries) {
+    cache->entries = calloc(nEntries, sizeof(RenderCacheEntry));
+    cache->nEntries = nEntries;
+}
+
+// NOTE(sen) C-like highlighting. The lexer only carries block comments from one row to the next.
+typedef enum HighlightState {
+    HighlightState_Unknown, // NOTE(sen) Row hasn't been lexed
+    HighlightState_Normal,
+    HighlightState_BlockComment,
+} HighlightState;
+
+typedef enum Highlight {
+    Highlight_Normal,
+    Highlight_Comment,
+    Highlight_Keyword,
+    Highlight_Type,
+    Highlight_String,
+    Highlight_Number,
+    Highlight_Preprocessor,
+} Highlight;
+
+global i32 HIGHLIGHT_COLORS[] = {39, 36, 33, 32, 35, 31, 34};
+
+global char* HIGHLIGHT_EXTENSIONS[] = {".c", ".h", ".cc", ".cpp", ".cxx", ".hpp", ".hh", ".inl", ".java", ".js", ".ts", ".go", ".rs"};
+
+global char* HIGHLIGHT_KEYWORDS[] = {
+    "if", "else", "for", "while", "do", "switch", "case", "default", "break", "continue", "return",
+    "goto", "sizeof", "typedef", "struct", "union", "enum", "static", "const", "volatile", "extern",
+    "inline", "register", "restrict", "class", "public", "private", "protected", "namespace",
+    "template", "new", "delete", "true", "false", "NULL", "nullptr",
+};
+
+global char* HIGHLIGHT_TYPES[] = {
+    "void", "char", "short", "int", "long", "float", "double", "signed", "unsigned", "bool", "_Bool",
+    "size_t", "ssize_t", "int8_t", "int16_t", "int32_t", "int64_t", "uint8_t", "uint16_t", "uint32_t",
+    "uint64_t", "auto",
+};
+
+// NOTE(sen) Rows with no lexed row this close above them are lexed from there assuming nothing was
+// open, like vim's `syntax sync minlines`
+#define HIGHLIGHT_SYNC_ROWS 256
+
+function b32
+highlightForFilename(char* filename) {
+    b32 result = false;
+    char* extension = strrchr(filename, '.');
+    for (u32 extIndex = 0; extension && extIndex < sizeof(HIGHLIGHT_EXTENSIONS) / sizeof(HIGHLIGHT_EXTENSIONS[0]); extIndex++) {
+        if (strcmp(extension, HIGHLIGHT_EXTENSIONS[extIndex]) == 0) {
+            result = true;
+        }
+    }
+    return result;
+}
+
+function b32
+isWordChar(char ch) {
+    b32 result = isalnum((unsigned char)ch) || ch == '_';
+    return result;
+}
+
+function b32
+wordIn(char* word, i32 len, char** words, i32 nWords) {
+    b32 result = false;
+    for (i32 wordIndex = 0; wordIndex < nWords && !result; wordIndex++) {
+        result = strncmp(words[wordIndex], word, len) == 0 && words[wordIndex][len] == '\0';
+    }
+    return result;
+}
+
+// NOTE(sen) Classify `len` characters starting in `state`, returns the state at the end. `hl` gets
+// one `Highlight` per character and can be 0 when only the state is wanted.
+function i32
+lexHighlight(char* chars, i32 len, i32 state, u8* hl) {
+#define MARK(from, to, highlight) if (hl) { memset(hl + (from), (highlight), (to) - (from)); }
+    i32 index = 0;
+    b32 lineStart = true;
+    while (index < len) {
+        char ch = chars[index];
+        char next = index + 1 < len ? chars[index + 1] : '\0';
+        i32 tokenStart = index;
+        if (state == HighlightState_BlockComment) {
+            while (index < len && !(chars[index] == '*' && index + 1 < len && chars[index + 1] == '/')) {
+                index++;
+            }
+            if (index < len) {
+                index += 2;
+                state = HighlightState_Normal;
+            }
+            MARK(tokenStart, index, Highlight_Comment);
+        } else if (ch == '/' && next == '/') {
+            index = len;
+            MARK(tokenStart, index, Highlight_Comment);
+        } else if (ch == '/' && next == '*') {
+            index += 2;
+            state = HighlightState_BlockComment;
+            MARK(tokenStart, index, Highlight_Comment);
+        } else if (ch == '"' || ch == '\'') {
+            index++;
+            while (index < len && chars[index] != ch) {
+                index += chars[index] == '\\' ? 2 : 1;
+            }
+            index = index < len ? index + 1 : len;
+            MARK(tokenStart, index, Highlight_String);
+        } else if (ch == '#' && lineStart) {
+            index++;
+            while (index < len && isWordChar(chars[index])) {
+                index++;
+            }
+            MARK(tokenStart, index, Highlight_Preprocessor);
+        } else if (isdigit((unsigned char)ch)) {
+            while (index < len && (isWordChar(chars[index]) || chars[index] == '.')) {
+                index++;
+            }
+            MARK(tokenStart, index, Highlight_Number);
+        } else if (isWordChar(ch)) {
+            while (index < len && isWordChar(chars[index])) {
+                index++;
+            }
+            i32 wordLen = index - tokenStart;
+            Highlight highlight = Highlight_Normal;
+            if (wordIn(chars + tokenStart, wordLen, HIGHLIGHT_KEYWORDS, sizeof(HIGHLIGHT_KEYWORDS) / sizeof(char*))) {
+                highlight = Highlight_Keyword;
+            } else if (wordIn(chars + tokenStart, wordLen, HIGHLIGHT_TYPES, sizeof(HIGHLIGHT_TYPES) / sizeof(char*))) {
+                highlight = Highlight_Type;
+            }
+            MARK(tokenStart, index, highlight);
+        } else {
+            index++;
+            MARK(tokenStart, index, Highlight_Normal);
+        }
+        if (!isspace((unsigned char)ch)) {
+            lineStart = false;
+        }
+    }
+    return state;
+#undef MARK
+}
+
+// NOTE(sen) Lex a row for its end state only
+function i32
+highlightRowState(Row* row, i32 startState) {
+    row->hlEndState = lexHighlight(gbContiguous(&row->fileChars), gbLen(&row->fileChars), startState, 0);
+    return row->hlEndState;
+}
+
+function i32
+highlightStartState(EditorState* state, i32 rowIndex) {
+    i32 firstRow = rowIndex;
+    i32 result = HighlightState_Normal;
+    while (firstRow > 0 && rowIndex - firstRow < HIGHLIGHT_SYNC_ROWS) {
+        i32 known = getRow(state, firstRow - 1)->hlEndState;
+        if (known != HighlightState_Unknown) {
+            result = known;
+            break;
+        }
+        firstRow--;
+    }
+    for (i32 lexRow = firstRow; lexRow < rowIndex; lexRow++) {
+        result = highlightRowState(getRow(state, lexRow), result);
+    }
+    return result;
+}
+
+// NOTE(sen) Re-lex edited rows, then the rows after them until one ends up in the state it had
+// before. Rows that were never lexed stop it too, `highlightStartState` takes care of them.
+function void
+highlightEdited(EditorState* state, i32 firstRow, i32 lastRow) {
+    if (state->highlight) {
+        i32 hlState = highlightStartState(state, firstRow);
+        for (i32 rowIndex = firstRow; rowIndex < state->nRows; rowIndex++) {
+            Row* row = getRow(state, rowIndex);
+            i32 oldState = row->hlEndState;
+            hlState = highlightRowState(row, hlState);
+            if (rowIndex > lastRow && (oldState == hlState || oldState == HighlightState_Unknown)) {
+                break;
+            }
+        }
+    }
+}
+
+// NOTE(sen) Call after editing the characters of rows `firstRow` to `lastRow`, adding and removing
+// rows is taken care of by `blockTreeAdd`
+function void
+rowsEdited(EditorState* state, i32 firstRow, i32 lastRow) {
+    highlightEdited(state, firstRow, lastRow);
+    i32 rowIndex = firstRow;
+    while (rowIndex <= lastRow && rowIndex < state->nRows) {
+        i32 blockFirstRow;
+        i32 blockIndex = findRowBlock(state, rowIndex, &blockFirstRow);
+        wrapForgetBlock(state, blockIndex);
+        rowIndex = blockFirstRow + state->blocks[blockIndex].nRows;
+    }
+}
+
+// NOTE(sen) There is always room for the cursor after the last character
+function i32
+rowScreenLines(EditorState* state, i32 index, char tabChar, i32 replacementsPerTab) {
+    i32 result = 1;
+    if (index < state->nRows) {
+        result = rowRenderSize(getRow(state, index), tabChar, replacementsPerTab) / state->wrapCols + 1;
+    }
+    return result;
+}
+
+// NOTE(sen) Start over counting one line per row, for when the width of the screen changes
+function void
+wrapReset(EditorState* state) {
+    state->wrapCols = state->screenCols;
+    for (i32 blockIndex = 0; blockIndex < state->nBlocks; blockIndex++) {
+        state->blocks[blockIndex].screenLinesKnown = false;
+    }
+    rebuildBlockTree(state);
+}
+
+function b32
+wrapMeasureBlock(EditorState* state, i32 blockIndex, char tabChar, i32 replacementsPerTab) {
+    RowBlock* block = state->blocks + blockIndex;
+    b32 result = !block->screenLinesKnown;
+    if (result) {
+        loadRowBlock(state, block);
+        i32 screenLines = 0;
+        for (i32 rowIndex = 0; rowIndex < block->nRows; rowIndex++) {
+            screenLines += rowRenderSize(block->rows + rowIndex, tabChar, replacementsPerTab) / state->wrapCols + 1;
+        }
+        fenwickAdd(state->wrapTree, state->nBlocks, blockIndex, screenLines - block->screenLines);
+        block->screenLines = screenLines;
+        block->screenLinesKnown = true;
+    }
+    return result;
+}
+
+// NOTE(sen) Screen lines above row `index`, its block is measured first
+function i32
+wrapLinesBefore(EditorState* state, i32 index, char tabChar, i32 replacementsPerTab) {
+    i32 result = 0;
+    i32 lastRow = (index < state->nRows ? index : state->nRows) - 1;
+    if (lastRow >= 0) {
+        i32 blockFirstRow;
+        i32 blockIndex = findRowBlock(state, lastRow, &blockFirstRow);
+        wrapMeasureBlock(state, blockIndex, tabChar, replacementsPerTab);
+        result = fenwickPrefix(state->wrapTree, blockIndex);
+        for (i32 rowIndex = blockFirstRow; rowIndex <= lastRow; rowIndex++) {
+            result += rowScreenLines(state, rowIndex, tabChar, replacementsPerTab);
+        }
+    }
+    result += index > state->nRows ? index - state->nRows : 0;
+    return result;
+}
+
+// NOTE(sen) Row `delta` screen lines away from line `subLine` of row `index` and which of its lines
+// that is. Blocks from one to the other are measured first so the tree is exact between them, after
+// that it's a tree search and a scan of one block.
+function i32
+wrapMoveLines(
+    EditorState* state, i32 index, i32 subLine, i32 delta, i32* resultSubLine, char tabChar, i32 replacementsPerTab
+) {
+    i32 result = state->nRows;
+    *resultSubLine = 0;
+    for (b32 measured = state->nRows > 0; measured;) {
+        i32 target = wrapLinesBefore(state, index, tabChar, replacementsPerTab) + subLine + delta;
+        target = target > 0 ? target : 0;
+        i32 targetFirstLine;
+        i32 targetBlock = fenwickFind(state->wrapTree, state->nBlocks, target, &targetFirstLine);
+        i32 indexFirstRow;
+        i32 indexBlock = findRowBlock(state, index < state->nRows ? index : state->nRows - 1, &indexFirstRow);
+        i32 fromBlock = targetBlock < indexBlock ? targetBlock : indexBlock;
+        i32 toBlock = targetBlock > indexBlock ? targetBlock : indexBlock;
+        measured = false;
+        for (i32 blockIndex = fromBlock; blockIndex <= toBlock && blockIndex < state->nBlocks; blockIndex++) {
+            measured |= wrapMeasureBlock(state, blockIndex, tabChar, replacementsPerTab);
+        }
+        if (!measured && targetBlock < state->nBlocks) {
+            i32 remaining = target - targetFirstLine;
+            i32 rowIndex = blockTreePrefix(state, targetBlock);
+            for (;; rowIndex++) {
+                i32 screenLines = rowScreenLines(state, rowIndex, tabChar, replacementsPerTab);
+                if (remaining < screenLines) {
+                    break;
+                }
+                remaining -= screenLines;
+            }
+            result = rowIndex;
+            *resultSubLine = remaining;
+        }
+    }
+    return result;
+}
+
+// NOTE(sen) Screen lines from line `fromSubLine` of row `fromRow` down to line `toSubLine` of row
+// `toRow`, only exact up to `limit`
+function i32
+wrapLinesBetween(
+    EditorState* state, i32 fromRow, i32 fromSubLine, i32 toRow, i32 toSubLine, i32 limit, char tabChar,
+    i32 replacementsPerTab
+) {
+    i32 result = toSubLine - fromSubLine;
+    for (i32 rowIndex = fromRow; rowIndex < toRow && result <= limit; rowIndex++) {
+        result += rowScreenLines(state, rowIndex, tabChar, replacementsPerTab);
+    }
+    return result;
+}
+
+// NOTE(sen) Colour changes only where the highlight changes
+function void
+abAppendHighlighted(AppendBuffer* ab, char* chars, u8* hl, i32 len) {
+    u8 current = Highlight_Normal;
+    i32 runStart = 0;
+    for (i32 index = 0; index <= len; index++) {
+        if (index == len || hl[index] != current) {
+            abAppend(ab, chars + runStart, index - runStart);
+            runStart = index;
+            if (index < len) {
+                current = hl[index];
+                char escape[16];
+                i32 escapeLen = snprintf(escape, sizeof(escape), "\x1b[%dm", HIGHLIGHT_COLORS[current]);
+                abAppend(ab, escape, escapeLen);
+            }
+        }
+    }
+    if (current != Highlight_Normal) {
+        abAppend(ab, "\x1b[39m", 5);
+    }
+}
+
+// NOTE(sen) Render characters of a row, highlighted when `hlStartState` isn't 0. The entry is only
+// good until the next call.
+function RenderCacheEntry*
+constructRenderChars(RenderCache* cache, Row* row, char tabChar, i32 replacementsPerTab, i32 hlStartState) {
+    if (row->renderTag > 0) {
+        RenderCacheEntry* cached = cache->entries + (row->renderTag - 1) % cache->nEntries;
+        if (cached->tag == row->renderTag && cached->hlStartState == hlStartState) {
+            return cached;
+        }
+    }
+    PROFILE_BEGIN(RenderChars);
+
+    // NOTE(sen) Tags of an entry are its index + 1 plus multiples of the number of entries, so the
+    // tag alone says where to look
+    i32 entryIndex = cache->nextEvict;
+    cache->nextEvict = (cache->nextEvict + 1) % cache->nEntries;
+    RenderCacheEntry* entry = cache->entries + entryIndex;
+    entry->tag = entry->tag > 0 ? entry->tag + cache->nEntries : entryIndex + 1;
+    if ((entry->tag - 1) % cache->nEntries != (u32)entryIndex) {
+        entry->tag = entryIndex + 1;
+    }
+    row->renderTag = entry->tag;
+
+    // NOTE(sen) Tabs become spaces, UTF-8 is kept as is and bytes that don't decode become '?'
+    i32 fileLen = gbLen(&row->fileChars);
+    entry->len = fileLen + gbCountChar(&row->fileChars, 0, fileLen, tabChar) * (replacementsPerTab - 1);
+    if (entry->cap < entry->len) {
+        entry->cap = entry->len * 2;
+        entry->chars = realloc(entry->chars, entry->cap);
+        free(entry->hl);
+        entry->hl = 0;
+    }
+
+    char tabReplacement = ' ';
+    i32 renderIndex = 0;
+    for (i32 charIndex = 0; charIndex < fileLen;) {
+        char rowChar = gbAt(&row->fileChars, charIndex);
+        if (rowChar == tabChar) {
+            for (i32 spaceIndex = 0; spaceIndex < replacementsPerTab; ++spaceIndex) {
+                entry->chars[renderIndex++] = tabReplacement;
+            }
+            charIndex++;
+        } else if ((u8)rowChar < 0x80) {
+            entry->chars[renderIndex++] = rowChar;
+            charIndex++;
+        } else {
+            u32 codepoint;
+            i32 charLen = gbDecode(&row->fileChars, charIndex, fileLen, &codepoint);
+            if (codepoint == UTF8_INVALID) {
+                entry->chars[renderIndex++] = '?';
+            } else {
+                for (i32 byteIndex = 0; byteIndex < charLen; byteIndex++) {
+                    entry->chars[renderIndex++] = gbAt(&row->fileChars, charIndex + byteIndex);
+                }
+            }
+            charIndex += charLen;
+        }
+    }
+    assert(renderIndex <= entry->len);
+    entry->len = renderIndex;
+    // NOTE(sen) Tabs are spaces by now which lex the same
+    entry->hlStartState = hlStartState;
+    if (hlStartState != HighlightState_Unknown) {
+        if (!entry->hl) {
+            entry->hl = malloc(entry->cap);
+        }
+        row->hlEndState = lexHighlight(entry->chars, entry->len, hlStartState, entry->hl);
+    }
+    PROFILE_END(RenderChars);
+    return entry;
+}
+
+// NOTE(sen) Render only the visible part of a row instead of all of it
+function void
+abAppendRenderSlice(AppendBuffer* ab, Row* row, i32 start, i32 len, char tabChar, i32 replacementsPerTab) {
+    ColumnCheckpoint at = rowSeekColumn(row, start, true, tabChar, replacementsPerTab);
+    char chunk[256];
+    i32 chunkLen = 0;
+    i32 rowLen = gbLen(&row->fileChars);
+    while (at.fileX < rowLen) {
+        u32 codepoint;
+        i32 charLen = gbDecode(&row->fileChars, at.fileX, rowLen, &codepoint);
+        i32 width = charWidth(codepoint, tabChar, replacementsPerTab);
+        // NOTE(sen) Zero width characters go with the one before them
+        if (at.renderX >= start + len + (width == 0)) {
+            break;
+        }
+        if (codepoint != (u8)tabChar && at.renderX >= start && at.renderX + width <= start + len) {
+            if (chunkLen + 4 > (i32)sizeof(chunk)) {
+                abAppend(ab, chunk, chunkLen);
+                chunkLen = 0;
+            }
+            if (codepoint == UTF8_INVALID) {
+                chunk[chunkLen++] = '?';
+            } else {
+                for (i32 byteIndex = 0; byteIndex < charLen; byteIndex++) {
+                    chunk[chunkLen++] = gbAt(&row->fileChars, at.fileX + byteIndex);
+                }
+            }
+        } else {
+            // NOTE(sen) Tabs and wide characters can be cut off by either edge
+            for (i32 column = at.renderX; column < at.renderX + width; column++) {
+                if (column >= start && column < start + len) {
+                    chunk[chunkLen++] = ' ';
+                    if (chunkLen == (i32)sizeof(chunk)) {
+                        abAppend(ab, chunk, chunkLen);
+                        chunkLen = 0;
+                    }
+                }
+            }
+        }
+        at.fileX += charLen;
+        at.renderX += width;
+    }
+    abAppend(ab, chunk, chunkLen);
+}
+
+// NOTE(sen) Columns [`start`, `start` + `len`) of render characters that have UTF-8 in them. Wide
+// characters cut off by either edge show as spaces.
+function void
+abAppendRenderChars(
+    AppendBuffer* ab, char* chars, u8* hl, i32 nChars, i32 start, i32 len, char tabChar, i32 replacementsPerTab
+) {
+    i32 column = 0;
+    i32 from = 0;
+    i32 padBefore = 0;
+    u32 codepoint;
+    while (from < nChars) {
+        i32 charLen = utf8Decode(chars + from, nChars - from, &codepoint);
+        i32 width = charWidth(codepoint, tabChar, replacementsPerTab);
+        if (column + width > start || (width == 0 && column > start)) {
+            break;
+        }
+        column += width;
+        from += charLen;
+    }
+    if (column < start && from < nChars) {
+        // NOTE(sen) A wide character across the left edge
+        padBefore = column + 2 - start;
+        column += 2;
+        from += utf8Decode(chars + from, nChars - from, &codepoint);
+    }
+    i32 to = from;
+    while (to < nChars) {
+        i32 charLen = utf8Decode(chars + to, nChars - to, &codepoint);
+        i32 width = charWidth(codepoint, tabChar, replacementsPerTab);
+        if (column + width > start + len) {
+            break;
+        }
+        column += width;
+        to += charLen;
+    }
+    i32 padAfter = to < nChars && column < start + len ? start + len - column : 0;
+    abAppendFill(ab, ' ', padBefore);
+    if (hl) {
+        abAppendHighlighted(ab, chars + from, hl + from, to - from);
+    } else {
+        abAppend(ab, chars + from, to - from);
+    }
+    abAppendFill(ab, ' ', padAfter);
+}
+
+function void
+abAppendRender(
+    AppendBuffer* ab, RenderCache* cache, Row* row, i32 start, i32 len, char tabChar, i32 replacementsPerTab,
+    i32 hlStartState
+) {
+    if (rowColumnIndex(row, tabChar, replacementsPerTab)) {
+        // NOTE(sen) Long rows that aren't plain don't go through the cache and aren't highlighted, their
+        // state is only brought up to date when unknown
+        abAppendRenderSlice(ab, row, start, len, tabChar, replacementsPerTab);
+        if (hlStartState != HighlightState_Unknown && row->hlEndState == HighlightState_Unknown) {
+            highlightRowState(row, hlStartState);
+        }
+    } else if (hlStartState == HighlightState_Unknown && rowPlain(row, tabChar, replacementsPerTab)) {
+        abAppendGap(ab, &row->fileChars, start, len);
+    } else {
+        RenderCacheEntry* entry = constructRenderChars(cache, row, tabChar, replacementsPerTab, hlStartState);
+        u8* hl = hlStartState != HighlightState_Unknown ? entry->hl : 0;
+        if (row->nonAscii) {
+            abAppendRenderChars(ab, entry->chars, hl, entry->len, start, len, tabChar, replacementsPerTab);
+        } else if (hl) {
+            abAppendHighlighted(ab, entry->chars + start, hl + start, len);
+        } else {
+            abAppend(ab, entry->chars + start, len);
+        }
+    }
+}
+
+function Row*
+addRow(EditorState* state) {
+    Row* row = insertRow(state, state->nRows);
+    return row;
+}
+
+function i32
+renderXForFileX(Row* row, i32 fileX, char tabChar, i32 replacementsPerTab) {
+    i32 renderX = rowSeekColumn(row, fileX, false, tabChar, replacementsPerTab).renderX;
+    return renderX;
+}
+
+// NOTE(sen) Insert text that may span several lines at the cursor. Every affected row gets one
+// insert and new rows go in at the row gap, so this is linear in the size of the text.
+function void
+insertText(EditorState* state, char* text, i32 textLen, char tabChar, i32 replacementsPerTab) {
+    PROFILE_BEGIN(InsertText);
+    if (state->cursorY == state->nRows) {
+        addRow(state);
+    }
+    i32 firstRow = state->cursorY;
+    Row* row = getRow(state, state->cursorY);
+
+    // NOTE(sen) Whatever was after the cursor ends up after the last inserted line
+    char* tail = 0;
+    i32 tailLen = 0;
+
+    i32 lineStart = 0;
+    for (i32 charIndex = 0; charIndex <= textLen; charIndex++) {
+        b32 atEnd = charIndex == textLen;
+        if (atEnd || text[charIndex] == '\r' || text[charIndex] == '\n') {
+            i32 lineLen = charIndex - lineStart;
+            rowInsert(row, state->cursorFileX, text + lineStart, lineLen, tabChar, replacementsPerTab);
+            state->cursorFileX += lineLen;
+            if (!atEnd) {
+                if (text[charIndex] == '\r' && charIndex + 1 < textLen && text[charIndex + 1] == '\n') {
+                    charIndex++;
+                }
+                lineStart = charIndex + 1;
+                if (!tail) {
+                    tailLen = gbLen(&row->fileChars) - state->cursorFileX;
+                    tail = malloc(tailLen + 1);
+                    memcpy(tail, gbContiguous(&row->fileChars) + state->cursorFileX, tailLen);
+                    rowDelete(row, state->cursorFileX, tailLen, tabChar, replacementsPerTab);
+                }
+                state->cursorY++;
+                state->cursorFileX = 0;
+                row = insertRow(state, state->cursorY);
+            }
+        }
+    }
+    if (tail) {
+        rowInsert(row, gbLen(&row->fileChars), tail, tailLen, tabChar, replacementsPerTab);
+        free(tail);
+    }
+    state->cursorRenderX = renderXForFileX(row, state->cursorFileX, tabChar, replacementsPerTab);
+    state->dirty = true;
+    rowsEdited(state, firstRow, state->cursorY);
+    PROFILE_END(InsertText);
+}
+
+// NOTE(sen) Remove everything from (y, x) up to (endY, endX). The rows in between go in one
+// `deleteRows` so this is linear in the amount of text removed.
+function void
+deleteText(EditorState* state, i32 y, i32 x, i32 endY, i32 endX, char tabChar, i32 replacementsPerTab) {
+    Row* row = getRow(state, y);
+    if (endY == y) {
+        rowDelete(row, x, endX - x, tabChar, replacementsPerTab);
+    } else {
+        Row* lastRow = getRow(state, endY);
+        i32 tailLen = gbLen(&lastRow->fileChars) - endX;
+        char* tail = malloc(tailLen + 1);
+        memcpy(tail, gbContiguous(&lastRow->fileChars) + endX, tailLen);
+        rowDelete(row, x, gbLen(&row->fileChars) - x, tabChar, replacementsPerTab);
+        rowInsert(row, x, tail, tailLen, tabChar, replacementsPerTab);
+        free(tail);
+        deleteRows(state, y + 1, endY - y);
+    }
+    state->dirty = true;
+    rowsEdited(state, y, y);
+}
+
+function usize
+undoRecordSize(i32 textLen) {
+    usize result = (sizeof(UndoRecord) + textLen + sizeof(usize) + 7) & ~(usize)7;
+    return result;
+}
+
+function char*
+undoText(UndoRecord* record) {
+    char* result = (char*)(record + 1);
+    return result;
+}
+
+function void
+undoSetFooter(UndoRecord* record) {
+    usize size = undoRecordSize(record->textLen);
+    memcpy((char*)record + size - sizeof(usize), &size, sizeof(usize));
+}
+
+// NOTE(sen) The record that ends at the journal position, 0 if the chunk starts there
+function UndoRecord*
+undoLastRecord(UndoJournal* journal) {
+    UndoRecord* result = 0;
+    if (journal->current && journal->offset > 0) {
+        usize size;
+        memcpy(&size, journal->current->data + journal->offset - sizeof(usize), sizeof(usize));
+        result = (UndoRecord*)(journal->current->data + journal->offset - size);
+    }
+    return result;
+}
+
+function void
+undoSeal(UndoJournal* journal) {
+    journal->sealed = true;
+}
+
+// NOTE(sen) New record at the journal position, the caller fills in the text. Everything that
+// could have been redone is gone after this.
+function UndoRecord*
+undoAdd(UndoJournal* journal, UndoKind kind, i32 y, i32 x, i32 endY, i32 endX, i32 textLen, b32 joined) {
+    UndoChunk* chunk = journal->current;
+    if (chunk) {
+        UndoChunk* redoChunk = chunk->next;
+        while (redoChunk) {
+            UndoChunk* next = redoChunk->next;
+            journal->bytes -= redoChunk->cap;
+            free(redoChunk);
+            redoChunk = next;
+        }
+        chunk->next = 0;
+        chunk->used = journal->offset;
+    }
+
+    usize size = undoRecordSize(textLen);
+    if (!chunk || chunk->cap - journal->offset < size) {
+        usize cap = size > UNDO_CHUNK_BYTES ? size : UNDO_CHUNK_BYTES;
+        UndoChunk* newChunk = malloc(sizeof(UndoChunk) + cap);
+        newChunk->prev = chunk;
+        newChunk->next = 0;
+        newChunk->cap = cap;
+        newChunk->used = 0;
+        if (chunk) {
+            chunk->next = newChunk;
+        } else {
+            journal->first = newChunk;
+        }
+        journal->current = newChunk;
+        journal->offset = 0;
+        journal->bytes += cap;
+    }
+
+    UndoRecord* record = (UndoRecord*)(journal->current->data + journal->offset);
+    *record = (UndoRecord) {kind, y, x, endY, endX, textLen, joined};
+    undoSetFooter(record);
+    journal->offset += size;
+    journal->current->used = journal->offset;
+    journal->sealed = false;
+
+    // NOTE(sen) Drop the oldest history, the chunk the new record is in always stays. A step that
+    // goes on into the next chunk takes that chunk with it so no step is left half there.
+    while (journal->bytes > journal->maxBytes && journal->first != journal->current) {
+        UndoChunk* last = journal->first;
+        while (last != journal->current && ((UndoRecord*)last->next->data)->joined) {
+            last = last->next;
+        }
+        if (last == journal->current) {
+            break;
+        }
+        while (journal->first != last->next) {
+            UndoChunk* oldest = journal->first;
+            journal->first = oldest->next;
+            journal->bytes -= oldest->cap;
+            free(oldest);
+        }
+        journal->first->prev = 0;
+    }
+    return record;
+}
+
+// NOTE(sen) Queue the record for the swap file, it's written out by `swapCommit`
+function void
+swapAdd(SwapFile* swap, UndoRecord* record, char* text) {
+    if (swap->enabled) {
+        if (swap->pending.len == 0) {
+            swap->pendingSince = getTimeSeconds();
+        }
+        abAppend(&swap->pending, (char*)record, sizeof(UndoRecord));
+        abAppend(&swap->pending, text, record->textLen);
+    }
+}
+
+function b32
+writeAll(i32 fd, char* chars, usize len) {
+    while (len > 0) {
+        isize written = write(fd, chars, len);
+        if (written == -1 && errno != EINTR) {
+            break;
+        }
+        if (written > 0) {
+            chars += written;
+            len -= written;
+        }
+    }
+    return len == 0;
+}
+
+// NOTE(sen) Write out the pending records. The swap file is only made once there is something to
+// put in it. Gives up on the swap file if it can't be written.
+function void
+swapCommit(SwapFile* swap) {
+    if (swap->enabled && swap->pending.len > 0) {
+        if (swap->fd == -1) {
+            swap->fd = open(swap->filename, O_RDWR | O_CREAT | O_TRUNC, 0600);
+            if (swap->fd == -1 || !writeAll(swap->fd, (char*)&swap->header, sizeof(SwapHeader))) {
+                swap->enabled = false;
+            }
+        }
+        if (swap->enabled && writeAll(swap->fd, swap->pending.buf, swap->pending.len) && fdatasync(swap->fd) == 0) {
+            swap->committedBytes += swap->pending.len;
+        } else {
+            swap->enabled = false;
+        }
+        abReset(&swap->pending);
+    }
+}
+
+// NOTE(sen) How long the main loop can wait before it has to commit, no more than `timeoutMs`
+function i32
+swapTimeoutMs(SwapFile* swap, i32 timeoutMs) {
+    i32 result = timeoutMs;
+    if (swap->enabled && swap->pending.len > 0) {
+        f64 remaining = swap->pendingSince + SWAP_COMMIT_SECONDS - getTimeSeconds();
+        i32 remainingMs = remaining > 0 ? (i32)(remaining * 1000) + 1 : 0;
+        if (result == -1 || remainingMs < result) {
+            result = remainingMs;
+        }
+    }
+    return result;
+}
+
+function void
+swapCommitIfDue(SwapFile* swap) {
+    if (swap->pending.len > 0 && getTimeSeconds() - swap->pendingSince >= SWAP_COMMIT_SECONDS) {
+        swapCommit(swap);
+    }
+}
+
+// NOTE(sen) The edits are saved or thrown away
+function void
+swapDiscard(SwapFile* swap) {
+    if (swap->fd != -1) {
+        close(swap->fd);
+        unlink(swap->filename);
+        swap->fd = -1;
+    }
+    abReset(&swap->pending);
+    swap->committedBytes = 0;
+}
+
+// NOTE(sen) A save of everything up to here is starting
+function void
+swapSaveStarted(SwapFile* swap) {
+    swapCommit(swap);
+    swap->saveMark = swap->committedBytes;
+}
+
+// NOTE(sen) The save went through, so the swap file is now about the saved file and only needs the
+// edits made while it ran. Those are copied into a new swap file that replaces the old one.
+function void
+swapSaveFinished(SwapFile* swap, char* documentFilename) {
+    swapCommit(swap);
+    struct stat fileStat;
+    if (swap->enabled && stat(documentFilename, &fileStat) == 0) {
+        swap->header.fileSize = fileStat.st_size;
+        swap->header.mtimeSec = fileStat.st_mtim.tv_sec;
+        swap->header.mtimeNsec = fileStat.st_mtim.tv_nsec;
+        usize tailLen = swap->committedBytes - swap->saveMark;
+        if (tailLen == 0) {
+            swapDiscard(swap);
+        } else {
+            char* tail = malloc(tailLen);
+            char tempFilename[sizeof(swap->filename) + 8];
+            snprintf(tempFilename, sizeof(tempFilename), "%s.tmp", swap->filename);
+            i32 fd = open(tempFilename, O_RDWR | O_CREAT | O_TRUNC, 0600);
+            b32 ok = pread(swap->fd, tail, tailLen, sizeof(SwapHeader) + swap->saveMark) == (isize)tailLen
+                && fd != -1
+                && writeAll(fd, (char*)&swap->header, sizeof(SwapHeader))
+                && writeAll(fd, tail, tailLen)
+                && fdatasync(fd) == 0
+                && rename(tempFilename, swap->filename) == 0;
+            free(tail);
+            close(swap->fd);
+            swap->fd = fd;
+            swap->committedBytes = tailLen;
+            if (!ok) {
+                if (fd != -1) {
+                    close(fd);
+                }
+                unlink(tempFilename);
+                swap->fd = -1;
+                swap->enabled = false;
+            }
+        }
+    }
+    swap->saveMark = 0;
+}
+
+// NOTE(sen) Typing continues an insert where it ended, backspacing continues a delete where it
+// started. Anything else is a new record.
+function void
+undoRecord(UndoJournal* journal, UndoKind kind, i32 y, i32 x, i32 endY, i32 endX, char* text, i32 textLen) {
+    UndoRecord edit = {.kind = kind, .y = y, .x = x, .endY = endY, .endX = endX, .textLen = textLen, .joined = false};
+    swapAdd(SWAP_FILE, &edit, text);
+    UndoRecord* last = journal->sealed ? 0 : undoLastRecord(journal);
+    b32 merged = false;
+    if (last && last->kind == kind && last->textLen + textLen <= UNDO_COALESCE_MAX
+        && journal->offset == journal->current->used && !journal->current->next) {
+        usize lastOffset = (char*)last - journal->current->data;
+        usize grownSize = undoRecordSize(last->textLen + textLen);
+        if (lastOffset + grownSize <= journal->current->cap) {
+            if (kind == UndoKind_Insert && last->endY == y && last->endX == x) {
+                memcpy(undoText(last) + last->textLen, text, textLen);
+                last->endY = endY;
+                last->endX = endX;
+                merged = true;
+            } else if (kind == UndoKind_Delete && endY == last->y && endX == last->x) {
+                memmove(undoText(last) + textLen, undoText(last), last->textLen);
+                memcpy(undoText(last), text, textLen);
+                last->y = y;
+                last->x = x;
+                merged = true;
+            }
+        }
+        if (merged) {
+            last->textLen += textLen;
+            undoSetFooter(last);
+            journal->offset = lastOffset + grownSize;
+            journal->current->used = journal->offset;
+        }
+    }
+    if (!merged) {
+        UndoRecord* record = undoAdd(journal, kind, y, x, endY, endX, textLen, false);
+        memcpy(undoText(record), text, textLen);
+    }
+}
+
+function void
+applyUndoRecord(EditorState* state, UndoRecord* record, char* text, b32 insert, char tabChar, i32 replacementsPerTab) {
+    state->cursorY = record->y;
+    state->cursorFileX = record->x;
+    if (insert) {
+        insertText(state, text, record->textLen, tabChar, replacementsPerTab);
+    } else {
+        deleteText(state, record->y, record->x, record->endY, record->endX, tabChar, replacementsPerTab);
+        Row* row = getRow(state, record->y);
+        state->cursorRenderX = renderXForFileX(row, record->x, tabChar, replacementsPerTab);
+    }
+}
+
+// NOTE(sen) Records joined to the one before them go back as one step
+function b32
+undoStep(UndoJournal* journal, EditorState* state, char tabChar, i32 replacementsPerTab) {
+    b32 result = false;
+    b32 joined = true;
+    while (joined) {
+        while (journal->current && journal->offset == 0 && journal->current->prev) {
+            journal->current = journal->current->prev;
+            journal->offset = journal->current->used;
+        }
+        UndoRecord* record = undoLastRecord(journal);
+        joined = false;
+        if (record) {
+            journal->offset -= undoRecordSize(record->textLen);
+            UndoRecord inverse = *record;
+            inverse.kind = record->kind == UndoKind_Insert ? UndoKind_Delete : UndoKind_Insert;
+            swapAdd(SWAP_FILE, &inverse, undoText(record));
+            applyUndoRecord(state, record, undoText(record), record->kind == UndoKind_Delete, tabChar, replacementsPerTab);
+            joined = record->joined;
+            result = true;
+        }
+    }
+    if (result) {
+        undoSeal(journal);
+    }
+    return result;
+}
+
+function b32
+redoStep(UndoJournal* journal, EditorState* state, char tabChar, i32 replacementsPerTab) {
+    b32 result = false;
+    b32 more = true;
+    while (more) {
+        while (journal->current && journal->offset == journal->current->used && journal->current->next) {
+            journal->current = journal->current->next;
+            journal->offset = 0;
+        }
+        UndoRecord* record = 0;
+        if (journal->current && journal->offset < journal->current->used) {
+            record = (UndoRecord*)(journal->current->data + journal->offset);
+        }
+        more = record && (!result || record->joined);
+        if (more) {
+            journal->offset += undoRecordSize(record->textLen);
+            swapAdd(SWAP_FILE, record, undoText(record));
+            applyUndoRecord(state, record, undoText(record), record->kind == UndoKind_Insert, tabChar, replacementsPerTab);
+            result = true;
+        }
+    }
+    if (result) {
+        undoSeal(journal);
+    }
+    return result;
+}
+
+function char*
+findNthNewlineScalar(char* chars, usize len, i64 n, i64* nFound) {
+    char* result = 0;
+    char* end = chars + len;
+    i64 found = 0;
+    while (found < n && (chars = memchr(chars, '\n', end - chars))) {
+        if (++found == n) {
+            result = chars;
+        }
+        chars++;
+    }
+    *nFound = found;
+    return result;
+}
+
+#if defined(__x86_64__)
+
+// NOTE(sen) Count newlines a block at a time and only look at individual ones in the block
+// where the count is reached
+function char*
+findNthNewlineSSE2(char* chars, usize len, i64 n, i64* nFound) {
+    char* result = 0;
+    i64 found = 0;
+    usize pos = 0;
+    __m128i newline = _mm_set1_epi8('\n');
+    for (; pos + 16 <= len && !result; pos += 16) {
+        u32 mask = _mm_movemask_epi8(_mm_cmpeq_epi8(_mm_loadu_si128((__m128i*)(chars + pos)), newline));
+        i64 count = __builtin_popcount(mask);
+        if (found + count >= n) {
+            for (i64 skip = n - found - 1; skip > 0; skip--) {
+                mask &= mask - 1;
+            }
+            result = chars + pos + __builtin_ctz(mask);
+            found = n;
+        } else {
+            found += count;
+        }
+    }
+    if (!result) {
+        i64 tailFound;
+        result = findNthNewlineScalar(chars + pos, len - pos, n - found, &tailFound);
+        found += tailFound;
+    }
+    *nFound = found;
+    return result;
+}
+
+__attribute__((target("avx2,popcnt"))) function char*
+findNthNewlineAVX2(char* chars, usize len, i64 n, i64* nFound) {
+    char* result = 0;
+    i64 found = 0;
+    usize pos = 0;
+    __m256i newline = _mm256_set1_epi8('\n');
+    for (; pos + 64 <= len && !result; pos += 64) {
+        u64 mask0 = (uint32_t)_mm256_movemask_epi8(_mm256_cmpeq_epi8(_mm256_loadu_si256((__m256i*)(chars + pos)), newline));
+        u64 mask1 = (uint32_t)_mm256_movemask_epi8(_mm256_cmpeq_epi8(_mm256_loadu_si256((__m256i*)(chars + pos + 32)), newline));
+        u64 mask = mask0 | (mask1 << 32);
+        i64 count = __builtin_popcountll(mask);
+        if (found + count >= n) {
+            for (i64 skip = n - found - 1; skip > 0; skip--) {
+                mask &= mask - 1;
+            }
+            result = chars + pos + __builtin_ctzll(mask);
+            found = n;
+        } else {
+            found += count;
+        }
+    }
+    if (!result) {
+        i64 tailFound;
+        result = findNthNewlineSSE2(chars + pos, len - pos, n - found, &tailFound);
+        found += tailFound;
+    }
+    *nFound = found;
+    return result;
+}
+
+#endif
+
+// NOTE(sen) Pointer to the `n`th (1-based) newline, 0 if there are fewer. `nFound` is how many
+// were seen, which makes this a newline counter when `n` is large.
+function char*
+findNthNewline(char* chars, usize len, i64 n, i64* nFound) {
+    char* result;
+#if defined(__x86_64__)
+    if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("popcnt")) {
+        result = findNthNewlineAVX2(chars, len, n, nFound);
+    } else {
+        result = findNthNewlineSSE2(chars, len, n, nFound);
+    }
+#else
+    result = findNthNewlineScalar(chars, len, n, nFound);
+#endif
+    return result;
+}
+
+function b32
+lineIndexReadSidecar(LineIndex* index) {
+    b32 result = false;
+    FILE* file = fopen(index->sidecarFilename, "rb");
+    if (file) {
+        LineIndexSidecarHeader header;
+        if (fread(&header, sizeof(header), 1, file) == 1
+            && memcmp(header.magic, LINE_INDEX_SIDECAR_MAGIC, sizeof(header.magic)) == 0
+            && header.fileSize == index->size
+            && header.mtimeSec == index->mtime.tv_sec
+            && header.mtimeNsec == index->mtime.tv_nsec
+            && header.stride == LINE_INDEX_STRIDE
+            && header.nCheckpoints > 0
+            && header.nCheckpoints <= index->offsetsCap
+            && fread(index->offsets, sizeof(usize), header.nCheckpoints, file) == (usize)header.nCheckpoints) {
+            index->nLines = header.nLines;
+            index->nCheckpoints = header.nCheckpoints;
+            index->complete = true;
+            result = true;
+        }
+        fclose(file);
+    }
+    return result;
+}
+
+function void
+lineIndexWriteSidecar(LineIndex* index) {
+    char tempFilename[sizeof(index->sidecarFilename) + 8];
+    snprintf(tempFilename, sizeof(tempFilename), "%s.tmp", index->sidecarFilename);
+    FILE* file = fopen(tempFilename, "wb");
+    if (file) {
+        LineIndexSidecarHeader header = {
+            .fileSize = index->size,
+            .mtimeSec = index->mtime.tv_sec,
+            .mtimeNsec = index->mtime.tv_nsec,
+            .stride = LINE_INDEX_STRIDE,
+            .nLines = index->nLines,
+            .nCheckpoints = index->nCheckpoints,
+        };
+        memcpy(header.magic, LINE_INDEX_SIDECAR_MAGIC, sizeof(header.magic));
+        b32 ok = fwrite(&header, sizeof(header), 1, file) == 1
+            && fwrite(index->offsets, sizeof(usize), index->nCheckpoints, file) == (usize)index->nCheckpoints;
+        ok = fclose(file) == 0 && ok;
+        if (!ok || rename(tempFilename, index->sidecarFilename)) {
+            unlink(tempFilename);
+        }
+    }
+}
+
+function void*
+lineIndexThread(void* arg) {
+    LineIndex* index = arg;
+    i64 nCheckpoints = 1;
+    i64 nLines = 0;
+    for (;;) {
+        usize lineStart = index->offsets[nCheckpoints - 1];
+        i64 nFound;
+        char* newline = findNthNewline(index->base + lineStart, index->size - lineStart, LINE_INDEX_STRIDE, &nFound);
+        usize nextLineStart = newline ? newline + 1 - index->base : index->size;
+        if (nextLineStart < index->size) {
+            index->offsets[nCheckpoints] = nextLineStart;
+            pthread_mutex_lock(&index->mutex);
+            __atomic_store_n(&index->nCheckpoints, ++nCheckpoints, __ATOMIC_RELEASE);
+            pthread_cond_broadcast(&index->progress);
+            pthread_mutex_unlock(&index->mutex);
+        } else {
+            // NOTE(sen) A last line without a newline still counts
+            b32 unterminated = index->base[index->size - 1] != '\n';
+            nLines = (nCheckpoints - 1) * LINE_INDEX_STRIDE + nFound + unterminated;
+            break;
+        }
+    }
+    index->nLines = nLines;
+    pthread_mutex_lock(&index->mutex);
+    __atomic_store_n(&index->complete, true, __ATOMIC_RELEASE);
+    pthread_cond_broadcast(&index->progress);
+    pthread_mutex_unlock(&index->mutex);
+
+    if (index->size >= LINE_INDEX_SIDECAR_MIN_BYTES) {
+        lineIndexWriteSidecar(index);
+    }
+    return 0;
+}
+
+// NOTE(sen) Use the sidecar from last time if it's still good, otherwise index in the background
+function void
+lineIndexStart(LineIndex* index, char* base, usize size, char* filename, struct stat* fileStat) {
+    index->base = base;
+    index->size = size;
+    index->mtime = fileStat->st_mtim;
+    snprintf(index->sidecarFilename, sizeof(index->sidecarFilename), "%s.kiloidx", filename);
+    pthread_mutex_init(&index->mutex, 0);
+    pthread_cond_init(&index->progress, 0);
+    // NOTE(sen) Every line is at least one byte so this is enough for any contents
+    index->offsetsCap = size / LINE_INDEX_STRIDE + 2;
+    index->offsets = calloc(index->offsetsCap, sizeof(usize));
+    if (size == 0) {
+        index->complete = true;
+    } else if (!lineIndexReadSidecar(index)) {
+        index->offsets[0] = 0;
+        index->nCheckpoints = 1;
+        if (pthread_create(&index->thread, 0, lineIndexThread, index)) {
+            die("pthread_create");
+        }
+    }
+}
+
+// NOTE(sen) Blocks until there are `nCheckpoints` checkpoints or the index is done
+function void
+lineIndexWait(LineIndex* index, i64 nCheckpoints) {
+    pthread_mutex_lock(&index->mutex);
+    while (index->nCheckpoints < nCheckpoints && !index->complete) {
+        pthread_cond_wait(&index->progress, &index->mutex);
+    }
+    pthread_mutex_unlock(&index->mutex);
+}
+
+function b32
+rowsComplete(EditorState* state) {
+    b32 result = __atomic_load_n(&state->lineIndex.complete, __ATOMIC_ACQUIRE)
+        && state->checkpointsUsed == state->lineIndex.nCheckpoints;
+    if (state->stream) {
+        result = result && __atomic_load_n(&state->stream->ended, __ATOMIC_ACQUIRE)
+            && state->blocksMapEnd == __atomic_load_n(&state->stream->size, __ATOMIC_ACQUIRE);
+    }
+    return result;
+}
+
+// NOTE(sen) Turn the whole lines that came down the pipe since last time into rows. The last block
+// is topped up to `LINE_INDEX_STRIDE` rows and the rest go in new blocks that aren't loaded until
+// looked at. Nothing gets edited while the pipe is open, so the last block still ends where the
+// previous lines did.
+function void
+streamSyncRows(EditorState* state) {
+    Stream* stream = state->stream;
+    b32 ended = __atomic_load_n(&stream->ended, __ATOMIC_ACQUIRE);
+    usize size = __atomic_load_n(&stream->size, __ATOMIC_ACQUIRE);
+    char* start = state->mapBase + state->blocksMapEnd;
+    char* end = state->mapBase + size;
+    if (!ended) {
+        // NOTE(sen) A line that is still coming in waits until it's whole
+        char* lastNewline = memrchr(start, '\n', end - start);
+        end = lastNewline ? lastNewline + 1 : start;
+    }
+    noteNewline(state, start, end - start);
+    while (start < end) {
+        RowBlock* block = state->nBlocks > 0 ? state->blocks + state->nBlocks - 1 : 0;
+        if (!block || block->nRows >= LINE_INDEX_STRIDE || block->mapEnd != state->blocksMapEnd) {
+            block = appendBlock(state);
+            block->mapStart = start - state->mapBase;
+            block->mapEnd = block->mapStart;
+        }
+        i64 nLines;
+        char* newline = findNthNewline(start, end - start, LINE_INDEX_STRIDE - block->nRows, &nLines);
+        char* linesEnd = newline ? newline + 1 : end;
+        // NOTE(sen) A last line without a newline still counts
+        if (!newline && end[-1] != '\n') {
+            nLines++;
+        }
+        if (block->loaded) {
+            if (block->nRows + nLines > block->rowsCap) {
+                block->rowsCap = block->rowsCap * 2 > block->nRows + nLines ? block->rowsCap * 2 : block->nRows + nLines;
+                block->rows = realloc(block->rows, block->rowsCap * sizeof(Row));
+            }
+            memset(block->rows + block->nRows, 0, nLines * sizeof(Row));
+            borrowLines(block->rows + block->nRows, nLines, start, linesEnd);
+        }
+        block->nRows += nLines;
+        block->mapEnd = linesEnd - state->mapBase;
+        blockTreeAdd(state, state->nBlocks - 1, nLines);
+        state->nRows += nLines;
+        state->blocksMapEnd = block->mapEnd;
+        start = linesEnd;
+    }
+    // NOTE(sen) Searches don't look past the rows, they can't wait for lines that may never come
+    state->mapSize = state->blocksMapEnd;
+    stream->sizeSeen = size;
+    if (ended && stream->error[0] && !stream->errorShown) {
+        stream->errorShown = true;
+        state->userMessageLen = snprintf(
+            state->userMessage, sizeof(state->userMessage), "Stopped reading input: %s", stream->error
+        );
+    }
+}
+
+// NOTE(sen) Blocks until more has been read than the rows were last made from or the input ended
+function void
+streamWait(Stream* stream) {
+    pthread_mutex_lock(&stream->mutex);
+    while (__atomic_load_n(&stream->size, __ATOMIC_ACQUIRE) == stream->sizeSeen
+           && !__atomic_load_n(&stream->ended, __ATOMIC_ACQUIRE)) {
+        pthread_cond_wait(&stream->progress, &stream->mutex);
+    }
+    pthread_mutex_unlock(&stream->mutex);
+}
+
+// NOTE(sen) Turn checkpoints the index published since last time into row blocks, block k goes
+// from checkpoint k to checkpoint k + 1
+function void
+syncRowBlocks(EditorState* state) {
+    LineIndex* index = &state->lineIndex;
+    b32 complete = __atomic_load_n(&index->complete, __ATOMIC_ACQUIRE);
+    i64 nCheckpoints = __atomic_load_n(&index->nCheckpoints, __ATOMIC_ACQUIRE);
+    while (state->checkpointsUsed < nCheckpoints) {
+        i64 checkpoint = state->checkpointsUsed;
+        b32 last = checkpoint + 1 == nCheckpoints;
+        if (last && !complete) {
+            break;
+        }
+        RowBlock* block = appendBlock(state);
+        block->mapStart = index->offsets[checkpoint];
+        block->mapEnd = last ? index->size : index->offsets[checkpoint + 1];
+        block->nRows = last ? index->nLines - checkpoint * LINE_INDEX_STRIDE : LINE_INDEX_STRIDE;
+        blockTreeAdd(state, state->nBlocks - 1, block->nRows);
+        state->nRows += block->nRows;
+        state->blocksMapEnd = block->mapEnd;
+        state->checkpointsUsed++;
+    }
+    if (state->stream) {
+        streamSyncRows(state);
+    }
+}
+
+// NOTE(sen) Blocks until there can be more rows. Returns false for pipes, they might never end and
+// make do with what has come in.
+function b32
+waitForMoreRows(EditorState* state) {
+    b32 result = true;
+    if (!state->stream) {
+        lineIndexWait(&state->lineIndex, state->checkpointsUsed + 2);
+    } else if (state->stream->regularFile) {
+        streamWait(state->stream);
+    } else {
+        result = false;
+    }
+    return result;
+}
+
+// NOTE(sen) Make sure there are at least `minRows` rows if the file has that many
+function void
+ensureRows(EditorState* state, i32 minRows) {
+    syncRowBlocks(state);
+    while (state->nRows < minRows && !rowsComplete(state) && waitForMoreRows(state)) {
+        syncRowBlocks(state);
+    }
+}
+
+// NOTE(sen) Make sure the mapping byte at `offset` is in a row block
+function void
+ensureRowsThroughByte(EditorState* state, usize offset) {
+    syncRowBlocks(state);
+    while (state->blocksMapEnd <= offset && !rowsComplete(state) && waitForMoreRows(state)) {
+        syncRowBlocks(state);
+    }
+}
+
+// NOTE(sen) Row and column of a mapping byte that is in one of the unloaded blocks in [blockStart, blockEnd)
+function void
+locateMapByte(EditorState* state, i32 blockStart, i32 blockEnd, char* byte, i32* matchRow, i32* matchX) {
+    usize offset = byte - state->mapBase;
+    i32 blockIndex = blockStart;
+    for (; blockIndex < blockEnd - 1; blockIndex++) {
+        RowBlock* block = state->blocks + blockIndex;
+        if (!block->loaded && offset >= block->mapStart && offset < block->mapEnd) {
+            break;
+        }
+    }
+    RowBlock* block = state->blocks + blockIndex;
+    char* blockStartByte = state->mapBase + block->mapStart;
+    i64 nNewlines;
+    findNthNewline(blockStartByte, byte - blockStartByte, INT64_MAX, &nNewlines);
+    char* lineStart = byte;
+    while (lineStart > blockStartByte && lineStart[-1] != '\n') {
+        lineStart--;
+    }
+    *matchRow = blockTreePrefix(state, blockIndex) + nNewlines;
+    *matchX = byte - lineStart;
+}
+
+// NOTE(sen) Start journaling edits to `filename` and put back the ones a previous session left
+// behind. A swap file for a different version of the file is moved out of the way. Returns how
+// many edits were recovered.
+function i32
+swapOpen(SwapFile* swap, EditorState* state, char* filename, struct stat* fileStat, char tabChar, i32 replacementsPerTab) {
+    i32 result = 0;
+    swap->enabled = true;
+    swap->fd = -1;
+    snprintf(swap->filename, sizeof(swap->filename), "%s.kiloswp", filename);
+    memcpy(swap->header.magic, SWAP_MAGIC, sizeof(swap->header.magic));
+    swap->header.fileSize = fileStat->st_size;
+    swap->header.mtimeSec = fileStat->st_mtim.tv_sec;
+    swap->header.mtimeNsec = fileStat->st_mtim.tv_nsec;
+
+    i32 fd = open(swap->filename, O_RDWR);
+    if (fd != -1) {
+        struct stat swapStat;
+        SwapHeader header;
+        b32 matches = fstat(fd, &swapStat) == 0
+            && read(fd, &header, sizeof(header)) == sizeof(header)
+            && memcmp(&header, &swap->header, sizeof(header)) == 0;
+        if (matches) {
+            usize len = swapStat.st_size - sizeof(SwapHeader);
+            char* records = malloc(len);
+            if (pread(fd, records, len, sizeof(SwapHeader)) != (isize)len) {
+                len = 0;
+            }
+            // NOTE(sen) A crash can leave a partly written record at the end, everything from the
+            // first one that doesn't fit or doesn't make sense for the rows is dropped
+            usize offset = 0;
+            while (offset + sizeof(UndoRecord) <= len) {
+                // NOTE(sen) Records follow their text so they aren't aligned
+                UndoRecord record;
+                memcpy(&record, records + offset, sizeof(UndoRecord));
+                ensureRows(state, record.y > record.endY ? record.y + 2 : record.endY + 2);
+                b32 valid = (record.kind == UndoKind_Insert || record.kind == UndoKind_Delete)
+                    && record.textLen >= 0 && offset + sizeof(UndoRecord) + record.textLen <= len
+                    && record.y >= 0 && record.y <= state->nRows && record.x >= 0
+                    && record.x <= (record.y < state->nRows ? gbLen(&getRow(state, record.y)->fileChars) : 0);
+                if (valid && record.kind == UndoKind_Delete) {
+                    valid = record.y <= record.endY && record.endY < state->nRows && record.endX >= 0
+                        && record.endX <= gbLen(&getRow(state, record.endY)->fileChars)
+                        && (record.y < record.endY || record.x <= record.endX);
+                }
+                if (!valid) {
+                    break;
+                }
+                char* text = records + offset + sizeof(UndoRecord);
+                applyUndoRecord(state, &record, text, record.kind == UndoKind_Insert, tabChar, replacementsPerTab);
+                offset += sizeof(UndoRecord) + record.textLen;
+                result++;
+            }
+            free(records);
+            if (ftruncate(fd, sizeof(SwapHeader) + offset) == 0 && lseek(fd, 0, SEEK_END) != -1) {
+                swap->fd = fd;
+                swap->committedBytes = offset;
+            } else {
+                close(fd);
+            }
+        } else {
+            close(fd);
+            char staleFilename[sizeof(swap->filename) + 8];
+            snprintf(staleFilename, sizeof(staleFilename), "%s.stale", swap->filename);
+            rename(swap->filename, staleFilename);
+            state->userMessageLen = snprintf(
+                state->userMessage, sizeof(state->userMessage), "Swap file is for another version, moved to %.80s",
+                staleFilename
+            );
+        }
+    }
+    return result;
+}
+
+// NOTE(sen) Returns true if there is something to read before the timeout (-1 waits forever)
+function b32
+pollInput(i32 timeoutMs) {
+    struct pollfd pfd = {.fd = STDIN_FILENO, .events = POLLIN};
+    i32 result = poll(&pfd, 1, timeoutMs);
+    if (result == -1 && errno != EINTR) { die("poll"); }
+    return result > 0;
+}
+
+// NOTE(sen) Take everything the terminal has for us right now
+function void
+readAvailableInput(InputState* input) {
+    if (input->pos > 0) {
+        memmove(input->buf, input->buf + input->pos, input->len - input->pos);
+        input->len -= input->pos;
+        input->pos = 0;
+    }
+    while (input->len < (i32)sizeof(input->buf) && pollInput(0)) {
+        isize nread = read(STDIN_FILENO, input->buf + input->len, sizeof(input->buf) - input->len);
+        if (nread == -1 && errno != EAGAIN) { die("read"); }
+        if (nread <= 0) {
+            break;
+        }
+        input->len += nread;
+    }
+}
+
+// NOTE(sen) 1 if the pending bytes are exactly `seq` (up to its end), -1 if they are a prefix of it,
+// 0 if they don't match
+function i32
+matchPending(InputState* input, char* seq) {
+    i32 seqLen = strlen(seq);
+    i32 available = input->len - input->pos;
+    i32 compareLen = available < seqLen ? available : seqLen;
+    i32 result = 0;
+    if (memcmp(input->buf + input->pos, seq, compareLen) == 0) {
+        result = compareLen == seqLen ? 1 : -1;
+    }
+    return result;
+}
+
+// NOTE(sen) Decode one key from the buffered bytes. Returns `Key_None` when more bytes are needed,
+// `timedOut` means no more are coming so whatever is there has to be taken as is.
+function i32
+decodeKey(InputState* input, b32 timedOut) {
+    i32 key = Key_None;
+    if (input->inPaste) {
+        // NOTE(sen) Everything up to the end marker is text
+        while (input->pos < input->len) {
+            char* start = input->buf + input->pos;
+            char* escape = memchr(start, '\x1b', input->len - input->pos);
+            i32 textLen = escape ? escape - start : input->len - input->pos;
+            abAppend(&input->paste, start, textLen);
+            input->pos += textLen;
+            if (escape) {
+                i32 match = matchPending(input, PASTE_END);
+                if (match == 1) {
+                    input->pos += strlen(PASTE_END);
+                    input->inPaste = false;
+                    key = Key_Paste;
+                    break;
+                } else if (match == -1 && !timedOut) {
+                    break;
+                } else {
+                    abAppend(&input->paste, "\x1b", 1);
+                    input->pos++;
+                }
+            }
+        }
+    } else if (input->pos < input->len) {
+        char ch = input->buf[input->pos];
+        if (ch != '\x1b') {
+            key = ch;
+            input->pos++;
+        } else {
+            b32 needMore = false;
+            for (usize seqIndex = 0; seqIndex < sizeof(ESCAPE_SEQUENCES) / sizeof(ESCAPE_SEQUENCES[0]); seqIndex++) {
+                EscapeSequence* seq = ESCAPE_SEQUENCES + seqIndex;
+                i32 match = matchPending(input, seq->chars);
+                if (match == 1) {
+                    key = seq->key;
+                    input->pos += strlen(seq->chars);
+                    break;
+                } else if (match == -1) {
+                    needMore = true;
+                }
+            }
+            if (key == Key_Paste) {
+                input->inPaste = true;
+                abReset(&input->paste);
+                key = decodeKey(input, timedOut);
+            } else if (key == Key_None && (!needMore || timedOut)) {
+                // NOTE(sen) Skip over CSI/SS3 sequences we don't know, anything else is a lone escape
+                i32 end = input->pos + 1;
+                b32 isSequence = end < input->len && (input->buf[end] == '[' || input->buf[end] == 'O');
+                if (isSequence) {
+                    end++;
+                    while (end < input->len && !(input->buf[end] >= 0x40 && input->buf[end] <= 0x7E)) {
+                        end++;
+                    }
+                }
+                if (isSequence && end < input->len) {
+                    input->pos = end + 1;
+                    key = decodeKey(input, timedOut);
+                } else if (!isSequence || timedOut) {
+                    key = '\x1b';
+                    input->pos++;
+                }
+            }
+        }
+    }
+    return key;
+}
+
+function b32
+inputPending(InputState* input) {
+    b32 result = input->pos < input->len;
+    return result;
+}
+
+// NOTE(sen) Next key from the current batch, `Key_None` once the batch is used up
+function i32
+nextKey(InputState* input) {
+    i32 key = decodeKey(input, input->replaying);
+    while (key == Key_None && !input->replaying && (inputPending(input) || input->inPaste)) {
+        // NOTE(sen) Part of a sequence, wait for the rest
+        b32 pasteInProgress = input->inPaste;
+        if (pollInput(pasteInProgress ? -1 : ESCAPE_TIMEOUT_MS)) {
+            readAvailableInput(input);
+            key = decodeKey(input, false);
+        } else {
+            key = decodeKey(input, true);
+            break;
+        }
+    }
+    return key;
+}
+
+
+function void
+zstdLoadOnce(void) {
+    void* library = dlopen("libzstd.so.1", RTLD_NOW | RTLD_LOCAL);
+    if (library) {
+        ZSTD.createDCtx = dlsym(library, "ZSTD_createDCtx");
+        ZSTD.freeDCtx = dlsym(library, "ZSTD_freeDCtx");
+        ZSTD.decompressStream = dlsym(library, "ZSTD_decompressStream");
+        ZSTD.createCCtx = dlsym(library, "ZSTD_createCCtx");
+        ZSTD.freeCCtx = dlsym(library, "ZSTD_freeCCtx");
+        ZSTD.compressStream2 = dlsym(library, "ZSTD_compressStream2");
+        ZSTD.isError = dlsym(library, "ZSTD_isError");
+        ZSTD.getErrorName = dlsym(library, "ZSTD_getErrorName");
+        ZSTD.loaded = ZSTD.createDCtx && ZSTD.freeDCtx && ZSTD.decompressStream && ZSTD.createCCtx && ZSTD.freeCCtx
+            && ZSTD.compressStream2 && ZSTD.isError && ZSTD.getErrorName;
+    }
+}
+
+// NOTE(sen) Safe to call from any thread, returns false if libzstd isn't there
+function b32
+zstdLoad(void) {
+    pthread_once(&ZSTD_ONCE, zstdLoadOnce);
+    return ZSTD.loaded;
+}
+
+function Compression
+detectCompression(char* bytes, usize len) {
+    Compression result = Compression_None;
+    if (len >= 2 && memcmp(bytes, "\x1f\x8b", 2) == 0) {
+        result = Compression_Gzip;
+    } else if (len >= 4 && memcmp(bytes, "\x28\xb5\x2f\xfd", 4) == 0) {
+        result = Compression_Zstd;
+    }
+    return result;
+}
+
+// NOTE(sen) Pieces that continue right where the last one ended are merged into it
+function void
+addSaveSegment(SaveJob* job, char* chars, usize len) {
+    SaveSegment* last = job->nSegments > 0 ? job->segments + job->nSegments - 1 : 0;
+    if (last && last->chars + last->len == chars) {
+        last->len += len;
+    } else if (len > 0) {
+        if (job->nSegments == job->segmentsCap) {
+            job->segmentsCap = job->segmentsCap ? job->segmentsCap * 2 : 1024;
+            job->segments = realloc(job->segments, job->segmentsCap * sizeof(SaveSegment));
+        }
+        job->segments[job->nSegments++] = (SaveSegment) {chars, len};
+    }
+    job->totalBytes += len;
+}
+
+function void
+takeSaveSnapshot(SaveJob* job, EditorState* state) {
+    job->nSegments = 0;
+    job->totalBytes = 0;
+
+    usize ownedBytes = 0;
+    for (i32 blockIndex = 0; blockIndex < state->nBlocks; blockIndex++) {
+        RowBlock* block = state->blocks + blockIndex;
+        for (i32 rowIndex = 0; rowIndex < block->nRows && block->loaded; rowIndex++) {
+            GapBuffer* gb = &block->rows[rowIndex].fileChars;
+            if (!gb->borrowed) {
+                ownedBytes += gbLen(gb) + 2;
+            }
+        }
+    }
+    job->ownedChars = malloc(ownedBytes + 1);
+
+    char* ownedCursor = job->ownedChars;
+    char* sourceStart = state->mapBase ? state->mapBase : state->readChars;
+    char* sourceEnd = state->mapBase ? state->mapBase + state->mapSize : state->readChars + state->readSize;
+    char* newline = state->newlineLen == 2 ? "\r\n" : "\n";
+    i32 newlineLen = state->newlineLen == 2 ? 2 : 1;
+    // NOTE(sen) The last row ends like the file did, until the line index is done there is more after it
+    i32 lastRow = rowsComplete(state) ? state->nRows - 1 : -1;
+    i32 firstRowInBlock = 0;
+    for (i32 blockIndex = 0; blockIndex < state->nBlocks; blockIndex++) {
+        RowBlock* block = state->blocks + blockIndex;
+        if (!block->loaded) {
+            // NOTE(sen) Blocks nobody looked at are written with their newlines as they were
+            addSaveSegment(job, state->mapBase + block->mapStart, block->mapEnd - block->mapStart);
+            firstRowInBlock += block->nRows;
+            continue;
+        }
+        for (i32 rowIndex = 0; rowIndex < block->nRows; rowIndex++) {
+            GapBuffer* gb = &block->rows[rowIndex].fileChars;
+            b32 newlineAfter = firstRowInBlock + rowIndex != lastRow || !state->noFinalNewline;
+            if (gb->borrowed) {
+                addSaveSegment(job, gb->buf, gb->cap);
+                // NOTE(sen) Unedited rows keep the line ending they had so that runs of them become one
+                // segment and come out as they were
+                char* after = gb->buf + gb->cap;
+                char* afterEnd = after;
+                if (after >= sourceStart && after <= sourceEnd) {
+                    while (afterEnd < sourceEnd && *afterEnd == '\r') {
+                        afterEnd++;
+                    }
+                    if (afterEnd < sourceEnd && *afterEnd == '\n') {
+                        afterEnd++;
+                    }
+                }
+                if (newlineAfter && afterEnd > after) {
+                    addSaveSegment(job, after, afterEnd - after);
+                } else if (newlineAfter) {
+                    addSaveSegment(job, newline, newlineLen);
+                }
+            } else {
+                char* start = ownedCursor;
+                memcpy(ownedCursor, gb->buf, gb->gapStart);
+                ownedCursor += gb->gapStart;
+                memcpy(ownedCursor, gb->buf + gb->gapEnd, gb->cap - gb->gapEnd);
+                ownedCursor += gb->cap - gb->gapEnd;
+                if (newlineAfter) {
+                    memcpy(ownedCursor, newline, newlineLen);
+                    ownedCursor += newlineLen;
+                }
+                addSaveSegment(job, start, ownedCursor - start);
+            }
+        }
+        firstRowInBlock += block->nRows;
+    }
+    // NOTE(sen) Whatever the line index hasn't got to yet goes out as is
+    if (!rowsComplete(state)) {
+        addSaveSegment(job, state->mapBase + state->blocksMapEnd, state->mapSize - state->blocksMapEnd);
+    }
+}
+
+// NOTE(sen) Returns an errno, 0 if everything got written
+function i32
+saveWriteSegments(SaveJob* job, i32 fd) {
+    i32 error = 0;
+    struct iovec iov[IOV_MAX];
+    i32 segmentIndex = 0;
+    usize segmentOffset = 0;
+    while (segmentIndex < job->nSegments && !error) {
+        i32 nIov = 0;
+        for (i32 index = segmentIndex; index < job->nSegments && nIov < IOV_MAX; index++) {
+            SaveSegment* segment = job->segments + index;
+            usize offset = index == segmentIndex ? segmentOffset : 0;
+            iov[nIov++] = (struct iovec) {segment->chars + offset, segment->len - offset};
+        }
+        isize written = writev(fd, iov, nIov);
+        if (written == -1) {
+            if (errno != EINTR) {
+                error = errno;
+            }
+        } else {
+            __atomic_add_fetch(&job->bytesWritten, written, __ATOMIC_RELAXED);
+            // NOTE(sen) Skip past what got written, writes can be partial
+            usize remaining = written;
+            while (segmentIndex < job->nSegments && remaining > 0) {
+                usize segmentLeft = job->segments[segmentIndex].len - segmentOffset;
+                if (remaining >= segmentLeft) {
+                    remaining -= segmentLeft;
+                    segmentIndex++;
+                    segmentOffset = 0;
+                } else {
+                    segmentOffset += remaining;
+                    remaining = 0;
+                }
+            }
+        }
+    }
+    return error;
+}
+
+// NOTE(sen) Compress the segments into `fd` a piece at a time. Returns an errno, the compressors
+// failing is EIO.
+function i32
+saveCompressSegments(SaveJob* job, i32 fd) {
+    i32 error = 0;
+    usize outCap = STREAM_INPUT_BYTES;
+    char* out = malloc(outCap);
+    z_stream zlib = {0};
+    void* zstd = 0;
+    if (job->compression == Compression_Gzip) {
+        if (deflateInit2(&zlib, Z_DEFAULT_COMPRESSION, Z_DEFLATED, 15 + 16, 8, Z_DEFAULT_STRATEGY) != Z_OK) {
+            error = ENOMEM;
+        }
+    } else if (!zstdLoad() || !(zstd = ZSTD.createCCtx())) {
+        error = ENOSYS;
+    }
+    // NOTE(sen) The pass after the last segment finishes the stream
+    for (i32 segmentIndex = 0; segmentIndex <= job->nSegments && !error; segmentIndex++) {
+        b32 finish = segmentIndex == job->nSegments;
+        SaveSegment segment = finish ? (SaveSegment) {0} : job->segments[segmentIndex];
+        usize offset = 0;
+        do {
+            // NOTE(sen) zlib counts in 32 bits
+            usize pieceLen = segment.len - offset < (1u << 30) ? segment.len - offset : (1u << 30);
+            char* piece = segment.chars + offset;
+            b32 done = false;
+            if (job->compression == Compression_Gzip) {
+                zlib.next_in = (u8*)piece;
+                zlib.avail_in = pieceLen;
+                while (!done && !error) {
+                    zlib.next_out = (u8*)out;
+                    zlib.avail_out = outCap;
+                    i32 status = deflate(&zlib, finish ? Z_FINISH : Z_NO_FLUSH);
+                    if (status == Z_STREAM_ERROR) {
+                        error = EIO;
+                    } else if (!writeAll(fd, out, outCap - zlib.avail_out)) {
+                        error = errno;
+                    }
+                    done = finish ? status == Z_STREAM_END : zlib.avail_out != 0;
+                }
+            } else {
+                ZstdInBuffer zin = {piece, pieceLen, 0};
+                while (!done && !error) {
+                    ZstdOutBuffer zout = {out, outCap, 0};
+                    usize status = ZSTD.compressStream2(zstd, &zout, &zin, finish ? ZSTD_E_END : ZSTD_E_CONTINUE);
+                    if (ZSTD.isError(status)) {
+                        error = EIO;
+                    } else if (!writeAll(fd, out, zout.pos)) {
+                        error = errno;
+                    }
+                    done = finish ? status == 0 : zin.pos == zin.size;
+                }
+            }
+            __atomic_add_fetch(&job->bytesWritten, pieceLen, __ATOMIC_RELAXED);
+            offset += pieceLen;
+        } while (offset < segment.len && !error);
+    }
+    if (job->compression == Compression_Gzip) {
+        deflateEnd(&zlib);
+    } else if (zstd) {
+        ZSTD.freeCCtx(zstd);
+    }
+    free(out);
+    return error;
+}
+
+// NOTE(sen) Write everything to a temporary file next to the original, sync it and rename it over.
+// Rows may point into the mapping of the original file so it can't be truncated in place, the
+// mapping keeps the old contents alive after the rename.
+function void*
+saveThread(void* arg) {
+    SaveJob* job = arg;
+    i32 error = 0;
+
+    struct stat originalStat;
+    mode_t mode = 0644;
+    if (stat(job->filename, &originalStat) == 0) {
+        mode = originalStat.st_mode & 07777;
+    }
+
+    i32 fd = open(job->tempFilename, O_WRONLY | O_CREAT | O_TRUNC, mode);
+    if (fd == -1) {
+        error = errno;
+    } else {
+        error = job->compression == Compression_None ? saveWriteSegments(job, fd) : saveCompressSegments(job, fd);
+        if (!error && fsync(fd)) {
+            error = errno;
+        }
+        if (close(fd) && !error) {
+            error = errno;
+        }
+        if (!error && rename(job->tempFilename, job->filename)) {
+            error = errno;
+        }
+        if (error) {
+            unlink(job->tempFilename);
+        } else {
+            // NOTE(sen) Make the rename itself durable
+            char dirBuf[PATH_MAX];
+            snprintf(dirBuf, sizeof(dirBuf), "%s", job->filename);
+            i32 dirFd = open(dirname(dirBuf), O_RDONLY | O_DIRECTORY);
+            if (dirFd != -1) {
+                fsync(dirFd);
+                close(dirFd);
+            }
+        }
+    }
+
+    job->error = error;
+    job->endTime = getTimeSeconds();
+    __atomic_store_n(&job->finished, true, __ATOMIC_RELEASE);
+    return 0;
+}
+
+function b32
+startSave(SaveJob* job, EditorState* state, char* filename) {
+    b32 result = false;
+    if (!job->running) {
+        snprintf(job->filename, sizeof(job->filename), "%s", filename);
+        snprintf(job->tempFilename, sizeof(job->tempFilename), "%s.kilosave", filename);
+        takeSaveSnapshot(job, state);
+        swapSaveStarted(SWAP_FILE);
+        job->bytesWritten = 0;
+        job->finished = false;
+        job->error = 0;
+        job->startTime = getTimeSeconds();
+        job->compression = state->stream ? state->stream->compression : Compression_None;
+        if (pthread_create(&job->thread, 0, saveThread, job) == 0) {
+            job->running = true;
+            result = true;
+        } else {
+            free(job->ownedChars);
+            job->ownedChars = 0;
+        }
+    }
+    return result;
+}
+
+// NOTE(sen) Blocks until the save is done
+function void
+waitForSave(SaveJob* job) {
+    if (job->running) {
+        pthread_join(job->thread, 0);
+        free(job->ownedChars);
+        job->ownedChars = 0;
+        job->running = false;
+    }
+}
+
+// NOTE(sen) Returns true if the save finished (successfully or not) since the last check
+function b32
+checkSaveFinished(SaveJob* job) {
+    b32 result = false;
+    if (job->running && __atomic_load_n(&job->finished, __ATOMIC_ACQUIRE)) {
+        waitForSave(job);
+        result = true;
+    }
+    return result;
+}
+
+function f64
+saveThroughputMBps(SaveJob* job) {
+    b32 finished = __atomic_load_n(&job->finished, __ATOMIC_ACQUIRE);
+    f64 elapsed = (finished ? job->endTime : getTimeSeconds()) - job->startTime;
+    usize written = __atomic_load_n(&job->bytesWritten, __ATOMIC_RELAXED);
+    f64 result = elapsed > 0 ? (f64)written / (1024.0 * 1024.0) / elapsed : 0;
+    return result;
+}
+
+typedef struct ReplayKeyName {
+    char* name;
+    char* bytes;
+} ReplayKeyName;
+
+global ReplayKeyName REPLAY_KEY_NAMES[] = {
+    {"Up", "\x1b[A"},
+    {"Down", "\x1b[B"},
+    {"Right", "\x1b[C"},
+    {"Left", "\x1b[D"},
+    {"Home", "\x1b[H"},
+    {"End", "\x1b[F"},
+    {"PageUp", "\x1b[5~"},
+    {"PageDown", "\x1b[6~"},
+    {"Delete", "\x1b[3~"},
+    {"Backspace", "\x7f"},
+    {"Enter", "\r"},
+    {"Escape", "\x1b"},
+};
+
+function i32
+replayGroup(Replay* replay, char* label) {
+    i32 result = -1;
+    for (i32 groupIndex = 0; groupIndex < replay->nGroups; groupIndex++) {
+        if (strcmp(replay->groups[groupIndex].label, label) == 0) {
+            result = groupIndex;
+            break;
+        }
+    }
+    if (result == -1) {
+        if (replay->nGroups == REPLAY_MAX_GROUPS) {
+            errno = E2BIG;
+            die("replay script has too many different commands");
+        }
+        result = replay->nGroups++;
+        snprintf(replay->groups[result].label, sizeof(replay->groups[result].label), "%s", label);
+    }
+    return result;
+}
+
+function void
+addReplayEvent(Replay* replay, i32 group, char* bytes, i32 bytesLen, b32 paste) {
+    if (replay->nEvents == replay->eventsCap) {
+        replay->eventsCap = replay->eventsCap ? replay->eventsCap * 2 : 256;
+        replay->events = realloc(replay->events, replay->eventsCap * sizeof(ReplayEvent));
+    }
+    replay->events[replay->nEvents++] = (ReplayEvent) {group, replay->bytes.len, bytesLen, paste};
+    abAppend(&replay->bytes, bytes, bytesLen);
+}
+
+// NOTE(sen) One command per line, every event is handled as its own batch and gets its own frame:
+//     type <text>              one event per character
+//     key <name> [count]       `name` from `REPLAY_KEY_NAMES` or Ctrl-<letter>
+//     goto <line>              Ctrl-G, the digits and Enter in one event
+//     find <text>              Ctrl-F, the text and Enter in one event
+//     paste <count> <text>     `count` lines of `text` in one bracketed paste
+//     save                     Ctrl-S, the next event waits for the save to finish
+// Empty lines and lines starting with # are skipped.
+function void
+replayLoad(Replay* replay, char* path) {
+    FILE* file = fopen(path, "r");
+    if (!file) { die("replay script"); }
+    // NOTE(sen) The first frame is timed from startup
+    replay->timedGroup = replayGroup(replay, "open");
+    char* line = 0;
+    usize linecap = 0;
+    i32 linelen;
+    char event[256];
+    while ((linelen = getline(&line, &linecap, file)) != -1) {
+        while (linelen > 0 && (line[linelen - 1] == '\n' || line[linelen - 1] == '\r')) {
+            line[--linelen] = '\0';
+        }
+        if (linelen == 0 || line[0] == '#') {
+            continue;
+        }
+        char* arg = strchr(line, ' ');
+        if (arg) {
+            *arg++ = '\0';
+        } else {
+            arg = line + linelen;
+        }
+        if (strcmp(line, "type") == 0) {
+            i32 group = replayGroup(replay, "type");
+            for (char* ch = arg; *ch; ch++) {
+                addReplayEvent(replay, group, ch, 1, false);
+            }
+        } else if (strcmp(line, "key") == 0) {
+            char name[32];
+            i32 count = 1;
+            if (sscanf(arg, "%31s %d", name, &count) < 1) {
+                errno = EINVAL;
+                die("replay script: key needs a name");
+            }
+            char* bytes = 0;
+            char ctrl;
+            if (strncmp(name, "Ctrl-", 5) == 0 && isalpha(name[5]) && name[6] == '\0') {
+                ctrl = CTRL_KEY(name[5]);
+                bytes = &ctrl;
+            }
+            for (u32 nameIndex = 0; !bytes && nameIndex < sizeof(REPLAY_KEY_NAMES) / sizeof(REPLAY_KEY_NAMES[0]); nameIndex++) {
+                if (strcmp(REPLAY_KEY_NAMES[nameIndex].name, name) == 0) {
+                    bytes = REPLAY_KEY_NAMES[nameIndex].bytes;
+                }
+            }
+            if (!bytes) {
+                errno = EINVAL;
+                die("replay script: unknown key");
+            }
+            char label[32];
+            snprintf(label, sizeof(label), "key %.27s", name);
+            i32 group = replayGroup(replay, label);
+            i32 bytesLen = bytes == &ctrl ? 1 : strlen(bytes);
+            for (i32 repeat = 0; repeat < count; repeat++) {
+                addReplayEvent(replay, group, bytes, bytesLen, false);
+            }
+        } else if (strcmp(line, "goto") == 0 || strcmp(line, "find") == 0) {
+            char lead = line[0] == 'g' ? CTRL_KEY('g') : CTRL_KEY('f');
+            i32 eventLen = snprintf(event, sizeof(event), "%c%.200s\r", lead, arg);
+            addReplayEvent(replay, replayGroup(replay, line), event, eventLen, false);
+        } else if (strcmp(line, "paste") == 0) {
+            char* text = 0;
+            i32 count = strtol(arg, &text, 10);
+            if (count <= 0 || *text != ' ') {
+                errno = EINVAL;
+                die("replay script: paste needs a line count and text");
+            }
+            text++;
+            i32 group = replayGroup(replay, "paste");
+            i32 bytesStart = replay->bytes.len;
+            for (i32 lineIndex = 0; lineIndex < count; lineIndex++) {
+                abAppend(&replay->bytes, text, strlen(text));
+                abAppend(&replay->bytes, "\n", 1);
+            }
+            addReplayEvent(replay, group, 0, 0, true);
+            replay->events[replay->nEvents - 1].bytesStart = bytesStart;
+            replay->events[replay->nEvents - 1].bytesLen = replay->bytes.len - bytesStart;
+        } else if (strcmp(line, "save") == 0) {
+            char save = CTRL_KEY('s');
+            addReplayEvent(replay, replayGroup(replay, "save"), &save, 1, false);
+        } else {
+            errno = EINVAL;
+            die("replay script: unknown command");
+        }
+    }
+    free(line);
+    fclose(file);
+    replay->active = true;
+}
+
+// NOTE(sen) Put the next event where `nextKey` will find it. False once the script is done.
+function b32
+replayInject(Replay* replay, InputState* input, SaveJob* save) {
+    // NOTE(sen) Saves run in the background, time them separately from the frames
+    if (save->running) {
+        while (!__atomic_load_n(&save->finished, __ATOMIC_ACQUIRE)) {
+            struct timespec wait = {.tv_nsec = 1000000};
+            nanosleep(&wait, 0);
+        }
+        replay->nSaves++;
+        replay->saveSeconds += save->endTime - save->startTime;
+        replay->saveBytes += save->totalBytes;
+    }
+    b32 result = replay->nextEvent < replay->nEvents;
+    if (result) {
+        ReplayEvent* event = replay->events + replay->nextEvent++;
+        char* bytes = replay->bytes.buf + event->bytesStart;
+        input->pos = 0;
+        if (event->paste) {
+            abAppend(&input->paste, bytes, event->bytesLen);
+            input->inPaste = true;
+            input->len = strlen(PASTE_END);
+            memcpy(input->buf, PASTE_END, input->len);
+        } else {
+            assert(event->bytesLen <= (i32)sizeof(input->buf));
+            input->len = event->bytesLen;
+            memcpy(input->buf, bytes, input->len);
+        }
+        input->replaying = true;
+        replay->timedGroup = event->group;
+        replay->timedAllocations = __atomic_load_n(&ALLOCATION_COUNT, __ATOMIC_RELAXED);
+        replay->timedStart = getTimeSeconds();
+    }
+    return result;
+}
+
+function void
+replayFrameDone(Replay* replay, i32 frameBytes) {
+    if (replay->timedGroup >= 0) {
+        f64 latency = getTimeSeconds() - replay->timedStart;
+        ReplayGroup* group = replay->groups + replay->timedGroup;
+        if (group->nLatencies == group->latenciesCap) {
+            group->latenciesCap = group->latenciesCap ? group->latenciesCap * 2 : 64;
+            group->latencies = realloc(group->latencies, group->latenciesCap * sizeof(f64));
+        }
+        group->latencies[group->nLatencies++] = latency;
+        group->frameBytes += frameBytes;
+        group->allocations += __atomic_load_n(&ALLOCATION_COUNT, __ATOMIC_RELAXED) - replay->timedAllocations;
+        replay->timedGroup = -1;
+    }
+}
+
+function i32
+compareF64(const void* left, const void* right) {
+    f64 l = *(f64*)left;
+    f64 r = *(f64*)right;
+    i32 result = l < r ? -1 : l > r ? 1 : 0;
+    return result;
+}
+
+// NOTE(sen) Nearest rank on sorted values
+function f64
+percentile(f64* sorted, i32 n, f64 fraction) {
+    i32 rank = (i32)(fraction * n + 0.999999);
+    f64 result = n > 0 ? sorted[clamp(rank - 1, 0, n - 1)] : 0;
+    return result;
+}
+
+function void
+replayReport(Replay* replay, char* filename, usize fileSize, i32 screenRows, i32 screenCols) {
+    printf(
+        "%s: %.1fMB, %dx%d, %d events\n", filename, (f64)fileSize / (1024.0 * 1024.0),
+        screenRows, screenCols, replay->nEvents
+    );
+    printf("%-20s %8s %10s %10s %10s %12s %12s\n", "command", "frames", "p50 us", "p99 us", "max us", "bytes/frame", "allocs/frame");
+    for (i32 groupIndex = 0; groupIndex < replay->nGroups; groupIndex++) {
+        ReplayGroup* group = replay->groups + groupIndex;
+        i32 n = group->nLatencies;
+        if (n == 0) {
+            continue;
+        }
+        qsort(group->latencies, n, sizeof(f64), compareF64);
+        printf(
+            "%-20s %8d %10.1f %10.1f %10.1f %12.1f %12.1f\n", group->label, n,
+            percentile(group->latencies, n, 0.5) * 1e6, percentile(group->latencies, n, 0.99) * 1e6,
+            group->latencies[n - 1] * 1e6, (f64)group->frameBytes / n, (f64)group->allocations / n
+        );
+    }
+    if (replay->nSaves > 0) {
+        printf(
+            "saves: %d in %.3fs (%.1fMB/s)\n", replay->nSaves, replay->saveSeconds,
+            replay->saveSeconds > 0 ? (f64)replay->saveBytes / (1024.0 * 1024.0) / replay->saveSeconds : 0
+        );
+    }
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    printf(
+        "peak RSS: %.1fMB, allocations: %lu\n", (f64)usage.ru_maxrss / 1024.0,
+        __atomic_load_n(&ALLOCATION_COUNT, __ATOMIC_RELAXED)
+    );
+    fflush(stdout);
+}
+
+function void*
+workerThread(void* arg) {
+    WorkerPool* pool = arg;
+    pthread_mutex_lock(&pool->mutex);
+    for (;;) {
+        while (pool->nextTask >= pool->nTasks) {
+            pthread_cond_wait(&pool->workAvailable, &pool->mutex);
+        }
+        i32 taskIndex = pool->nextTask++;
+        pthread_mutex_unlock(&pool->mutex);
+        pool->taskFunction(pool->tasks + taskIndex * pool->taskSize);
+        pthread_mutex_lock(&pool->mutex);
+        if (++pool->nTasksDone == pool->nTasks) {
+            pthread_cond_signal(&pool->workDone);
+        }
+    }
+    return 0;
+}
+
+function void
+poolInit(WorkerPool* pool) {
+    i32 nCpus = sysconf(_SC_NPROCESSORS_ONLN);
+    pool->nThreads = clamp(nCpus - 1, 0, 63);
+    pool->threads = calloc(pool->nThreads + 1, sizeof(pthread_t));
+    pthread_mutex_init(&pool->mutex, 0);
+    pthread_cond_init(&pool->workAvailable, 0);
+    pthread_cond_init(&pool->workDone, 0);
+    for (i32 threadIndex = 0; threadIndex < pool->nThreads; threadIndex++) {
+        pthread_create(pool->threads + threadIndex, 0, workerThread, pool);
+    }
+}
+
+// NOTE(sen) How many pieces it's worth cutting parallel work into
+function i32
+poolWidth(WorkerPool* pool) {
+    i32 result = pool->nThreads + 1;
+    return result;
+}
+
+function void
+poolRun(WorkerPool* pool, TaskFunction taskFunction, void* tasks, usize taskSize, i32 nTasks) {
+    pthread_mutex_lock(&pool->mutex);
+    pool->taskFunction = taskFunction;
+    pool->tasks = tasks;
+    pool->taskSize = taskSize;
+    pool->nTasks = nTasks;
+    pool->nextTask = 0;
+    pool->nTasksDone = 0;
+    pthread_cond_broadcast(&pool->workAvailable);
+    while (pool->nextTask < pool->nTasks) {
+        i32 taskIndex = pool->nextTask++;
+        pthread_mutex_unlock(&pool->mutex);
+        taskFunction((char*)tasks + taskIndex * taskSize);
+        pthread_mutex_lock(&pool->mutex);
+        pool->nTasksDone++;
+    }
+    while (pool->nTasksDone < pool->nTasks) {
+        pthread_cond_wait(&pool->workDone, &pool->mutex);
+    }
+    pool->nTasks = 0;
+    pool->nextTask = 0;
+    pthread_mutex_unlock(&pool->mutex);
+}
+
+// NOTE(sen) Start of the first line that starts at or after `offset`
+function usize
+lineStartAtOrAfter(char* chars, usize len, usize offset) {
+    usize result = offset;
+    if (offset > 0 && offset < len) {
+        char* newline = memchr(chars + offset - 1, '\n', len - offset + 1);
+        result = newline ? newline + 1 - chars : len;
+    }
+    return result;
+}
+
+function void
+loadCountTask(void* arg) {
+    LoadTask* task = arg;
+    task->start = lineStartAtOrAfter(task->chars, task->len, task->start);
+    task->end = lineStartAtOrAfter(task->chars, task->len, task->end);
+    task->nRows = 0;
+    if (task->end > task->start) {
+        findNthNewline(task->chars + task->start, task->end - task->start, INT64_MAX, &task->nRows);
+        // NOTE(sen) A last line without a newline still counts
+        if (task->end == task->len && task->chars[task->len - 1] != '\n') {
+            task->nRows++;
+        }
+    }
+}
+
+function void
+loadFillTask(void* arg) {
+    LoadTask* task = arg;
+    char* lineStart = task->chars + task->start;
+    char* end = task->chars + task->end;
+    i64 rowIndex = task->firstRow;
+    while (rowIndex < task->firstRow + task->nRows) {
+        RowBlock* block = task->blocks + rowIndex / LINE_INDEX_STRIDE;
+        i32 rowInBlock = rowIndex % LINE_INDEX_STRIDE;
+        i32 nRows = block->nRows - rowInBlock;
+        if (rowIndex + nRows > task->firstRow + task->nRows) {
+            nRows = task->firstRow + task->nRows - rowIndex;
+        }
+        lineStart = borrowLines(block->rows + rowInBlock, nRows, lineStart, end);
+        rowIndex += nRows;
+    }
+}
+
+// NOTE(sen) Everything left to read from `fd`, `sizeHint` is how much there probably is
+function char*
+readAll(i32 fd, usize sizeHint, usize* len) {
+    usize cap = sizeHint > 0 ? sizeHint + 1 : 1 << 16;
+    char* chars = malloc(cap);
+    *len = 0;
+    for (;;) {
+        if (*len == cap) {
+            cap *= 2;
+            chars = realloc(chars, cap);
+        }
+        isize nread = read(fd, chars + *len, cap - *len);
+        if (nread == -1 && errno != EINTR) { die("read"); }
+        if (nread == 0) {
+            break;
+        }
+        if (nread > 0) {
+            *len += nread;
+        }
+    }
+    return chars;
+}
+
+// NOTE(sen) Make rows for the whole of `chars` up front. The pieces count their lines in parallel,
+// then every block is allocated at its final size and the pieces fill in their rows in parallel.
+function void
+loadRows(EditorState* state, char* chars, usize len) {
+    noteNewline(state, chars, len);
+    i32 nTasks = clamp(len / LOAD_PARALLEL_MIN_BYTES, 1, poolWidth(&WORKER_POOL) * 4);
+    LoadTask* tasks = calloc(nTasks, sizeof(LoadTask));
+    for (i32 taskIndex = 0; taskIndex < nTasks; taskIndex++) {
+        LoadTask* task = tasks + taskIndex;
+        task->chars = chars;
+        task->len = len;
+        task->start = len / nTasks * taskIndex;
+        task->end = taskIndex == nTasks - 1 ? len : len / nTasks * (taskIndex + 1);
+    }
+    poolRun(&WORKER_POOL, loadCountTask, tasks, sizeof(LoadTask), nTasks);
+
+    i64 nRows = 0;
+    for (i32 taskIndex = 0; taskIndex < nTasks; taskIndex++) {
+        tasks[taskIndex].firstRow = nRows;
+        nRows += tasks[taskIndex].nRows;
+    }
+    if (nRows > INT_MAX) { die("too many lines"); }
+    i32 nBlocks = (nRows + LINE_INDEX_STRIDE - 1) / LINE_INDEX_STRIDE;
+    reserveBlocks(state, nBlocks);
+    for (i32 blockIndex = 0; blockIndex < nBlocks; blockIndex++) {
+        RowBlock* block = state->blocks + blockIndex;
+        memset(block, 0, sizeof(RowBlock));
+        block->loaded = true;
+        block->nRows = blockIndex == nBlocks - 1 ? nRows - (i64)blockIndex * LINE_INDEX_STRIDE : LINE_INDEX_STRIDE;
+        block->rowsCap = block->nRows;
+        block->rows = calloc(block->rowsCap, sizeof(Row));
+    }
+    state->nBlocks = nBlocks;
+    state->nRows = nRows;
+    rebuildBlockTree(state);
+
+    for (i32 taskIndex = 0; taskIndex < nTasks; taskIndex++) {
+        tasks[taskIndex].blocks = state->blocks;
+    }
+    poolRun(&WORKER_POOL, loadFillTask, tasks, sizeof(LoadTask), nTasks);
+    free(tasks);
+}
+
+// NOTE(sen) Add rows at the end for the lines of `chars`, they borrow their characters from it. The
+// last block is filled up before new ones are started.
+function void
+appendLines(EditorState* state, char* chars, usize len) {
+    noteNewline(state, chars, len);
+    i64 nLines = 0;
+    if (len > 0) {
+        findNthNewline(chars, len, INT64_MAX, &nLines);
+        if (chars[len - 1] != '\n') {
+            nLines++;
+        }
+    }
+    char* lineStart = chars;
+    while (nLines > 0) {
+        RowBlock* block = state->nBlocks > 0 ? state->blocks + state->nBlocks - 1 : 0;
+        if (!block || block->nRows >= LINE_INDEX_STRIDE) {
+            block = appendBlock(state);
+            block->loaded = true;
+        }
+        loadRowBlock(state, block);
+        i32 nRows = LINE_INDEX_STRIDE - block->nRows;
+        if (nRows > nLines) {
+            nRows = nLines;
+        }
+        if (block->nRows + nRows > block->rowsCap) {
+            block->rowsCap = block->rowsCap * 2 > block->nRows + nRows ? block->rowsCap * 2 : block->nRows + nRows;
+            block->rows = realloc(block->rows, block->rowsCap * sizeof(Row));
+        }
+        memset(block->rows + block->nRows, 0, nRows * sizeof(Row));
+        lineStart = borrowLines(block->rows + block->nRows, nRows, lineStart, chars + len);
+        block->nRows += nRows;
+        blockTreeAdd(state, state->nBlocks - 1, nRows);
+        state->nRows += nRows;
+        nLines -= nRows;
+    }
+}
+
+// NOTE(sen) Forget every row and chunk, for when the file was replaced or truncated
+function void
+followReset(Follow* follow, EditorState* state) {
+    for (i32 blockIndex = 0; blockIndex < state->nBlocks; blockIndex++) {
+        RowBlock* block = state->blocks + blockIndex;
+        if (block->loaded) {
+            for (i32 rowIndex = 0; rowIndex < block->nRows; rowIndex++) {
+                rowFree(block->rows + rowIndex);
+            }
+            free(block->rows);
+        }
+    }
+    state->nBlocks = 0;
+    state->nRows = 0;
+    state->cursorY = 0;
+    state->cursorFileX = 0;
+    state->cursorRenderX = 0;
+    state->rowOffset = 0;
+    state->colOffset = 0;
+    state->wrapOffset = 0;
+    for (i32 chunkIndex = 0; chunkIndex < follow->nChunks; chunkIndex++) {
+        free(follow->chunks[chunkIndex]);
+    }
+    follow->nChunks = 0;
+    follow->offset = 0;
+    follow->lastLineOpen = false;
+}
+
+// NOTE(sen) Read what was appended since last time and add it as rows. The view stays at the
+// bottom if it was there. Returns true if anything was added.
+function b32
+followRead(Follow* follow, EditorState* state, char tabChar, i32 replacementsPerTab) {
+    struct stat fileStat;
+    usize sizeHint = 0;
+    if (fstat(follow->fd, &fileStat) == 0 && S_ISREG(fileStat.st_mode)) {
+        if ((usize)fileStat.st_size < follow->offset) {
+            followReset(follow, state);
+            lseek(follow->fd, 0, SEEK_SET);
+            state->userMessageLen = snprintf(state->userMessage, sizeof(state->userMessage), "File truncated");
+            follow->changed = true;
+        }
+        sizeHint = fileStat.st_size - follow->offset;
+    }
+    usize len;
+    char* chars = readAll(follow->fd, sizeHint, &len);
+    b32 result = len > 0;
+    if (result) {
+        if (follow->nChunks == follow->chunksCap) {
+            follow->chunksCap = follow->chunksCap * 2 > 16 ? follow->chunksCap * 2 : 16;
+            follow->chunks = realloc(follow->chunks, follow->chunksCap * sizeof(char*));
+        }
+        follow->chunks[follow->nChunks++] = chars;
+        follow->offset += len;
+
+        b32 atBottom = state->cursorY >= state->nRows - 1;
+        char* lineStart = chars;
+        if (follow->lastLineOpen && state->nRows > 0) {
+            // NOTE(sen) The rest of a line that was cut off goes on the end of its row
+            char* newline = memchr(chars, '\n', len);
+            i32 restLen = (newline ? newline : chars + len) - chars;
+            while (restLen > 0 && chars[restLen - 1] == '\r') {
+                --restLen;
+            }
+            Row* row = getRow(state, state->nRows - 1);
+            rowInsert(row, gbLen(&row->fileChars), chars, restLen, tabChar, replacementsPerTab);
+            rowsEdited(state, state->nRows - 1, state->nRows - 1);
+            lineStart = newline ? newline + 1 : chars + len;
+        }
+        if (state->nBlocks == 0) {
+            loadRows(state, lineStart, chars + len - lineStart);
+        } else {
+            appendLines(state, lineStart, chars + len - lineStart);
+        }
+        follow->lastLineOpen = chars[len - 1] != '\n';
+
+        if (atBottom && state->nRows > 0) {
+            state->cursorY = state->nRows - 1;
+            state->cursorFileX = 0;
+            state->cursorRenderX = 0;
+        }
+        follow->changed = true;
+    } else {
+        free(chars);
+    }
+    return result;
+}
+
+function void
+followStart(Follow* follow, EditorState* state, i32 fd, char* filename, char tabChar, i32 replacementsPerTab) {
+    follow->fd = fd;
+    follow->inotifyFd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if (follow->inotifyFd == -1) { die("inotify_init1"); }
+    follow->fileWatch = inotify_add_watch(follow->inotifyFd, filename, IN_MODIFY);
+    if (follow->fileWatch == -1) { die("inotify_add_watch"); }
+    char dirBuf[PATH_MAX];
+    char baseBuf[PATH_MAX];
+    snprintf(dirBuf, sizeof(dirBuf), "%s", filename);
+    snprintf(baseBuf, sizeof(baseBuf), "%s", filename);
+    snprintf(follow->basename, sizeof(follow->basename), "%s", basename(baseBuf));
+    follow->dirWatch = inotify_add_watch(follow->inotifyFd, dirname(dirBuf), IN_CREATE | IN_MOVED_TO);
+    followRead(follow, state, tabChar, replacementsPerTab);
+}
+
+// NOTE(sen) Something new has the name now (log rotation), switch over to it once the old file is
+// drained
+function void
+followReopen(Follow* follow, EditorState* state, char* filename, char tabChar, i32 replacementsPerTab) {
+    i32 fd = open(filename, O_RDONLY);
+    if (fd != -1) {
+        inotify_rm_watch(follow->inotifyFd, follow->fileWatch);
+        follow->fileWatch = inotify_add_watch(follow->inotifyFd, filename, IN_MODIFY);
+        close(follow->fd);
+        follow->fd = fd;
+        followReset(follow, state);
+        followRead(follow, state, tabChar, replacementsPerTab);
+        state->userMessageLen = snprintf(state->userMessage, sizeof(state->userMessage), "File replaced");
+        follow->changed = true;
+    }
+}
+
+function void
+followHandleEvents(Follow* follow, EditorState* state, char* filename, char tabChar, i32 replacementsPerTab) {
+    char buf[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+    b32 replaced = false;
+    for (;;) {
+        isize nread = read(follow->inotifyFd, buf, sizeof(buf));
+        if (nread <= 0) {
+            break;
+        }
+        for (char* at = buf; at < buf + nread;) {
+            struct inotify_event* event = (struct inotify_event*)at;
+            if (event->wd == follow->dirWatch && event->len > 0 && strcmp(event->name, follow->basename) == 0) {
+                replaced = true;
+            }
+            at += sizeof(struct inotify_event) + event->len;
+        }
+    }
+    followRead(follow, state, tabChar, replacementsPerTab);
+    if (replaced) {
+        followReopen(follow, state, filename, tabChar, replacementsPerTab);
+    }
+}
+
+// NOTE(sen) Like `pollInput` with no timeout, but adds what gets appended to the file while waiting.
+// A frame is let through once additions have waited for a frame interval so that a fast growing
+// file doesn't redraw for every write. Returns true if there is input.
+function b32
+followWaitForInput(Follow* follow, EditorState* state, char* filename, char tabChar, i32 replacementsPerTab) {
+    b32 result = false;
+    for (;;) {
+        i32 timeoutMs = -1;
+        if (follow->changed) {
+            f64 remaining = follow->lastFrameTime + FRAME_SECONDS - getTimeSeconds();
+            timeoutMs = remaining > 0 ? (i32)(remaining * 1000) + 1 : 0;
+        }
+        struct pollfd pfds[2] = {{.fd = STDIN_FILENO, .events = POLLIN}, {.fd = follow->inotifyFd, .events = POLLIN}};
+        i32 nReady = poll(pfds, 2, timeoutMs);
+        if (nReady == -1 && errno != EINTR) { die("poll"); }
+        if (nReady > 0 && (pfds[0].revents & POLLIN)) {
+            result = true;
+            break;
+        }
+        if (nReady > 0 && (pfds[1].revents & POLLIN)) {
+            followHandleEvents(follow, state, filename, tabChar, replacementsPerTab);
+        } else if (nReady == 0) {
+            break;
+        }
+    }
+    follow->changed = false;
+    follow->lastFrameTime = getTimeSeconds();
+    return result;
+}
+
+// NOTE(sen) Move what has been read so far into an unlinked temp file and map that over the
+// reserved range instead. The bytes are the same, readers of the range don't notice.
+function b32
+streamSpill(Stream* stream, usize size) {
+    b32 result = false;
+    char* dir = getenv("TMPDIR");
+    char path[PATH_MAX];
+    snprintf(path, sizeof(path), "%s/kilo-XXXXXX", dir && dir[0] ? dir : "/tmp");
+    i32 fd = mkstemp(path);
+    if (fd != -1) {
+        unlink(path);
+        if (writeAll(fd, stream->base, size)
+            && mmap(stream->base, STREAM_RESERVE_BYTES, PROT_READ, MAP_SHARED | MAP_FIXED, fd, 0) != MAP_FAILED) {
+            stream->spillFd = fd;
+            result = true;
+        } else {
+            close(fd);
+        }
+    }
+    return result;
+}
+
+function void
+streamFail(Stream* stream, const char* reason) {
+    snprintf(stream->error, sizeof(stream->error), "%s", reason);
+}
+
+// NOTE(sen) Read the first few bytes, enough to tell if the input is compressed. They are kept in
+// `input` to be decompressed or passed on.
+function b32
+streamDetect(Stream* stream) {
+    b32 result = true;
+    for (;;) {
+        // NOTE(sen) Only wait for more if what's there could still turn out to be a magic number
+        b32 maybeMagic = stream->inputLen == 0 || (stream->input[0] == '\x1f' && stream->inputLen < 2)
+            || (stream->input[0] == '\x28' && stream->inputLen < 4);
+        if (!maybeMagic) {
+            break;
+        }
+        isize nread = read(stream->fd, stream->input + stream->inputLen, STREAM_INPUT_BYTES - stream->inputLen);
+        if (nread == -1 && errno == EINTR) {
+            continue;
+        }
+        if (nread == -1) {
+            streamFail(stream, strerror(errno));
+            result = false;
+        }
+        if (nread <= 0) {
+            break;
+        }
+        stream->inputLen += nread;
+    }
+    stream->compression = result ? detectCompression(stream->input, stream->inputLen) : Compression_None;
+    if (stream->compression == Compression_Gzip) {
+        // NOTE(sen) 16 means a gzip wrapper instead of zlib's
+        if (inflateInit2(&stream->zlib, 15 + 16) != Z_OK) {
+            streamFail(stream, "inflateInit2 failed");
+            result = false;
+        }
+    } else if (stream->compression == Compression_Zstd) {
+        if (!zstdLoad() || !(stream->zstd = ZSTD.createDCtx())) {
+            streamFail(stream, "zstd needs libzstd.so.1");
+            result = false;
+        }
+    }
+    return result;
+}
+
+// NOTE(sen) Next piece of the input, decompressed if it needs to be. Returns how many bytes went
+// into `dest`, 0 at the end of the input and -1 if something went wrong (that goes in `error`).
+function isize
+streamProduce(Stream* stream, char* dest, usize len) {
+    isize result = 0;
+    if (stream->compression == Compression_None && stream->inputPos < stream->inputLen) {
+        result = stream->inputLen - stream->inputPos < len ? stream->inputLen - stream->inputPos : len;
+        memcpy(dest, stream->input + stream->inputPos, result);
+        stream->inputPos += result;
+    } else if (stream->compression == Compression_None) {
+        do {
+            result = read(stream->fd, dest, len);
+        } while (result == -1 && errno == EINTR);
+        if (result == -1) {
+            streamFail(stream, strerror(errno));
+        }
+    } else {
+        while (result == 0) {
+            if (stream->inputPos == stream->inputLen) {
+                isize nread = read(stream->fd, stream->input, STREAM_INPUT_BYTES);
+                if (nread == -1 && errno == EINTR) {
+                    continue;
+                }
+                if (nread == -1) {
+                    streamFail(stream, strerror(errno));
+                    result = -1;
+                } else if (nread == 0 && stream->inFrame) {
+                    streamFail(stream, "compressed data is cut short");
+                    result = -1;
+                }
+                if (nread <= 0) {
+                    break;
+                }
+                stream->inputLen = nread;
+                stream->inputPos = 0;
+            }
+            char* in = stream->input + stream->inputPos;
+            usize inLen = stream->inputLen - stream->inputPos;
+            if (stream->compression == Compression_Gzip) {
+                stream->zlib.next_in = (u8*)in;
+                stream->zlib.avail_in = inLen;
+                stream->zlib.next_out = (u8*)dest;
+                stream->zlib.avail_out = len;
+                i32 status = inflate(&stream->zlib, Z_NO_FLUSH);
+                if (status != Z_OK && status != Z_STREAM_END) {
+                    streamFail(stream, stream->zlib.msg ? stream->zlib.msg : "bad gzip data");
+                    result = -1;
+                    break;
+                }
+                stream->inputPos += inLen - stream->zlib.avail_in;
+                result = len - stream->zlib.avail_out;
+                stream->inFrame = status != Z_STREAM_END;
+                if (status == Z_STREAM_END) {
+                    // NOTE(sen) Another member can follow, like with `cat a.gz b.gz`
+                    inflateReset(&stream->zlib);
+                }
+            } else {
+                ZstdInBuffer zin = {in, inLen, 0};
+                ZstdOutBuffer zout = {dest, len, 0};
+                usize status = ZSTD.decompressStream(stream->zstd, &zout, &zin);
+                if (ZSTD.isError(status)) {
+                    streamFail(stream, ZSTD.getErrorName(status));
+                    result = -1;
+                    break;
+                }
+                stream->inputPos += zin.pos;
+                result = zout.pos;
+                stream->inFrame = status != 0;
+            }
+        }
+    }
+    return result;
+}
+
+function void*
+streamThread(void* arg) {
+    Stream* stream = arg;
+    char* staging = 0;
+    usize size = 0;
+    b32 reading = streamDetect(stream);
+    while (reading) {
+        if (stream->spillFd == -1 && size == STREAM_MEMORY_BYTES) {
+            if (!streamSpill(stream, size)) {
+                streamFail(stream, strerror(errno));
+                break;
+            }
+            staging = malloc(STREAM_READ_BYTES);
+        }
+        if (size + STREAM_READ_BYTES > STREAM_RESERVE_BYTES) {
+            streamFail(stream, "too big");
+            break;
+        }
+        // NOTE(sen) Straight into place while in memory, through the temp file after that
+        char* dest = staging ? staging : stream->base + size;
+        usize len = STREAM_READ_BYTES;
+        if (!staging && STREAM_MEMORY_BYTES - size < len) {
+            len = STREAM_MEMORY_BYTES - size;
+        }
+        isize nProduced = streamProduce(stream, dest, len);
+        if (nProduced <= 0) {
+            break;
+        }
+        if (staging && !writeAll(stream->spillFd, staging, nProduced)) {
+            streamFail(stream, strerror(errno));
+            break;
+        }
+        size += nProduced;
+        pthread_mutex_lock(&stream->mutex);
+        __atomic_store_n(&stream->size, size, __ATOMIC_RELEASE);
+        pthread_cond_broadcast(&stream->progress);
+        pthread_mutex_unlock(&stream->mutex);
+        write(stream->wakeFds[1], "", 1);
+    }
+    if (stream->compression == Compression_Gzip) {
+        inflateEnd(&stream->zlib);
+    } else if (stream->zstd) {
+        ZSTD.freeDCtx(stream->zstd);
+    }
+    free(staging);
+    free(stream->input);
+    close(stream->fd);
+    pthread_mutex_lock(&stream->mutex);
+    __atomic_store_n(&stream->ended, true, __ATOMIC_RELEASE);
+    pthread_cond_broadcast(&stream->progress);
+    pthread_mutex_unlock(&stream->mutex);
+    write(stream->wakeFds[1], "", 1);
+    return 0;
+}
+
+function void
+streamStart(Stream* stream, i32 fd, b32 regularFile) {
+    stream->fd = fd;
+    stream->regularFile = regularFile;
+    stream->spillFd = -1;
+    stream->input = malloc(STREAM_INPUT_BYTES);
+    // NOTE(sen) Only the part that is kept in memory is writable (and counts against overcommit)
+    stream->base = mmap(0, STREAM_RESERVE_BYTES, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (stream->base == MAP_FAILED) { die("mmap"); }
+    if (mprotect(stream->base, STREAM_MEMORY_BYTES, PROT_READ | PROT_WRITE)) { die("mprotect"); }
+    if (pipe2(stream->wakeFds, O_NONBLOCK | O_CLOEXEC)) { die("pipe2"); }
+    pthread_mutex_init(&stream->mutex, 0);
+    pthread_cond_init(&stream->progress, 0);
+    if (pthread_create(&stream->thread, 0, streamThread, stream)) { die("pthread_create"); }
+}
+
+// NOTE(sen) Like `pollInput`, but also returns when more of the pipe has been read. That is held
+// back until a frame interval has passed since last time so that a fast pipe doesn't redraw for
+// every read. Returns true if there is input.
+function b32
+streamWaitForInput(Stream* stream, i32 timeoutMs) {
+    struct pollfd pfds[2] = {{.fd = STDIN_FILENO, .events = POLLIN}, {.fd = stream->wakeFds[0], .events = POLLIN}};
+    i32 nReady = poll(pfds, 2, timeoutMs);
+    if (nReady == -1 && errno != EINTR) { die("poll"); }
+    if (nReady > 0 && (pfds[1].revents & POLLIN)) {
+        char drained[64];
+        while (read(stream->wakeFds[0], drained, sizeof(drained)) > 0) {}
+        f64 remaining = stream->lastFrameTime + FRAME_SECONDS - getTimeSeconds();
+        if (remaining > 0 && !(pfds[0].revents & POLLIN)) {
+            nReady = poll(pfds, 1, (i32)(remaining * 1000) + 1);
+            if (nReady == -1 && errno != EINTR) { die("poll"); }
+        }
+    }
+    b32 result = nReady > 0 && (pfds[0].revents & POLLIN);
+    stream->lastFrameTime = getTimeSeconds();
+    return result;
+}
+
+function char*
+findSubstringScalar(char* haystack, usize haystackLen, char* needle, usize needleLen) {
+    char* result = 0;
+    if (needleLen > 0 && haystackLen >= needleLen) {
+        char* last = haystack + haystackLen - needleLen;
+        char* candidate = haystack;
+        while (candidate <= last && (candidate = memchr(candidate, needle[0], last - candidate + 1))) {
+            if (memcmp(candidate + 1, needle + 1, needleLen - 1) == 0) {
+                result = candidate;
+                break;
+            }
+            candidate++;
+        }
+    }
+    return result;
+}
+
+#if defined(__x86_64__)
+
+// NOTE(sen) Compare the first and the last byte of the needle against a block of positions at
+// once and only look at the rest of the needle where both match
+function char*
+findSubstringSSE2(char* haystack, usize haystackLen, char* needle, usize needleLen) {
+    char* result = 0;
+    usize pos = 0;
+    if (needleLen > 0 && haystackLen >= needleLen) {
+        __m128i first = _mm_set1_epi8(needle[0]);
+        __m128i last = _mm_set1_epi8(needle[needleLen - 1]);
+        for (; pos + needleLen - 1 + 16 <= haystackLen && !result; pos += 16) {
+            __m128i blockFirst = _mm_loadu_si128((__m128i*)(haystack + pos));
+            __m128i blockLast = _mm_loadu_si128((__m128i*)(haystack + pos + needleLen - 1));
+            u32 mask = _mm_movemask_epi8(_mm_and_si128(_mm_cmpeq_epi8(first, blockFirst), _mm_cmpeq_epi8(last, blockLast)));
+            while (mask) {
+                i32 bit = __builtin_ctz(mask);
+                if (memcmp(haystack + pos + bit + 1, needle + 1, needleLen - 1) == 0) {
+                    result = haystack + pos + bit;
+                    break;
+                }
+                mask &= mask - 1;
+            }
+        }
+    }
+    if (!result && pos < haystackLen) {
+        result = findSubstringScalar(haystack + pos, haystackLen - pos, needle, needleLen);
+    }
+    return result;
+}
+
+__attribute__((target("avx2"))) function char*
+findSubstringAVX2(char* haystack, usize haystackLen, char* needle, usize needleLen) {
+    char* result = 0;
+    usize pos = 0;
+    if (needleLen > 0 && haystackLen >= needleLen) {
+        __m256i first = _mm256_set1_epi8(needle[0]);
+        __m256i last = _mm256_set1_epi8(needle[needleLen - 1]);
+        for (; pos + needleLen - 1 + 32 <= haystackLen && !result; pos += 32) {
+            __m256i blockFirst = _mm256_loadu_si256((__m256i*)(haystack + pos));
+            __m256i blockLast = _mm256_loadu_si256((__m256i*)(haystack + pos + needleLen - 1));
+            u32 mask = (uint32_t)_mm256_movemask_epi8(
+                _mm256_and_si256(_mm256_cmpeq_epi8(first, blockFirst), _mm256_cmpeq_epi8(last, blockLast))
+            );
+            while (mask) {
+                i32 bit = __builtin_ctz(mask);
+                if (memcmp(haystack + pos + bit + 1, needle + 1, needleLen - 1) == 0) {
+                    result = haystack + pos + bit;
+                    break;
+                }
+                mask &= mask - 1;
+            }
+        }
+    }
+    if (!result && pos < haystackLen) {
+        result = findSubstringSSE2(haystack + pos, haystackLen - pos, needle, needleLen);
+    }
+    return result;
+}
+
+#endif
+
+// NOTE(sen) First occurrence of `needle` in `haystack`, 0 if there isn't one
+function char*
+findSubstring(char* haystack, usize haystackLen, char* needle, usize needleLen) {
+    char* result;
+#if defined(__x86_64__)
+    if (__builtin_cpu_supports("avx2")) {
+        result = findSubstringAVX2(haystack, haystackLen, needle, needleLen);
+    } else {
+        result = findSubstringSSE2(haystack, haystackLen, needle, needleLen);
+    }
+#else
+    result = findSubstringScalar(haystack, haystackLen, needle, needleLen);
+#endif
+    return result;
+}
+
+// NOTE(sen) Last occurrence of `needle` in `haystack`, 0 if there isn't one
+function char*
+findSubstringLast(char* haystack, usize haystackLen, char* needle, usize needleLen) {
+    char* result = 0;
+    if (needleLen > 0 && haystackLen >= needleLen) {
+        usize searchLen = haystackLen - needleLen + 1;
+        char* candidate;
+        while (searchLen > 0 && (candidate = memrchr(haystack, needle[0], searchLen))) {
+            if (memcmp(candidate + 1, needle + 1, needleLen - 1) == 0) {
+                result = candidate;
+                break;
+            }
+            searchLen = candidate - haystack;
+        }
+    }
+    return result;
+}
+
+// NOTE(sen) First match at or after `from`, -1 if none. Doesn't move the gap so it's safe to call
+// from several threads at once.
+function i32
+gbFind(GapBuffer* gb, i32 from, char* needle, i32 needleLen) {
+    i32 result = -1;
+    i32 gapLen = gb->gapEnd - gb->gapStart;
+    if (from < gb->gapStart) {
+        char* found = findSubstring(gb->buf + from, gb->gapStart - from, needle, needleLen);
+        if (found) {
+            result = found - gb->buf;
+        }
+    }
+    // NOTE(sen) Matches that go across the gap
+    if (result == -1 && needleLen > 1 && gb->gapStart > from && gb->gapEnd < gb->cap) {
+        char straddle[2 * sizeof(((FindState*)0)->query)];
+        i32 before = needleLen - 1 < gb->gapStart - from ? needleLen - 1 : gb->gapStart - from;
+        i32 after = needleLen - 1 < gb->cap - gb->gapEnd ? needleLen - 1 : gb->cap - gb->gapEnd;
+        if (before + after <= (i32)sizeof(straddle)) {
+            memcpy(straddle, gb->buf + gb->gapStart - before, before);
+            memcpy(straddle + before, gb->buf + gb->gapEnd, after);
+            char* found = findSubstring(straddle, before + after, needle, needleLen);
+            if (found) {
+                result = gb->gapStart - before + (found - straddle);
+            }
+        }
+    }
+    if (result == -1) {
+        i32 backFrom = from > gb->gapStart ? from : gb->gapStart;
+        char* backStart = gb->buf + backFrom + gapLen;
+        char* found = findSubstring(backStart, gb->buf + gb->cap - backStart, needle, needleLen);
+        if (found) {
+            result = found - gb->buf - gapLen;
+        }
+    }
+    return result;
+}
+
+// NOTE(sen) Last match that starts before `before`, -1 if none. Only for the main thread, moves the gap.
+function i32
+gbFindLast(GapBuffer* gb, i32 before, char* needle, i32 needleLen) {
+    i32 result = -1;
+    i32 len = gbLen(gb);
+    i32 searchLen = before + needleLen - 1 < len ? before + needleLen - 1 : len;
+    char* chars = gbContiguous(gb);
+    char* found = findSubstringLast(chars, searchLen, needle, needleLen);
+    if (found) {
+        result = found - chars;
+    }
+    return result;
+}
+
+function void
+findTask(void* arg) {
+    FindTask* task = arg;
+    // NOTE(sen) Nothing to do if an earlier piece already has a match
+    if (__atomic_load_n(task->firstFoundTask, __ATOMIC_RELAXED) > task->taskIndex) {
+        if (task->bytes) {
+            task->matchByte = findSubstring(task->bytes, task->bytesLen, task->needle, task->needleLen);
+            task->found = task->matchByte != 0;
+        } else {
+            for (i32 rowIndex = 0; rowIndex < task->nRows && !task->found; rowIndex++) {
+                i32 matchX = gbFind(&task->rows[rowIndex].fileChars, 0, task->needle, task->needleLen);
+                if (matchX != -1) {
+                    task->found = true;
+                    task->matchRow = task->firstRow + rowIndex;
+                    task->matchX = matchX;
+                }
+            }
+        }
+        if (task->found) {
+            i32 current = __atomic_load_n(task->firstFoundTask, __ATOMIC_RELAXED);
+            while (current > task->taskIndex
+                   && !__atomic_compare_exchange_n(task->firstFoundTask, &current, task->taskIndex, false, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {}
+        }
+    }
+}
+
+function FindTask*
+addFindTask(FindTask** tasks, i32* nTasks, i32* tasksCap) {
+    if (*nTasks == *tasksCap) {
+        *tasksCap = *tasksCap ? *tasksCap * 2 : 64;
+        *tasks = realloc(*tasks, *tasksCap * sizeof(FindTask));
+    }
+    FindTask* task = *tasks + (*nTasks)++;
+    memset(task, 0, sizeof(FindTask));
+    return task;
+}
+
+// NOTE(sen) Run the pieces in order until one matches, or all at once on the workers when there
+// is enough to search. Returns the index of the first piece with a match, -1 if none.
+function i32
+runFindTasks(FindTask* tasks, i32 nTasks, usize totalBytes) {
+    i32 firstFoundTask = INT32_MAX;
+    for (i32 taskIndex = 0; taskIndex < nTasks; taskIndex++) {
+        tasks[taskIndex].taskIndex = taskIndex;
+        tasks[taskIndex].firstFoundTask = &firstFoundTask;
+    }
+    if (nTasks > 1 && totalBytes >= FIND_PARALLEL_MIN_BYTES) {
+        poolRun(&WORKER_POOL, findTask, tasks, sizeof(FindTask), nTasks);
+    } else {
+        for (i32 taskIndex = 0; taskIndex < nTasks && firstFoundTask == INT32_MAX; taskIndex++) {
+            findTask(tasks + taskIndex);
+        }
+    }
+    i32 result = firstFoundTask == INT32_MAX ? -1 : firstFoundTask;
+    return result;
+}
+
+// NOTE(sen) Cut raw byte ranges into pieces so that every worker gets some, pieces overlap by the
+// needle length so nothing falls between them
+function void
+addFindByteTasks(
+    FindTask** tasks, i32* nTasks, i32* tasksCap, char* bytes, usize bytesLen, usize pieceLen,
+    char* needle, i32 needleLen, i32 blockStart, i32 blockEnd
+) {
+    for (usize start = 0; start < bytesLen; start += pieceLen) {
+        usize end = start + pieceLen + needleLen - 1;
+        if (end > bytesLen) {
+            end = bytesLen;
+        }
+        FindTask* task = addFindTask(tasks, nTasks, tasksCap);
+        task->needle = needle;
+        task->needleLen = needleLen;
+        task->bytes = bytes + start;
+        task->bytesLen = end - start;
+        task->blockStart = blockStart;
+        task->blockEnd = blockEnd;
+    }
+}
+
+function usize
+findPieceLen(usize totalBytes) {
+    usize result = totalBytes / poolWidth(&WORKER_POOL) + 1;
+    if (result < FIND_PARALLEL_MIN_BYTES) {
+        result = FIND_PARALLEL_MIN_BYTES;
+    }
+    return result;
+}
+
+// NOTE(sen) First match in rows [rowStart, rowEnd). Blocks that aren't loaded are searched as
+// raw bytes so nothing gets split into rows unless it has the match.
+function b32
+findInRowRange(EditorState* state, i32 rowStart, i32 rowEnd, char* needle, i32 needleLen, i32* matchRow, i32* matchX) {
+    b32 found = false;
+    if (rowStart < rowEnd) {
+        // NOTE(sen) First go over the blocks to see how much there is to search
+        usize totalBytes = 0;
+        {
+            i32 firstRow;
+            i32 blockIndex = findRowBlock(state, rowStart, &firstRow);
+            for (; blockIndex < state->nBlocks && firstRow < rowEnd; blockIndex++) {
+                RowBlock* block = state->blocks + blockIndex;
+                totalBytes += block->loaded ? block->nRows * 64 : block->mapEnd - block->mapStart;
+                firstRow += block->nRows;
+            }
+        }
+        usize pieceLen = findPieceLen(totalBytes);
+
+        FindTask* tasks = 0;
+        i32 nTasks = 0;
+        i32 tasksCap = 0;
+        i32 firstRow;
+        i32 blockIndex = findRowBlock(state, rowStart, &firstRow);
+        i32 rowIndex = rowStart;
+        while (rowIndex < rowEnd && blockIndex < state->nBlocks) {
+            RowBlock* block = state->blocks + blockIndex;
+            i32 blockEndRow = firstRow + block->nRows;
+            if (!block->loaded && rowIndex == firstRow && blockEndRow <= rowEnd) {
+                // NOTE(sen) Runs of unloaded blocks are next to each other in the mapping
+                i32 runEnd = blockIndex + 1;
+                while (runEnd < state->nBlocks && !state->blocks[runEnd].loaded
+                       && state->blocks[runEnd].mapStart == state->blocks[runEnd - 1].mapEnd
+                       && blockEndRow + state->blocks[runEnd].nRows <= rowEnd) {
+                    blockEndRow += state->blocks[runEnd].nRows;
+                    runEnd++;
+                }
+                usize runStart = block->mapStart;
+                usize runLen = state->blocks[runEnd - 1].mapEnd - runStart;
+                addFindByteTasks(
+                    &tasks, &nTasks, &tasksCap, state->mapBase + runStart, runLen, pieceLen,
+                    needle, needleLen, blockIndex, runEnd
+                );
+                blockIndex = runEnd;
+            } else {
+                if (block->nRows > 0) {
+                    loadRowBlock(state, block);
+                    i32 end = blockEndRow < rowEnd ? blockEndRow : rowEnd;
+                    FindTask* task = addFindTask(&tasks, &nTasks, &tasksCap);
+                    task->needle = needle;
+                    task->needleLen = needleLen;
+                    task->rows = block->rows + rowIndex - firstRow;
+                    task->nRows = end - rowIndex;
+                    task->firstRow = rowIndex;
+                }
+                blockIndex++;
+            }
+            rowIndex = blockEndRow;
+            firstRow = blockEndRow;
+        }
+
+        i32 foundTask = runFindTasks(tasks, nTasks, totalBytes);
+        if (foundTask != -1) {
+            FindTask* task = tasks + foundTask;
+            found = true;
+            if (task->bytes) {
+                locateMapByte(state, task->blockStart, task->blockEnd, task->matchByte, matchRow, matchX);
+            } else {
+                *matchRow = task->matchRow;
+                *matchX = task->matchX;
+            }
+        }
+        free(tasks);
+    }
+    return found;
+}
+
+// NOTE(sen) First match in raw bytes
+function char*
+findInBytes(char* bytes, usize bytesLen, char* needle, i32 needleLen) {
+    FindTask* tasks = 0;
+    i32 nTasks = 0;
+    i32 tasksCap = 0;
+    addFindByteTasks(&tasks, &nTasks, &tasksCap, bytes, bytesLen, findPieceLen(bytesLen), needle, needleLen, 0, 0);
+    i32 foundTask = runFindTasks(tasks, nTasks, bytesLen);
+    char* result = foundTask == -1 ? 0 : tasks[foundTask].matchByte;
+    free(tasks);
+    return result;
+}
+
+// NOTE(sen) Last match in rows [rowStart, rowEnd), going backwards is rare enough to do on this thread
+function b32
+findLastInRowRange(EditorState* state, i32 rowStart, i32 rowEnd, char* needle, i32 needleLen, i32* matchRow, i32* matchX) {
+    b32 found = false;
+    if (rowStart < rowEnd) {
+        i32 firstRow;
+        i32 blockIndex = findRowBlock(state, rowEnd - 1, &firstRow);
+        while (!found && rowEnd > rowStart && blockIndex >= 0) {
+            RowBlock* block = state->blocks + blockIndex;
+            i32 low = firstRow > rowStart ? firstRow : rowStart;
+            if (!block->loaded && low == firstRow && rowEnd == firstRow + block->nRows) {
+                char* byte = findSubstringLast(
+                    state->mapBase + block->mapStart, block->mapEnd - block->mapStart, needle, needleLen
+                );
+                if (byte) {
+                    found = true;
+                    locateMapByte(state, blockIndex, blockIndex + 1, byte, matchRow, matchX);
+                }
+            } else if (block->nRows > 0) {
+                loadRowBlock(state, block);
+                for (i32 rowIndex = rowEnd - 1; rowIndex >= low && !found; rowIndex--) {
+                    GapBuffer* gb = &block->rows[rowIndex - firstRow].fileChars;
+                    i32 x = gbFindLast(gb, gbLen(gb), needle, needleLen);
+                    if (x != -1) {
+                        found = true;
+                        *matchRow = rowIndex;
+                        *matchX = x;
+                    }
+                }
+            }
+            rowEnd = firstRow;
+            blockIndex--;
+            if (blockIndex >= 0) {
+                firstRow -= state->blocks[blockIndex].nRows;
+            }
+        }
+    }
+    return found;
+}
+
+// NOTE(sen) Match in the part of the mapping the line index hasn't got to yet, waits for the index
+// to get there so the match has a row
+function b32
+findInUnindexed(EditorState* state, char* needle, i32 needleLen, b32 backwards, i32* matchRow, i32* matchX) {
+    b32 found = false;
+    if (!rowsComplete(state)) {
+        char* unindexed = state->mapBase + state->blocksMapEnd;
+        usize unindexedLen = state->mapSize - state->blocksMapEnd;
+        char* byte = backwards ? findSubstringLast(unindexed, unindexedLen, needle, needleLen)
+                               : findInBytes(unindexed, unindexedLen, needle, needleLen);
+        if (byte) {
+            found = true;
+            i32 blockStart = state->nBlocks;
+            ensureRowsThroughByte(state, byte - state->mapBase);
+            locateMapByte(state, blockStart, state->nBlocks, byte, matchRow, matchX);
+        }
+    }
+    return found;
+}
+
+// NOTE(sen) Search the whole document starting at (startRow, startX) and wrapping around
+function b32
+findMatch(
+    EditorState* state, char* needle, i32 needleLen, i32 startRow, i32 startX, b32 backwards,
+    i32* matchRow, i32* matchX
+) {
+    b32 found = false;
+    if (needleLen > 0) {
+        b32 startInRows = startRow < state->nRows;
+        if (!backwards) {
+            if (startInRows) {
+                i32 x = gbFind(&getRow(state, startRow)->fileChars, startX, needle, needleLen);
+                if (x != -1) {
+                    found = true;
+                    *matchRow = startRow;
+                    *matchX = x;
+                }
+            }
+            if (!found) {
+                found = findInRowRange(state, startRow + 1, state->nRows, needle, needleLen, matchRow, matchX);
+            }
+            if (!found) {
+                found = findInUnindexed(state, needle, needleLen, false, matchRow, matchX);
+            }
+            if (!found) {
+                i32 wrapEnd = startInRows ? startRow + 1 : state->nRows;
+                found = findInRowRange(state, 0, wrapEnd, needle, needleLen, matchRow, matchX);
+            }
+        } else {
+            if (startInRows) {
+                i32 x = gbFindLast(&getRow(state, startRow)->fileChars, startX, needle, needleLen);
+                if (x != -1) {
+                    found = true;
+                    *matchRow = startRow;
+                    *matchX = x;
+                }
+            }
+            if (!found) {
+                i32 end = startInRows ? startRow : state->nRows;
+                found = findLastInRowRange(state, 0, end, needle, needleLen, matchRow, matchX);
+            }
+            if (!found) {
+                found = findInUnindexed(state, needle, needleLen, true, matchRow, matchX);
+            }
+            if (!found) {
+                found = findLastInRowRange(state, startRow, state->nRows, needle, needleLen, matchRow, matchX);
+            }
+        }
+    }
+    return found;
+}
+
+function void
+setFindMessage(EditorState* state, FindState* find) {
+    state->userMessageLen = snprintf(
+        state->userMessage, sizeof(state->userMessage), "Search: %.*s%s (Esc/Enter, Ctrl-H/Ctrl-L = prev/next)",
+        find->queryLen, find->query, find->found || find->queryLen == 0 ? "" : " [no match]"
+    );
+}
+
+// NOTE(sen) Moves the cursor to the next/previous match of the current query
+function void
+findStep(EditorState* state, FindState* find, i32 startRow, i32 startX, b32 backwards, char tabChar, i32 replacementsPerTab) {
+    i32 matchRow;
+    i32 matchX;
+    find->found = findMatch(state, find->query, find->queryLen, startRow, startX, backwards, &matchRow, &matchX);
+    if (find->found) {
+        state->cursorY = matchRow;
+        state->cursorFileX = matchX;
+        state->cursorRenderX = renderXForFileX(getRow(state, matchRow), matchX, tabChar, replacementsPerTab);
+    }
+}
+
+function void
+findStart(EditorState* state, FindState* find) {
+    find->active = true;
+    find->queryLen = 0;
+    find->found = false;
+    find->savedCursorY = state->cursorY;
+    find->savedCursorFileX = state->cursorFileX;
+    find->savedRowOffset = state->rowOffset;
+    find->savedColOffset = state->colOffset;
+    find->savedWrapOffset = state->wrapOffset;
+    setFindMessage(state, find);
+}
+
+// NOTE(sen) Keys while the search prompt is up
+function void
+findHandleKey(EditorState* state, FindState* find, i32 key, char tabChar, i32 replacementsPerTab) {
+    switch (key) {
+    case '\r': {
+        find->active = false;
+        state->userMessageLen = 0;
+    } break;
+    case '\x1b': {
+        find->active = false;
+        state->userMessageLen = 0;
+        state->cursorY = find->savedCursorY;
+        state->cursorFileX = find->savedCursorFileX;
+        state->rowOffset = find->savedRowOffset;
+        state->colOffset = find->savedColOffset;
+        state->wrapOffset = find->savedWrapOffset;
+        if (state->cursorY < state->nRows) {
+            state->cursorRenderX = renderXForFileX(getRow(state, state->cursorY), state->cursorFileX, tabChar, replacementsPerTab);
+        }
+    } break;
+    case Key_ArrowDown: case Key_ArrowRight: case CTRL_KEY('l'): case CTRL_KEY('f'): {
+        findStep(state, find, state->cursorY, state->cursorFileX + 1, false, tabChar, replacementsPerTab);
+    } break;
+    case Key_ArrowUp: case Key_ArrowLeft: case CTRL_KEY('h'): {
+        findStep(state, find, state->cursorY, state->cursorFileX, true, tabChar, replacementsPerTab);
+    } break;
+    case Key_Backspace: {
+        if (find->queryLen > 0) {
+            find->queryLen--;
+            findStep(state, find, find->savedCursorY, find->savedCursorFileX, false, tabChar, replacementsPerTab);
+        }
+    } break;
+    default: {
+        // NOTE(sen) Every change to the query searches again from where the search started
+        if (key >= 32 && key < 127 && find->queryLen < (i32)sizeof(find->query)) {
+            find->query[find->queryLen++] = (char)key;
+            findStep(state, find, find->savedCursorY, find->savedCursorFileX, false, tabChar, replacementsPerTab);
+        }
+    } break;
+    }
+    if (find->active) {
+        setFindMessage(state, find);
+    }
+}
+
+function i32
+regexAddNode(RegexParser* parser, RegexNodeKind kind) {
+    if (parser->nNodes == parser->nodesCap) {
+        parser->nodesCap = parser->nodesCap ? parser->nodesCap * 2 : 64;
+        parser->nodes = realloc(parser->nodes, parser->nodesCap * sizeof(RegexNode));
+    }
+    i32 result = parser->nNodes++;
+    RegexNode* node = parser->nodes + result;
+    memset(node, 0, sizeof(RegexNode));
+    node->kind = kind;
+    node->out = -1;
+    node->out1 = -1;
+    return result;
+}
+
+function RegexFragment
+regexSingle(RegexParser* parser, RegexNodeKind kind) {
+    i32 node = regexAddNode(parser, kind);
+    RegexFragment result = {node, node};
+    return result;
+}
+
+function void
+regexAddBytes(u64* bytes, i32 first, i32 last) {
+    for (i32 byte = first; byte <= last; byte++) {
+        bytes[byte >> 6] |= (u64)1 << (byte & 63);
+    }
+}
+
+function b32
+regexHasByte(u64* bytes, u8 byte) {
+    b32 result = (bytes[byte >> 6] >> (byte & 63)) & 1;
+    return result;
+}
+
+function RegexFragment
+regexBytes(RegexParser* parser, u64* bytes) {
+    RegexFragment result = regexSingle(parser, RegexNodeKind_Bytes);
+    memcpy(parser->nodes[result.start].bytes, bytes, sizeof(parser->nodes[result.start].bytes));
+    return result;
+}
+
+function RegexFragment
+regexByteRange(RegexParser* parser, i32 first, i32 last) {
+    u64 bytes[4] = {};
+    regexAddBytes(bytes, first, last);
+    RegexFragment result = regexBytes(parser, bytes);
+    return result;
+}
+
+function RegexFragment
+regexConcat(RegexParser* parser, RegexFragment first, RegexFragment second) {
+    if (parser->reverse) {
+        RegexFragment temp = first;
+        first = second;
+        second = temp;
+    }
+    parser->nodes[first.end].out = second.start;
+    RegexFragment result = {first.start, second.end};
+    return result;
+}
+
+function RegexFragment
+regexAlternate(RegexParser* parser, RegexFragment first, RegexFragment second) {
+    i32 split = regexAddNode(parser, RegexNodeKind_Split);
+    i32 end = regexAddNode(parser, RegexNodeKind_Empty);
+    parser->nodes[split].out = first.start;
+    parser->nodes[split].out1 = second.start;
+    parser->nodes[first.end].out = end;
+    parser->nodes[second.end].out = end;
+    RegexFragment result = {split, end};
+    return result;
+}
+
+// NOTE(sen) Any whole UTF-8 character that isn't ASCII, going by the shape of its bytes
+function RegexFragment
+regexNonAscii(RegexParser* parser) {
+    RegexFragment result = {-1, -1};
+    u8 leads[3][2] = {{0xC2, 0xDF}, {0xE0, 0xEF}, {0xF0, 0xF4}};
+    for (i32 nContinuation = 1; nContinuation <= 3; nContinuation++) {
+        RegexFragment sequence = regexByteRange(parser, leads[nContinuation - 1][0], leads[nContinuation - 1][1]);
+        for (i32 byteIndex = 0; byteIndex < nContinuation; byteIndex++) {
+            sequence = regexConcat(parser, sequence, regexByteRange(parser, 0x80, 0xBF));
+        }
+        result = result.start == -1 ? sequence : regexAlternate(parser, result, sequence);
+    }
+    return result;
+}
+
+// NOTE(sen) The bytes of the pattern character at `at`, one after the other
+function RegexFragment
+regexLiteral(RegexParser* parser, i32 at, i32* charLen) {
+    u32 codepoint;
+    *charLen = utf8Decode(parser->pattern + at, parser->len - at, &codepoint);
+    RegexFragment result = regexByteRange(parser, (u8)parser->pattern[at], (u8)parser->pattern[at]);
+    for (i32 byteIndex = 1; byteIndex < *charLen; byteIndex++) {
+        u8 byte = (u8)parser->pattern[at + byteIndex];
+        result = regexConcat(parser, result, regexByteRange(parser, byte, byte));
+    }
+    return result;
+}
+
+// NOTE(sen) ASCII bytes of \d \w \s, the uppercase ones take everything else including all of
+// non-ASCII. False if `ch` isn't one of them.
+function b32
+regexEscapeClass(char ch, u64* bytes, b32* nonAscii) {
+    u64 classBytes[4] = {};
+    char lower = (char)tolower((unsigned char)ch);
+    b32 result = lower == 'd' || lower == 'w' || lower == 's';
+    if (result) {
+        for (i32 byte = 0; byte < 128; byte++) {
+            b32 in = lower == 'd' ? isdigit(byte) != 0 : lower == 'w' ? isalnum(byte) || byte == '_' : isspace(byte) != 0;
+            if (in != (ch != lower)) {
+                regexAddBytes(classBytes, byte, byte);
+            }
+        }
+        for (i32 word = 0; word < 4; word++) {
+            bytes[word] |= classBytes[word];
+        }
+        if (ch != lower) {
+            *nonAscii = true;
+        }
+    }
+    return result;
+}
+
+// NOTE(sen) [...] with ASCII ranges. Non-ASCII characters can be listed but not in ranges or
+// negated classes, a negated class takes every non-ASCII character.
+function RegexFragment
+regexParseClass(RegexParser* parser) {
+    u64 bytes[4] = {};
+    b32 nonAscii = false;
+    RegexFragment listed = {-1, -1};
+    parser->at++;
+    b32 negated = parser->at < parser->len && parser->pattern[parser->at] == '^';
+    if (negated) {
+        parser->at++;
+    }
+    b32 first = true;
+    while (!parser->error && parser->at < parser->len && (parser->pattern[parser->at] != ']' || first)) {
+        first = false;
+        char ch = parser->pattern[parser->at];
+        if (ch == '\\' && parser->at + 1 < parser->len && regexEscapeClass(parser->pattern[parser->at + 1], bytes, &nonAscii)) {
+            parser->at += 2;
+            continue;
+        }
+        if (ch == '\\' && parser->at + 1 < parser->len) {
+            parser->at++;
+            ch = parser->pattern[parser->at] == 't' ? '\t' : parser->pattern[parser->at];
+        }
+        if ((u8)ch >= 0x80) {
+            i32 charLen;
+            RegexFragment literal = regexLiteral(parser, parser->at, &charLen);
+            listed = listed.start == -1 ? literal : regexAlternate(parser, listed, literal);
+            parser->at += charLen;
+            if (negated) {
+                parser->error = "non-ASCII in [^...]";
+            }
+        } else if (parser->at + 2 < parser->len && parser->pattern[parser->at + 1] == '-' && parser->pattern[parser->at + 2] != ']') {
+            u8 last = (u8)parser->pattern[parser->at + 2];
+            if (last >= 0x80 || last < (u8)ch) {
+                parser->error = "bad range";
+            } else {
+                regexAddBytes(bytes, (u8)ch, last);
+            }
+            parser->at += 3;
+        } else {
+            regexAddBytes(bytes, (u8)ch, (u8)ch);
+            parser->at++;
+        }
+    }
+    if (!parser->error && parser->at == parser->len) {
+        parser->error = "missing ]";
+    }
+    parser->at++;
+
+    // NOTE(sen) ASCII is the first two words
+    if (negated) {
+        for (i32 word = 0; word < 2; word++) {
+            bytes[word] = ~bytes[word];
+        }
+        nonAscii = !nonAscii;
+    }
+    b32 anyBytes = false;
+    for (i32 word = 0; word < 4; word++) {
+        anyBytes = anyBytes || bytes[word];
+    }
+    RegexFragment result = listed;
+    if (anyBytes) {
+        RegexFragment ascii = regexBytes(parser, bytes);
+        result = result.start == -1 ? ascii : regexAlternate(parser, result, ascii);
+    }
+    if (nonAscii) {
+        RegexFragment any = regexNonAscii(parser);
+        result = result.start == -1 ? any : regexAlternate(parser, result, any);
+    }
+    if (result.start == -1) {
+        if (!parser->error) {
+            parser->error = "empty []";
+        }
+        result = regexSingle(parser, RegexNodeKind_Empty);
+    }
+    return result;
+}
+
+function RegexFragment regexParseAlternation(RegexParser* parser);
+
+function RegexFragment
+regexParseAtom(RegexParser* parser) {
+    RegexFragment result;
+    char ch = parser->pattern[parser->at];
+    if (ch == '(') {
+        parser->at++;
+        result = regexParseAlternation(parser);
+        if (parser->at < parser->len && parser->pattern[parser->at] == ')') {
+            parser->at++;
+        } else if (!parser->error) {
+            parser->error = "missing )";
+        }
+    } else if (ch == '[') {
+        result = regexParseClass(parser);
+    } else if (ch == '.') {
+        parser->at++;
+        result = regexAlternate(parser, regexByteRange(parser, 0, 0x7F), regexNonAscii(parser));
+    } else if (ch == '^' || ch == '$') {
+        // NOTE(sen) Backwards the row starts at its end
+        parser->at++;
+        result = regexSingle(parser, (ch == '^') != parser->reverse ? RegexNodeKind_LineStart : RegexNodeKind_LineEnd);
+    } else if (ch == '*' || ch == '+' || ch == '?') {
+        parser->error = "nothing to repeat";
+        result = regexSingle(parser, RegexNodeKind_Empty);
+    } else if (ch == '\\' && parser->at + 1 < parser->len) {
+        u64 bytes[4] = {};
+        b32 nonAscii = false;
+        char escaped = parser->pattern[parser->at + 1];
+        if (regexEscapeClass(escaped, bytes, &nonAscii)) {
+            parser->at += 2;
+            result = regexBytes(parser, bytes);
+            if (nonAscii) {
+                result = regexAlternate(parser, result, regexNonAscii(parser));
+            }
+        } else if (escaped == 't') {
+            parser->at += 2;
+            result = regexByteRange(parser, '\t', '\t');
+        } else {
+            i32 charLen;
+            result = regexLiteral(parser, parser->at + 1, &charLen);
+            parser->at += 1 + charLen;
+        }
+    } else {
+        i32 charLen;
+        result = regexLiteral(parser, parser->at, &charLen);
+        parser->at += charLen;
+    }
+    return result;
+}
+
+function RegexFragment
+regexParseRepeat(RegexParser* parser) {
+    RegexFragment result = regexParseAtom(parser);
+    while (parser->at < parser->len) {
+        char op = parser->pattern[parser->at];
+        if (op != '*' && op != '+' && op != '?') {
+            break;
+        }
+        parser->at++;
+        i32 split = regexAddNode(parser, RegexNodeKind_Split);
+        i32 end = regexAddNode(parser, RegexNodeKind_Empty);
+        parser->nodes[split].out = result.start;
+        parser->nodes[split].out1 = end;
+        if (op == '*') {
+            parser->nodes[result.end].out = split;
+            result = (RegexFragment) {split, end};
+        } else if (op == '+') {
+            parser->nodes[result.end].out = split;
+            result = (RegexFragment) {result.start, end};
+        } else {
+            parser->nodes[result.end].out = end;
+            result = (RegexFragment) {split, end};
+        }
+    }
+    return result;
+}
+
+function RegexFragment
+regexParseConcat(RegexParser* parser) {
+    RegexFragment result = regexSingle(parser, RegexNodeKind_Empty);
+    while (!parser->error && parser->at < parser->len && parser->pattern[parser->at] != '|' && parser->pattern[parser->at] != ')') {
+        result = regexConcat(parser, result, regexParseRepeat(parser));
+    }
+    return result;
+}
+
+function RegexFragment
+regexParseAlternation(RegexParser* parser) {
+    RegexFragment result = regexParseConcat(parser);
+    while (!parser->error && parser->at < parser->len && parser->pattern[parser->at] == '|') {
+        parser->at++;
+        result = regexAlternate(parser, result, regexParseConcat(parser));
+    }
+    return result;
+}
+
+function void
+regexBuilderPush(RegexBuilder* builder, i32* nStack, i32 node) {
+    if (node >= 0 && builder->marks[node] != builder->generation) {
+        builder->marks[node] = builder->generation;
+        builder->stack[(*nStack)++] = node;
+    }
+}
+
+function i32
+compareI32(const void* left, const void* right) {
+    i32 l = *(i32*)left;
+    i32 r = *(i32*)right;
+    i32 result = l < r ? -1 : l > r ? 1 : 0;
+    return result;
+}
+
+// NOTE(sen) Nodes reachable from `seeds` without taking a byte. Only nodes that take a byte, the
+// match and assertions that don't hold here are kept, sorted so that equal sets compare equal.
+function i32
+regexClosure(RegexBuilder* builder, i32* seeds, i32 nSeeds, b32 atLineStart, b32 atLineEnd, i32* result) {
+    builder->generation++;
+    i32 nStack = 0;
+    i32 nResult = 0;
+    for (i32 seedIndex = 0; seedIndex < nSeeds; seedIndex++) {
+        regexBuilderPush(builder, &nStack, seeds[seedIndex]);
+    }
+    while (nStack > 0) {
+        i32 nodeIndex = builder->stack[--nStack];
+        RegexNode* node = builder->nodes + nodeIndex;
+        b32 passes = node->kind == RegexNodeKind_Empty || node->kind == RegexNodeKind_Split
+            || (node->kind == RegexNodeKind_LineStart && atLineStart) || (node->kind == RegexNodeKind_LineEnd && atLineEnd);
+        if (passes) {
+            regexBuilderPush(builder, &nStack, node->out);
+            regexBuilderPush(builder, &nStack, node->out1);
+        } else {
+            result[nResult++] = nodeIndex;
+        }
+    }
+    qsort(result, nResult, sizeof(i32), compareI32);
+    return nResult;
+}
+
+function u32
+regexSetHash(i32* set, i32 n) {
+    u32 result = 2166136261u;
+    for (i32 index = 0; index < n; index++) {
+        result = (result ^ (u32)set[index]) * 16777619u;
+    }
+    return result;
+}
+
+// NOTE(sen) State for the set `closure[0..n)`, made if it's new. -1 once there are too many states.
+function i32
+regexDfaState(RegexBuilder* builder, RegexDfa* dfa, i32 nClasses, i32 n) {
+    i32* set = builder->closure;
+    u32 tableMask = 2 * REGEX_MAX_DFA_STATES - 1;
+    u32 slot = regexSetHash(set, n) & tableMask;
+    i32 result = -1;
+    for (; builder->table[slot] != -1; slot = (slot + 1) & tableMask) {
+        i32 state = builder->table[slot];
+        usize start = builder->setStarts[state];
+        if (builder->setStarts[state + 1] - start == (usize)n && memcmp(builder->sets + start, set, n * sizeof(i32)) == 0) {
+            result = state;
+            break;
+        }
+    }
+    if (result == -1 && dfa->nStates < REGEX_MAX_DFA_STATES) {
+        result = dfa->nStates++;
+        builder->table[slot] = result;
+        if (builder->setsLen + n > builder->setsCap) {
+            builder->setsCap = (builder->setsLen + n) * 2;
+            builder->sets = realloc(builder->sets, builder->setsCap * sizeof(i32));
+        }
+        memcpy(builder->sets + builder->setsLen, set, n * sizeof(i32));
+        builder->setsLen += n;
+        builder->setStarts[result + 1] = builder->setsLen;
+
+        dfa->next = realloc(dfa->next, dfa->nStates * nClasses * sizeof(i32));
+        dfa->accept = realloc(dfa->accept, dfa->nStates);
+        u8 accept = 0;
+        for (i32 index = 0; index < n; index++) {
+            if (builder->nodes[set[index]].kind == RegexNodeKind_Match) {
+                accept = REGEX_ACCEPT | REGEX_ACCEPT_AT_END;
+            }
+        }
+        i32 nEnd = regexClosure(builder, set, n, false, true, builder->endClosure);
+        for (i32 index = 0; index < nEnd; index++) {
+            if (builder->nodes[builder->endClosure[index]].kind == RegexNodeKind_Match) {
+                accept |= REGEX_ACCEPT_AT_END;
+            }
+        }
+        dfa->accept[result] = accept;
+    }
+    return result;
+}
+
+// NOTE(sen) Subset construction over byte classes. The search DFA goes back to the start after
+// every byte so a match can begin anywhere.
+function b32
+regexBuildDfa(RegexBuilder* builder, Regex* regex, RegexDfa* dfa, b32 search) {
+    builder->setsLen = 0;
+    builder->setStarts[0] = 0;
+    memset(builder->table, 0xFF, 2 * REGEX_MAX_DFA_STATES * sizeof(i32));
+    memset(dfa, 0, sizeof(RegexDfa));
+    b32 result = regexDfaState(builder, dfa, regex->nClasses, 0) == 0;
+
+    u8 representatives[256];
+    for (i32 byte = 255; byte >= 0; byte--) {
+        representatives[regex->byteClass[byte]] = (u8)byte;
+    }
+    i32 n = regexClosure(builder, &builder->start, 1, true, false, builder->closure);
+    dfa->startLine = regexDfaState(builder, dfa, regex->nClasses, n);
+    n = regexClosure(builder, &builder->start, 1, false, false, builder->closure);
+    dfa->startMid = regexDfaState(builder, dfa, regex->nClasses, n);
+    for (i32 state = 0; state < dfa->nStates && result; state++) {
+        for (i32 byteClass = 0; byteClass < regex->nClasses && result; byteClass++) {
+            u8 byte = representatives[byteClass];
+            i32 nSeeds = 0;
+            for (usize index = builder->setStarts[state]; index < builder->setStarts[state + 1]; index++) {
+                RegexNode* node = builder->nodes + builder->sets[index];
+                if (node->kind == RegexNodeKind_Bytes && regexHasByte(node->bytes, byte)) {
+                    builder->seeds[nSeeds++] = node->out;
+                }
+            }
+            if (search) {
+                builder->seeds[nSeeds++] = builder->start;
+            }
+            n = regexClosure(builder, builder->seeds, nSeeds, false, false, builder->closure);
+            i32 next = regexDfaState(builder, dfa, regex->nClasses, n);
+            dfa->next[state * regex->nClasses + byteClass] = next;
+            result = next != -1;
+        }
+    }
+    return result;
+}
+
+function void
+regexFinishDfa(Regex* regex, RegexDfa* dfa) {
+    i32 nClasses = regex->nClasses;
+    i32* renumbered = malloc(dfa->nStates * sizeof(i32));
+    i32 nNumbered = 0;
+    for (i32 pass = 0; pass < 2; pass++) {
+        if (pass == 1) {
+            dfa->firstAccept = nNumbered * nClasses;
+        }
+        for (i32 state = 0; state < dfa->nStates; state++) {
+            if ((dfa->accept[state] & REGEX_ACCEPT) == pass * REGEX_ACCEPT) {
+                renumbered[state] = nNumbered++;
+            }
+        }
+    }
+    i32* next = malloc(dfa->nStates * nClasses * sizeof(i32));
+    u8* accept = malloc(dfa->nStates);
+    for (i32 state = 0; state < dfa->nStates; state++) {
+        i32 to = renumbered[state];
+        accept[to] = dfa->accept[state];
+        for (i32 byteClass = 0; byteClass < nClasses; byteClass++) {
+            next[to * nClasses + byteClass] = renumbered[dfa->next[state * nClasses + byteClass]] * nClasses;
+        }
+    }
+    free(dfa->next);
+    free(dfa->accept);
+    dfa->next = next;
+    dfa->accept = accept;
+    dfa->startLine = renumbered[dfa->startLine] * nClasses;
+    dfa->startMid = renumbered[dfa->startMid] * nClasses;
+    free(renumbered);
+}
+
+function void
+regexFree(Regex* regex) {
+    free(regex->anchored.next);
+    free(regex->anchored.accept);
+    free(regex->search.next);
+    free(regex->search.accept);
+    free(regex->reverse.next);
+    free(regex->reverse.accept);
+    memset(regex, 0, sizeof(Regex));
+}
+
+// NOTE(sen) NFA for the whole pattern, ending in a `Match` node. Nodes are left in `parser`.
+function RegexFragment
+regexParse(RegexParser* parser, char* pattern, i32 patternLen, b32 reverse) {
+    memset(parser, 0, sizeof(RegexParser));
+    parser->pattern = pattern;
+    parser->len = patternLen;
+    parser->reverse = reverse;
+    RegexFragment result = regexParseAlternation(parser);
+    if (!parser->error && parser->at < parser->len) {
+        parser->error = "unmatched )";
+    }
+    // NOTE(sen) The match comes last either way round
+    i32 match = regexAddNode(parser, RegexNodeKind_Match);
+    parser->nodes[result.end].out = match;
+    result.end = match;
+    return result;
+}
+
+function void
+regexBuilderInit(RegexBuilder* builder, RegexParser* parser, RegexFragment fragment) {
+    i32 nNodes = parser->nNodes;
+    memset(builder, 0, sizeof(RegexBuilder));
+    builder->nodes = parser->nodes;
+    builder->nNodes = nNodes;
+    builder->start = fragment.start;
+    builder->marks = calloc(nNodes, sizeof(i32));
+    builder->stack = malloc(nNodes * sizeof(i32));
+    builder->seeds = malloc((nNodes + 1) * sizeof(i32));
+    builder->closure = malloc(nNodes * sizeof(i32));
+    builder->endClosure = malloc(nNodes * sizeof(i32));
+    builder->setStarts = malloc((REGEX_MAX_DFA_STATES + 1) * sizeof(usize));
+    builder->table = malloc(2 * REGEX_MAX_DFA_STATES * sizeof(i32));
+}
+
+function void
+regexBuilderFree(RegexBuilder* builder) {
+    free(builder->marks);
+    free(builder->stack);
+    free(builder->seeds);
+    free(builder->closure);
+    free(builder->endClosure);
+    free(builder->sets);
+    free(builder->setStarts);
+    free(builder->table);
+}
+
+// NOTE(sen) Supports literals, . [] [^] \d \w \s (and uppercase) \t, * + ?, | and (), ^ and $ at
+// the ends of rows. Returns what's wrong with the pattern, 0 if it compiled.
+function char*
+regexCompile(Regex* regex, char* pattern, i32 patternLen) {
+    memset(regex, 0, sizeof(Regex));
+    RegexParser parser;
+    RegexFragment fragment = regexParse(&parser, pattern, patternLen, false);
+
+    // NOTE(sen) Split the bytes into classes that every `Bytes` node takes all or none of. The
+    // backwards pattern has the same `Bytes` nodes.
+    regex->nClasses = 1;
+    for (i32 nodeIndex = 0; nodeIndex < parser.nNodes; nodeIndex++) {
+        RegexNode* node = parser.nodes + nodeIndex;
+        if (node->kind == RegexNodeKind_Bytes) {
+            i32 remap[512];
+            memset(remap, 0xFF, sizeof(remap));
+            i32 nClasses = 0;
+            for (i32 byte = 0; byte < 256; byte++) {
+                i32 key = regex->byteClass[byte] * 2 + regexHasByte(node->bytes, (u8)byte);
+                if (remap[key] == -1) {
+                    remap[key] = nClasses++;
+                }
+                regex->byteClass[byte] = (u8)remap[key];
+            }
+            regex->nClasses = nClasses;
+        }
+    }
+
+    char* result = parser.error;
+    if (!result) {
+        RegexParser reverseParser;
+        RegexFragment reverseFragment = regexParse(&reverseParser, pattern, patternLen, true);
+        RegexBuilder builder;
+        regexBuilderInit(&builder, &parser, fragment);
+        RegexBuilder reverseBuilder;
+        regexBuilderInit(&reverseBuilder, &reverseParser, reverseFragment);
+        if (regexBuildDfa(&builder, regex, &regex->anchored, false) && regexBuildDfa(&builder, regex, &regex->search, true)
+            && regexBuildDfa(&reverseBuilder, regex, &regex->reverse, true)) {
+            regexFinishDfa(regex, &regex->anchored);
+            regexFinishDfa(regex, &regex->search);
+            regexFinishDfa(regex, &regex->reverse);
+        } else {
+            result = "pattern too complex";
+            regexFree(regex);
+        }
+        regexBuilderFree(&builder);
+        regexBuilderFree(&reverseBuilder);
+        free(reverseParser.nodes);
+    }
+    free(parser.nodes);
+    return result;
+}
+
+// NOTE(sen) End of the longest match that starts at `start`, -1 if none does
+function i32
+regexLongestAt(Regex* regex, char* chars, i32 len, i32 start) {
+    RegexDfa* dfa = &regex->anchored;
+    i32 state = start == 0 ? dfa->startLine : dfa->startMid;
+    i32 result = state >= dfa->firstAccept ? start : -1;
+    i32 at = start;
+    while (state != 0 && at < len) {
+        state = dfa->next[state + regex->byteClass[(u8)chars[at++]]];
+        if (state >= dfa->firstAccept) {
+            result = at;
+        }
+    }
+    if (at == len && (dfa->accept[state / regex->nClasses] & REGEX_ACCEPT_AT_END)) {
+        result = len;
+    }
+    return result;
+}
+
+// NOTE(sen) One pass of the search DFA, stops where the first match ends so rows without one are
+// only looked at once
+function b32
+regexAnyMatch(Regex* regex, char* chars, i32 len) {
+    RegexDfa* dfa = &regex->search;
+    i32 state = dfa->startLine;
+    i32 at = 0;
+    while (at < len && state < dfa->firstAccept) {
+        state = dfa->next[state + regex->byteClass[(u8)chars[at++]]];
+    }
+    b32 result = state >= dfa->firstAccept || (dfa->accept[state / regex->nClasses] & REGEX_ACCEPT_AT_END);
+    return result;
 }
 
+// NOTE(sen) Sets bit `x` of `starts` for every x in [0, `len`] that a match starts at, in one
+// pass of the reverse DFA from the end of the row to its start
 function void
-abAppend(AppendBuffer* ab, char* string, i32 len) {
-    char* new = realloc(ab->buf, ab->len + len);
-    if (new) {
-        memcpy(&new[ab->len], string, len);
-        ab->buf = new;
-        ab->len += len;
+regexMatchStarts(Regex* regex, char* chars, i32 len, u64* starts) {
+    RegexDfa* dfa = &regex->reverse;
+    memset(starts, 0, (len / 64 + 1) * sizeof(u64));
+    i32 state = dfa->startLine;
+    for (i32 at = len;; at--) {
+        if (state >= dfa->firstAccept || (at == 0 && (dfa->accept[state / regex->nClasses] & REGEX_ACCEPT_AT_END))) {
+            starts[at >> 6] |= (u64)1 << (at & 63);
+        }
+        if (at == 0) {
+            break;
+        }
+        state = dfa->next[state + regex->byteClass[(u8)chars[at - 1]]];
     }
 }
 
-function void
-abReset(AppendBuffer* ab) {
-    memset(ab->buf, 0, ab->len);
-    ab->len = 0;
+// NOTE(sen) Leftmost longest match at or after `from`, `starts` is from `regexMatchStarts`. The
+// longest match is found with one run of the anchored DFA from the first start.
+function b32
+regexFind(Regex* regex, char* chars, i32 len, u64* starts, i32 from, i32* matchStart, i32* matchEnd) {
+    b32 result = false;
+    i32 word = from >> 6;
+    u64 bits = starts[word] & (~(u64)0 << (from & 63));
+    while (!bits && word < len >> 6) {
+        bits = starts[++word];
+    }
+    if (bits) {
+        i32 start = word * 64 + __builtin_ctzll(bits);
+        i32 end = regexLongestAt(regex, chars, len, start);
+        assert(end != -1);
+        result = true;
+        *matchStart = start;
+        *matchEnd = end;
+    }
+    return result;
 }
 
-function i32
-clamp(i32 value, i32 min, i32 max) {
-    i32 result = value;
-    if (value < min) {
-        result = min;
-    } else if (value > max) {
-        result = max;
+function char*
+replaceTaskReserve(ReplaceTask* task, usize len) {
+    if (task->editsLen + len > task->editsCap) {
+        task->editsCap = (task->editsLen + len) * 2;
+        task->edits = realloc(task->edits, task->editsCap);
     }
+    char* result = task->edits + task->editsLen;
+    task->editsLen += len;
     return result;
 }
 
 function void
-makeCursorXValidAfterRowChange(EditorState* state, char tabChar, i32 replacementsPerTab) {
-    i32 closestValidRenderOffset = 0;
-    i32 closestValidFileOffset = 0;
-    if (state->cursorY < state->nRows) {
-        i32 renderIndex = 0;
-        Row* row = state->rows + state->cursorY;
-        for (i32 charIndex = 0; charIndex <= row->charsSize; charIndex++) {
-            if (abs(state->cursorRenderX - renderIndex) <= abs(state->cursorRenderX - closestValidRenderOffset)) {
-                closestValidRenderOffset = renderIndex;
-                closestValidFileOffset = charIndex;
-            } else {
+replaceTaskAppend(ReplaceTask* task, char* chars, i32 len) {
+    memcpy(replaceTaskReserve(task, len), chars, len);
+}
+
+// NOTE(sen) The part of the row from the first match to the last one is written out again with
+// the matches replaced
+function void
+replaceInRow(ReplaceTask* task, i32 rowIndex, char* chars, i32 len) {
+    i32 editX = -1;
+    usize editOffset = 0;
+    i32 copied = 0;
+    i32 at = 0;
+    i32 prevEnd = -1;
+    i32 matchStart;
+    i32 matchEnd;
+    if (!regexAnyMatch(task->regex, chars, len)) {
+        return;
+    }
+    if (task->startsCap < len / 64 + 1) {
+        task->startsCap = (len / 64 + 1) * 2;
+        task->starts = realloc(task->starts, task->startsCap * sizeof(u64));
+    }
+    regexMatchStarts(task->regex, chars, len, task->starts);
+    while (at <= len && regexFind(task->regex, chars, len, task->starts, at, &matchStart, &matchEnd)) {
+        // NOTE(sen) An empty match right where the last one ended doesn't count, an empty match
+        // keeps the character after it. Either way the next search starts past that character.
+        b32 empty = matchEnd == matchStart;
+        if (empty && matchStart == prevEnd) {
+            if (matchStart == len) {
                 break;
             }
-            if (charIndex == row->charsSize) {
+            u32 codepoint;
+            at = matchStart + utf8Decode(chars + matchStart, len - matchStart, &codepoint);
+            continue;
+        }
+        if (editX == -1) {
+            editX = matchStart;
+            copied = matchStart;
+            editOffset = task->editsLen;
+            replaceTaskReserve(task, sizeof(ReplaceEdit));
+        }
+        replaceTaskAppend(task, chars + copied, matchStart - copied);
+        replaceTaskAppend(task, task->replacement, task->replacementLen);
+        task->nMatches++;
+        copied = matchEnd;
+        at = matchEnd;
+        prevEnd = matchEnd;
+        if (empty) {
+            if (matchEnd == len) {
                 break;
             }
-            if (row->fileChars[charIndex] == tabChar) {
-                renderIndex += replacementsPerTab;
-            } else {
-                renderIndex++;
-            }
+            u32 codepoint;
+            i32 charLen = utf8Decode(chars + matchEnd, len - matchEnd, &codepoint);
+            replaceTaskAppend(task, chars + matchEnd, charLen);
+            copied = matchEnd + charLen;
+            at = copied;
         }
     }
-    state->cursorRenderX = closestValidRenderOffset;
-    state->cursorFileX = closestValidFileOffset;
+    if (editX != -1) {
+        ReplaceEdit edit = {rowIndex, editX, copied, (i32)(task->editsLen - editOffset - sizeof(ReplaceEdit))};
+        memcpy(task->edits + editOffset, &edit, sizeof(ReplaceEdit));
+    }
 }
 
 function void
-insert(char** string, i32* stringLen, char* insertion, i32 insertionLen, i32 offset) {
-    if (offset <= *stringLen) {
-        *string = realloc(*string, *stringLen + insertionLen + 1);
-        memmove(*string + offset + insertionLen, *string + offset, *stringLen - offset + 1);
-        *stringLen = *stringLen + insertionLen;
-        memmove(*string + offset, insertion, insertionLen);
+replaceTask(void* arg) {
+    ReplaceTask* task = arg;
+    if (task->rows) {
+        char* scratch = 0;
+        i32 scratchCap = 0;
+        for (i32 rowIndex = 0; rowIndex < task->nRows; rowIndex++) {
+            // NOTE(sen) Only the main thread moves gaps, rows split by theirs are copied out
+            GapBuffer* gb = &task->rows[rowIndex].fileChars;
+            i32 len = gbLen(gb);
+            char* chars = gb->buf;
+            if (gb->gapStart == 0) {
+                chars = gb->buf + gb->gapEnd;
+            } else if (gb->gapEnd != gb->cap) {
+                if (scratchCap < len) {
+                    scratchCap = len * 2;
+                    scratch = realloc(scratch, scratchCap);
+                }
+                memcpy(scratch, gb->buf, gb->gapStart);
+                memcpy(scratch + gb->gapStart, gb->buf + gb->gapEnd, gb->cap - gb->gapEnd);
+                chars = scratch;
+            }
+            replaceInRow(task, task->firstRow + rowIndex, chars, len);
+        }
+        free(scratch);
+    } else {
+        char* lineStart = task->bytes;
+        for (i32 rowIndex = 0; rowIndex < task->nRows; rowIndex++) {
+            char* newline = memchr(lineStart, '\n', task->bytesEnd - lineStart);
+            i32 linelen = (newline ? newline : task->bytesEnd) - lineStart;
+            while (linelen > 0 && lineStart[linelen - 1] == '\r') {
+                --linelen;
+            }
+            replaceInRow(task, task->firstRow + rowIndex, lineStart, linelen);
+            lineStart = newline ? newline + 1 : task->bytesEnd;
+        }
     }
+    free(task->starts);
 }
 
-function void*
-constructRenderChars(char** render, i32* renderLen, char* file, i32 fileLen, char tabChar, i32 replacementsPerTab) {
-    i32 nTabs = 0;
-    char tabReplacement = ' ';
-    for (i32 charIndex = 0; charIndex < fileLen; charIndex++) {
-        if (file[charIndex] == tabChar) {
-            nTabs++;
+// NOTE(sen) Replace every match in the document. Blocks are matched on the workers and only the
+// ones with matches get loaded, then every row with a match has its characters rebuilt once. The
+// edits go in the undo journal (when there is one) as one step. Returns the number of matches.
+function i32
+replaceAll(
+    EditorState* state, UndoJournal* undo, Regex* regex, char* replacement, i32 replacementLen,
+    i32* nRowsChanged, char tabChar, i32 replacementsPerTab
+) {
+    ensureRows(state, INT32_MAX);
+    ReplaceTask* tasks = calloc(state->nBlocks + 1, sizeof(ReplaceTask));
+    usize totalBytes = 0;
+    i32 firstRow = 0;
+    for (i32 blockIndex = 0; blockIndex < state->nBlocks; blockIndex++) {
+        RowBlock* block = state->blocks + blockIndex;
+        ReplaceTask* task = tasks + blockIndex;
+        task->regex = regex;
+        task->replacement = replacement;
+        task->replacementLen = replacementLen;
+        task->nRows = block->nRows;
+        task->firstRow = firstRow;
+        if (block->loaded) {
+            task->rows = block->rows;
+            totalBytes += block->nRows * 64;
+        } else {
+            task->bytes = state->mapBase + block->mapStart;
+            task->bytesEnd = state->mapBase + block->mapEnd;
+            totalBytes += block->mapEnd - block->mapStart;
         }
+        firstRow += block->nRows;
     }
-    *renderLen = fileLen - nTabs + nTabs * replacementsPerTab;
-    *render = malloc(*renderLen + 1);
-    i32 renderIndex = 0;
-    for (i32 charIndex = 0; charIndex < fileLen; charIndex++) {
-        char rowChar = file[charIndex];
-        if (rowChar == tabChar) {
-            for (i32 spaceIndex = 0; spaceIndex < replacementsPerTab; ++spaceIndex) {
-                (*render)[renderIndex++] = tabReplacement;
+    if (state->nBlocks > 1 && totalBytes >= FIND_PARALLEL_MIN_BYTES) {
+        poolRun(&WORKER_POOL, replaceTask, tasks, sizeof(ReplaceTask), state->nBlocks);
+    } else {
+        for (i32 blockIndex = 0; blockIndex < state->nBlocks; blockIndex++) {
+            replaceTask(tasks + blockIndex);
+        }
+    }
+
+    if (undo) {
+        undoSeal(undo);
+    }
+    i32 nMatches = 0;
+    *nRowsChanged = 0;
+    i32 editedFirst = -1;
+    i32 editedLast = -1;
+    for (i32 blockIndex = 0; blockIndex < state->nBlocks; blockIndex++) {
+        ReplaceTask* task = tasks + blockIndex;
+        nMatches += task->nMatches;
+        for (usize offset = 0; offset < task->editsLen;) {
+            ReplaceEdit edit;
+            memcpy(&edit, task->edits + offset, sizeof(ReplaceEdit));
+            char* text = task->edits + offset + sizeof(ReplaceEdit);
+            offset += sizeof(ReplaceEdit) + edit.len;
+            Row* row = getRow(state, edit.row);
+            if (undo) {
+                i32 removedLen = edit.endX - edit.x;
+                UndoRecord* removed = undoAdd(
+                    undo, UndoKind_Delete, edit.row, edit.x, edit.row, edit.endX, removedLen, *nRowsChanged > 0
+                );
+                memcpy(undoText(removed), gbContiguous(&row->fileChars) + edit.x, removedLen);
+                swapAdd(SWAP_FILE, removed, undoText(removed));
+                UndoRecord* added = undoAdd(
+                    undo, UndoKind_Insert, edit.row, edit.x, edit.row, edit.x + edit.len, edit.len, true
+                );
+                memcpy(undoText(added), text, edit.len);
+                swapAdd(SWAP_FILE, added, undoText(added));
+            }
+            rowReplace(row, edit.x, edit.endX - edit.x, text, edit.len, tabChar, replacementsPerTab);
+            (*nRowsChanged)++;
+            if (edit.row != editedLast + 1 && editedFirst != -1) {
+                rowsEdited(state, editedFirst, editedLast);
+                editedFirst = -1;
+            }
+            if (editedFirst == -1) {
+                editedFirst = edit.row;
             }
+            editedLast = edit.row;
+        }
+        free(task->edits);
+    }
+    if (editedFirst != -1) {
+        rowsEdited(state, editedFirst, editedLast);
+    }
+    free(tasks);
+
+    if (*nRowsChanged > 0) {
+        state->dirty = true;
+        if (state->cursorY < state->nRows) {
+            Row* row = getRow(state, state->cursorY);
+            i32 len = gbLen(&row->fileChars);
+            state->cursorFileX = state->cursorFileX < len ? state->cursorFileX : len;
+            while (state->cursorFileX > 0 && state->cursorFileX < len
+                   && ((u8)gbAt(&row->fileChars, state->cursorFileX) & 0xC0) == 0x80) {
+                state->cursorFileX--;
+            }
+            state->cursorRenderX = renderXForFileX(row, state->cursorFileX, tabChar, replacementsPerTab);
+        }
+    }
+    if (undo) {
+        undoSeal(undo);
+    }
+    return nMatches;
+}
+
+function void
+setReplaceMessage(EditorState* state, ReplaceState* replace) {
+    if (replace->compiled) {
+        state->userMessageLen = snprintf(
+            state->userMessage, sizeof(state->userMessage), "Replace /%.*s/ with: %.*s (Esc/Enter)",
+            replace->patternLen, replace->pattern, replace->replacementLen, replace->replacement
+        );
+    } else {
+        state->userMessageLen = snprintf(
+            state->userMessage, sizeof(state->userMessage), "Replace regex: %.*s%s%s%s (Esc/Enter)",
+            replace->patternLen, replace->pattern, replace->error ? " [" : "", replace->error ? replace->error : "",
+            replace->error ? "]" : ""
+        );
+    }
+}
+
+function void
+replaceStart(EditorState* state, ReplaceState* replace) {
+    replace->active = true;
+    replace->compiled = false;
+    replace->patternLen = 0;
+    replace->replacementLen = 0;
+    replace->error = 0;
+    setReplaceMessage(state, replace);
+}
+
+// NOTE(sen) Keys while the replace prompt is up, first the pattern and then what goes in its place
+function void
+replaceHandleKey(EditorState* state, ReplaceState* replace, UndoJournal* undo, i32 key, char tabChar, i32 replacementsPerTab) {
+    char* text = replace->compiled ? replace->replacement : replace->pattern;
+    i32* textLen = replace->compiled ? &replace->replacementLen : &replace->patternLen;
+    if (key == '\x1b') {
+        if (replace->compiled) {
+            regexFree(&replace->regex);
+        }
+        replace->active = false;
+        state->userMessageLen = 0;
+    } else if (key == '\r' && !replace->compiled) {
+        replace->error = regexCompile(&replace->regex, replace->pattern, replace->patternLen);
+        replace->compiled = !replace->error;
+        setReplaceMessage(state, replace);
+    } else if (key == '\r') {
+        f64 start = getTimeSeconds();
+        i32 nRowsChanged;
+        i32 nMatches = replaceAll(
+            state, undo, &replace->regex, replace->replacement, replace->replacementLen, &nRowsChanged, tabChar, replacementsPerTab
+        );
+        regexFree(&replace->regex);
+        replace->active = false;
+        if (nMatches > 0) {
+            state->userMessageLen = snprintf(
+                state->userMessage, sizeof(state->userMessage), "Replaced %d matches on %d lines in %.3fs",
+                nMatches, nRowsChanged, getTimeSeconds() - start
+            );
         } else {
-            (*render)[renderIndex++] = file[charIndex];
+            state->userMessageLen = snprintf(
+                state->userMessage, sizeof(state->userMessage), "No match for /%.*s/", replace->patternLen, replace->pattern
+            );
+        }
+    } else {
+        if (key == Key_Backspace && *textLen > 0) {
+            (*textLen)--;
+        } else if (((key >= 32 && key < 127) || key == '\t') && *textLen < (i32)sizeof(replace->pattern)) {
+            text[(*textLen)++] = (char)key;
         }
+        replace->error = 0;
+        setReplaceMessage(state, replace);
     }
-    assert(renderIndex == *renderLen);
 }
 
-function Row*
-addRow(EditorState* state) {
-    i32 rowIndex = state->nRows++;
-    state->rows = realloc(state->rows, state->nRows * sizeof(Row));
-    Row* row = state->rows + rowIndex;
-    memset(row, 0, sizeof(Row));
-    return row;
+function void
+setGotoLineMessage(EditorState* state, GotoLineState* gotoLine) {
+    state->userMessageLen = snprintf(
+        state->userMessage, sizeof(state->userMessage), "Go to line: %.*s (Esc/Enter)", gotoLine->nDigits, gotoLine->digits
+    );
+}
+
+// NOTE(sen) Only waits for the line index to get as far as the line, finding the line's block is O(log n)
+function void
+gotoLineHandleKey(EditorState* state, GotoLineState* gotoLine, i32 key) {
+    if (key == '\r' || key == '\x1b') {
+        gotoLine->active = false;
+        state->userMessageLen = 0;
+        if (key == '\r' && gotoLine->nDigits > 0) {
+            gotoLine->digits[gotoLine->nDigits] = '\0';
+            i64 line = atoll(gotoLine->digits);
+            i32 target = line > INT32_MAX / 2 ? INT32_MAX / 2 : (i32)line - 1;
+            ensureRows(state, target + state->screenRows + 1);
+            state->cursorY = clamp(target, 0, state->nRows > 0 ? state->nRows - 1 : 0);
+            state->cursorFileX = 0;
+            state->cursorRenderX = 0;
+            state->rowOffset = clamp(state->cursorY - state->screenRows / 2, 0, state->cursorY);
+            state->wrapOffset = 0;
+        }
+    } else {
+        if (key == Key_Backspace && gotoLine->nDigits > 0) {
+            gotoLine->nDigits--;
+        } else if (key >= '0' && key <= '9' && gotoLine->nDigits < (i32)sizeof(gotoLine->digits) - 1) {
+            gotoLine->digits[gotoLine->nDigits++] = (char)key;
+        }
+        setGotoLineMessage(state, gotoLine);
+    }
+}
+
+function void
+ensureRowsAroundCursor(EditorState* state) {
+    i32 topRow = state->cursorY > state->rowOffset ? state->cursorY : state->rowOffset;
+    ensureRows(state, topRow + state->screenRows + 1);
 }
 
 function void
 restoreOriginalTerminalSettings() {
+    write(STDOUT_FILENO, "\x1b[?2004l", 8); // NOTE(sen) Disable bracketed paste
     if (tcsetattr(STDIN_FILENO, TCSAFLUSH, &OG_TERMINAL_SETTINGS)) {
         die("tcsetattr");
     }
 }
 
+function void
+batchFail(i32 lineNumber, char* message) {
+    char buf[128];
+    snprintf(buf, sizeof(buf), "batch script line %d: %s", lineNumber, message);
+    errno = EINVAL;
+    die(buf);
+}
+
+// NOTE(sen) Splits /old/new/ at its delimiter, which is whatever the first character is. The last one is optional.
+function b32
+batchSplitReplace(char* arg, char** old, i32* oldLen, char** new, i32* newLen) {
+    char delimiter = arg[0];
+    *old = arg + 1;
+    char* oldEnd = delimiter ? strchr(*old, delimiter) : 0;
+    b32 result = oldEnd && oldEnd != *old;
+    if (result) {
+        *new = oldEnd + 1;
+        char* newEnd = strchr(*new, delimiter);
+        *oldLen = oldEnd - *old;
+        *newLen = newEnd ? newEnd - *new : (i32)strlen(*new);
+    }
+    return result;
+}
+
+// NOTE(sen) Edit without a terminal from a script on stdin, one command per line:
+//     goto <line>              make <line> (1-based) the current line, one past the last is fine
+//     insert [text]            new line before the current one, the current line stays the same
+//     delete [count]           delete `count` (default 1) lines from the current one on
+//     replace /old/new/        replace every `old` in the current line, any delimiter works
+//     replace-all /regex/new/  replace every match of `regex` in the whole document
+//     save [filename]          write everything out, to the opened file by default
+// Empty lines and lines starting with # are skipped. Rows are only made for the lines the script
+// touches, the rest is written straight from the file.
+function void
+runBatch(EditorState* state, char* filename, char tabChar, i32 replacementsPerTab) {
+    SaveJob save = {};
+    i32 current = 0;
+    i32 lineNumber = 0;
+    char* line = 0;
+    usize linecap = 0;
+    i32 linelen;
+    while ((linelen = getline(&line, &linecap, stdin)) != -1) {
+        lineNumber++;
+        while (linelen > 0 && (line[linelen - 1] == '\n' || line[linelen - 1] == '\r')) {
+            line[--linelen] = '\0';
+        }
+        if (linelen == 0 || line[0] == '#') {
+            continue;
+        }
+        char* arg = strchr(line, ' ');
+        if (arg) {
+            *arg++ = '\0';
+        } else {
+            arg = line + linelen;
+        }
+        if (strcmp(line, "goto") == 0) {
+            i32 target = atoi(arg);
+            ensureRows(state, target);
+            if (target < 1 || target > state->nRows + 1) {
+                batchFail(lineNumber, "no such line");
+            }
+            current = target - 1;
+        } else if (strcmp(line, "insert") == 0) {
+            Row* row = insertRow(state, current);
+            rowInsert(row, 0, arg, strlen(arg), tabChar, replacementsPerTab);
+            current++;
+        } else if (strcmp(line, "delete") == 0) {
+            i32 count = *arg ? atoi(arg) : 1;
+            ensureRows(state, current + count);
+            if (count < 1 || current + count > state->nRows) {
+                batchFail(lineNumber, "not that many lines");
+            }
+            deleteRows(state, current, count);
+        } else if (strcmp(line, "replace") == 0) {
+            char* old;
+            char* new;
+            i32 oldLen;
+            i32 newLen;
+            if (!batchSplitReplace(arg, &old, &oldLen, &new, &newLen)) {
+                batchFail(lineNumber, "replace needs /old/new/");
+            }
+            ensureRows(state, current + 1);
+            if (current >= state->nRows) {
+                batchFail(lineNumber, "no line to replace in");
+            }
+            // NOTE(sen) The part of the row from the first match to the end of the last one is built
+            // again with the matches replaced and goes in with one `rowReplace`
+            Row* row = getRow(state, current);
+            char* chars = gbContiguous(&row->fileChars);
+            i32 len = gbLen(&row->fileChars);
+            AppendBuffer replaced = {};
+            i32 firstMatch = -1;
+            i32 copied = 0;
+            for (i32 offset = 0; offset + oldLen <= len;) {
+                char* found = memmem(chars + offset, len - offset, old, oldLen);
+                if (!found) {
+                    break;
+                }
+                i32 matchStart = found - chars;
+                if (firstMatch == -1) {
+                    firstMatch = matchStart;
+                    copied = matchStart;
+                }
+                abAppend(&replaced, chars + copied, matchStart - copied);
+                abAppend(&replaced, new, newLen);
+                copied = matchStart + oldLen;
+                offset = copied;
+            }
+            if (firstMatch != -1) {
+                rowReplace(row, firstMatch, copied - firstMatch, replaced.buf, replaced.len, tabChar, replacementsPerTab);
+                rowsEdited(state, current, current);
+            }
+            free(replaced.buf);
+        } else if (strcmp(line, "replace-all") == 0) {
+            char* pattern;
+            char* new;
+            i32 patternLen;
+            i32 newLen;
+            if (!batchSplitReplace(arg, &pattern, &patternLen, &new, &newLen)) {
+                batchFail(lineNumber, "replace-all needs /regex/new/");
+            }
+            Regex regex;
+            char* error = regexCompile(&regex, pattern, patternLen);
+            if (error) {
+                batchFail(lineNumber, error);
+            }
+            f64 start = getTimeSeconds();
+            i32 nRowsChanged;
+            i32 nMatches = replaceAll(state, 0, &regex, new, newLen, &nRowsChanged, tabChar, replacementsPerTab);
+            regexFree(&regex);
+            printf("replaced %d matches on %d lines in %.3fs\n", nMatches, nRowsChanged, getTimeSeconds() - start);
+        } else if (strcmp(line, "save") == 0) {
+            char* saveFilename = *arg ? arg : filename;
+            if (!startSave(&save, state, saveFilename)) {
+                batchFail(lineNumber, "failed to start saving");
+            }
+            waitForSave(&save);
+            if (save.error) {
+                errno = save.error;
+                die(saveFilename);
+            }
+            printf(
+                "saved %s: %zu bytes in %.3fs (%.1fMB/s)\n", saveFilename, save.totalBytes,
+                save.endTime - save.startTime, saveThroughputMBps(&save)
+            );
+        } else {
+            batchFail(lineNumber, "unknown command");
+        }
+    }
+    free(line);
+}
+
+// NOTE(sen) Map or read the file and start indexing its lines in the background. Rows are only
+// made for the parts that get looked at. `-` is the pipe that was on stdin, `stdinFd` is a copy of it.
+function void
+bufferOpen(
+    Buffer* buffer, char* filename, i32 stdinFd, Follow* follow, b32 batch, char tabChar, i32 replacementsPerTab
+) {
+    EditorState* state = &buffer->state;
+    buffer->filename = filename;
+    buffer->swap.fd = -1;
+    i32 fd = strcmp(filename, "-") == 0 ? stdinFd : open(filename, O_RDONLY);
+    if (fd == -1) { die(filename); }
+    struct stat fileStat;
+    if (fstat(fd, &fileStat)) { die("fstat"); }
+    buffer->fileSize = fileStat.st_size;
+    b32 mapped = false;
+    Compression compression = Compression_None;
+    if (S_ISREG(fileStat.st_mode) && !follow->active) {
+        char magic[4];
+        isize nMagic = pread(fd, magic, sizeof(magic), 0);
+        compression = detectCompression(magic, nMagic > 0 ? nMagic : 0);
+        // NOTE(sen) Empty files can't be mapped but there is nothing to read anyway
+        mapped = fileStat.st_size == 0;
+        if (fileStat.st_size > 0 && compression == Compression_None) {
+            void* mapBase = mmap(0, fileStat.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+            if (mapBase != MAP_FAILED) {
+                state->mapBase = mapBase;
+                state->mapSize = fileStat.st_size;
+                mapped = true;
+                noteNewline(state, state->mapBase, state->mapSize);
+            }
+        }
+    }
+    if (follow->active) {
+        followStart(follow, state, fd, filename, tabChar, replacementsPerTab);
+        buffer->fileSize = follow->offset;
+    } else if (compression != Compression_None || (!mapped && !batch && !S_ISREG(fileStat.st_mode))) {
+        // NOTE(sen) Pipes and compressed files are read in the background and shown as they fill up
+        state->stream = calloc(1, sizeof(Stream));
+        streamStart(state->stream, fd, S_ISREG(fileStat.st_mode));
+        state->mapBase = state->stream->base;
+    } else if (!mapped) {
+        // NOTE(sen) Fall back to reading everything for things that can't be mapped
+        usize len;
+        char* chars = readAll(fd, fileStat.st_size, &len);
+        close(fd);
+        state->readChars = chars;
+        state->readSize = len;
+        buffer->fileSize = len;
+        loadRows(state, chars, len);
+    } else {
+        // NOTE(sen) The mapping stays valid after the descriptor is closed
+        close(fd);
+    }
+    state->highlight = highlightForFilename(filename);
+    if (state->mapBase && !state->stream) {
+        lineIndexStart(&state->lineIndex, state->mapBase, state->mapSize, filename, &fileStat);
+    } else {
+        state->lineIndex.complete = true;
+    }
+    if (state->stream && batch) {
+        // NOTE(sen) Batches work on the whole document
+        ensureRows(state, INT32_MAX);
+    }
+    if (!follow->active && !batch && !state->stream) {
+        i32 recovered = swapOpen(&buffer->swap, state, filename, &fileStat, tabChar, replacementsPerTab);
+        if (recovered > 0) {
+            state->dirty = true;
+            state->userMessageLen = snprintf(
+                state->userMessage, sizeof(state->userMessage), "Recovered %d unsaved edits", recovered
+            );
+        }
+    }
+}
+
 i32
 main(i32 argc, char* argv[]) {
-    if (argc < 2) {
+    f64 startTime = getTimeSeconds();
+
+    // NOTE(sen) Options come before the filenames
+    Replay replay = {.timedGroup = -1};
+    i32 replayRows = 24;
+    i32 replayCols = 80;
+    usize undoMaxBytes = UNDO_DEFAULT_MAX_BYTES;
+    Follow follow = {};
+    b32 batch = false;
+    b32 wrap = false;
+    i32 undoLimitMB;
+    i32 argIndex = 1;
+    for (; argIndex < argc && strncmp(argv[argIndex], "--", 2) == 0; argIndex++) {
+        char* arg = argv[argIndex];
+        if (strncmp(arg, "--replay=", 9) == 0) {
+            replayLoad(&replay, arg + 9);
+        } else if (strcmp(arg, "--batch") == 0) {
+            batch = true;
+        } else if (strcmp(arg, "--follow") == 0) {
+            follow.active = true;
+        } else if (strcmp(arg, "--wrap") == 0) {
+            wrap = true;
+        } else if (strcmp(arg, "--profile") == 0) {
+            PROFILER.enabled = true;
+        } else if (strncmp(arg, "--trace=", 8) == 0) {
+            PROFILER.enabled = true;
+            PROFILER.traceFilename = arg + 8;
+            atexit(profileWriteTrace);
+        } else if (sscanf(arg, "--undo-limit=%d", &undoLimitMB) == 1 && undoLimitMB >= 0) {
+            undoMaxBytes = (usize)undoLimitMB << 20;
+        } else if (sscanf(arg, "--size=%dx%d", &replayRows, &replayCols) != 2) {
+            errno = EINVAL;
+            die(arg);
+        }
+    }
+    if (argIndex >= argc) {
         die("provide a filename");
     }
+    i32 nBuffers = argc - argIndex;
+    if (nBuffers > 1 && (batch || follow.active)) {
+        errno = EINVAL;
+        die("--batch and --follow take one file");
+    }
 
-    // NOTE(sen) Save the original settings
-    if (tcgetattr(STDIN_FILENO, &OG_TERMINAL_SETTINGS)) {
-        die("tcgetattr");
+    // NOTE(sen) Piped input named `-` is read from a copy of stdin and the keys come from the terminal
+    i32 stdinFd = -1;
+    for (i32 index = argIndex; index < argc; index++) {
+        if (strcmp(argv[index], "-") == 0) {
+            if (stdinFd != -1 || batch || follow.active || isatty(STDIN_FILENO)) {
+                errno = EINVAL;
+                die("- takes piped input once, without --batch or --follow");
+            }
+            stdinFd = dup(STDIN_FILENO);
+            if (stdinFd == -1) { die("dup"); }
+            if (!replay.active) {
+                i32 ttyFd = open("/dev/tty", O_RDWR);
+                if (ttyFd == -1 || dup2(ttyFd, STDIN_FILENO) == -1) { die("/dev/tty"); }
+                close(ttyFd);
+            }
+        }
     }
-    atexit(restoreOriginalTerminalSettings);
 
-    // NOTE(sen) Change terminal settings
-    {
+    // NOTE(sen) Replays and batches are headless, the frames go nowhere and the keys come from the script
+    i32 outputFd = STDOUT_FILENO;
+    if (replay.active || batch) {
+        outputFd = open("/dev/null", O_WRONLY);
+        if (outputFd == -1) { die("open /dev/null"); }
+        replay.timedStart = startTime;
+    } else {
+        // NOTE(sen) Save the original settings
+        if (tcgetattr(STDIN_FILENO, &OG_TERMINAL_SETTINGS)) {
+            die("tcgetattr");
+        }
+        atexit(restoreOriginalTerminalSettings);
+
+        // NOTE(sen) Change terminal settings
         struct termios newTerminalSettings = OG_TERMINAL_SETTINGS;
 
         // NOTE(sen) Raw mode
@@ -220,21 +6549,24 @@ main(i32 argc, char* argv[]) {
         if (tcsetattr(STDIN_FILENO, TCSAFLUSH, &newTerminalSettings)) {
             die("tcsetattr");
         }
-    }
 
-    EditorState state = {};
-
-    // NOTE(sen) Set default message
-    state.userMessageLen =
-        snprintf(state.userMessage, sizeof(state.userMessage), "HELP: Ctrl-Q = quit");
+        // NOTE(sen) Have the terminal mark pastes so they can be inserted in one go
+        write(STDOUT_FILENO, "\x1b[?2004h", 8);
+    }
 
     // NOTE(sen) Figure out window size
+    i32 screenRows = 0;
+    i32 screenCols = 0;
     {
         struct winsize ws;
         b32 success = 0;
-        if (ioctl(STDOUT_FILENO, TIOCGWINSZ, &ws) != -1 && ws.ws_col != 0) {
-            state.screenRows = ws.ws_row;
-            state.screenCols = ws.ws_col;
+        if (replay.active || batch) {
+            screenRows = replayRows;
+            screenCols = replayCols;
+            success = replayRows > 2 && replayCols > 0;
+        } else if (ioctl(STDOUT_FILENO, TIOCGWINSZ, &ws) != -1 && ws.ws_col != 0) {
+            screenRows = ws.ws_row;
+            screenCols = ws.ws_col;
             success = 1;
         } else if (write(STDOUT_FILENO, "\x1b[999C\x1b[999B", 12) == 12) {
             if (write(STDOUT_FILENO, "\x1b[6n", 4) == 4) {
@@ -251,7 +6583,7 @@ main(i32 argc, char* argv[]) {
                 }
                 buf[index] = '\0';
                 if (buf[0] == '\x1b' || buf[1] == '[') {
-                    if (sscanf(buf + 2, "%d;%d", &state.screenRows, &state.screenCols) == 2) {
+                    if (sscanf(buf + 2, "%d;%d", &screenRows, &screenCols) == 2) {
                         success = 1;
                     }
                 }
@@ -261,372 +6593,709 @@ main(i32 argc, char* argv[]) {
             die("failed to get window size");
         }
         // NOTE(sen) Make room for the status bar and user message
-        state.screenRows -= 2;
+        screenRows -= 2;
     }
 
-    // NOTE(sen) Read file
-    char* filename = '\0';
+    poolInit(&WORKER_POOL);
+
+    // NOTE(sen) Open every file, their lines are indexed in the background while the first one is shown
     char tabChar = '\t';
     i32 replacementsPerTab = 8;
-    {
-        filename = argv[1];
-        FILE* file = fopen(filename, "r");
-        if (!file) { die("fopen"); }
-        char* line = 0;
-        usize linecap = 0;
-        i32 linelen;
-        while ((linelen = getline(&line, &linecap, file)) != -1) {
-            // NOTE(sen) Trim the final newline
-            while (linelen > 0 && (line[linelen - 1] == '\n' || line[linelen - 1] == '\r')) {
-                --linelen;
-            }
-            Row* row = addRow(&state);
-            // NOTE(sen) Copy the actual characters
-            row->charsSize = linelen;
-            row->fileChars = malloc(row->charsSize + 1);
-            memcpy(row->fileChars, line, row->charsSize);
-            row->fileChars[row->charsSize] = '\0';
-            constructRenderChars(&row->renderChars, &row->renderSize, row->fileChars, row->charsSize, tabChar, replacementsPerTab);
-        }
-        free(line);
-        fclose(file);
+    Buffer* buffers = calloc(nBuffers, sizeof(Buffer));
+    for (i32 bufferIndex = 0; bufferIndex < nBuffers; bufferIndex++) {
+        Buffer* buffer = buffers + bufferIndex;
+        EditorState* state = &buffer->state;
+        state->wrap = wrap;
+        state->screenRows = screenRows;
+        state->screenCols = screenCols;
+        buffer->undo.maxBytes = undoMaxBytes;
+        // NOTE(sen) Set default message
+        state->userMessageLen = snprintf(
+            state->userMessage, sizeof(state->userMessage), "HELP: Ctrl-Q = quit | Ctrl-Z = undo | Ctrl-Y = redo%s",
+            nBuffers > 1 ? " | Ctrl-N = next file" : ""
+        );
+        bufferOpen(buffer, argv[argIndex + bufferIndex], stdinFd, &follow, batch, tabChar, replacementsPerTab);
+        // NOTE(sen) Enough to hold every visible row with tabs plus some cursor movement around them
+        renderCacheInit(&state->renderCache, screenRows * 2 > 64 ? screenRows * 2 : 64);
+    }
+
+    // NOTE(sen) The buffer on screen, switching only changes these
+    i32 bufferIndex = 0;
+    Buffer* buffer = buffers;
+    EditorState* state = &buffer->state;
+    UndoJournal* undo = &buffer->undo;
+    SaveJob* save = &buffer->save;
+    char* filename = buffer->filename;
+    SWAP_FILE = &buffer->swap;
+
+    if (batch) {
+        runBatch(state, filename, tabChar, replacementsPerTab);
+        exit(0);
     }
 
     struct AppendBuffer appendBuffer = {};
+    struct AppendBuffer lineBuffer = {};
+    ScreenShadow shadow = {};
+    shadowInit(&shadow, state->screenRows + 2);
+
+    InputState input = {};
+    FindState find = {};
+    GotoLineState gotoLine = {};
+    ReplaceState replace = {};
+    f64 lastFrameTime = 0;
 
     for (;;) {
+        profileFrameBegin();
+
+        // NOTE(sen) Make sure rows exist for the viewport and for any single cursor move from it
+        PROFILE_BEGIN(Rows);
+        ensureRowsAroundCursor(state);
+
         // NOTE(sen) Adjust offsets (scroll)
-        {
+        i32 cursorSubLine = 0;
+        if (state->wrap) {
+            // NOTE(sen) Rows above the cursor are only walked when it's less than a screen of rows
+            // away, further than that the screen starts a screen of lines above it
+            if (state->wrapCols != state->screenCols) {
+                wrapReset(state);
+            }
+            state->colOffset = 0;
+            cursorSubLine = state->cursorRenderX / state->wrapCols;
+            i32 topLines = rowScreenLines(state, state->rowOffset, tabChar, replacementsPerTab);
+            state->wrapOffset = state->wrapOffset < topLines ? state->wrapOffset : topLines - 1;
+            if (state->cursorY < state->rowOffset || (state->cursorY == state->rowOffset && cursorSubLine < state->wrapOffset)) {
+                state->rowOffset = state->cursorY;
+                state->wrapOffset = cursorSubLine;
+            } else if (
+                state->cursorY - state->rowOffset >= state->screenRows
+                || wrapLinesBetween(
+                       state, state->rowOffset, state->wrapOffset, state->cursorY, cursorSubLine, state->screenRows,
+                       tabChar, replacementsPerTab
+                   ) >= state->screenRows
+            ) {
+                state->rowOffset = wrapMoveLines(
+                    state, state->cursorY, cursorSubLine, 1 - state->screenRows, &state->wrapOffset, tabChar,
+                    replacementsPerTab
+                );
+            }
+        } else {
             // NOTE(sen) Vertical
-            assert(state.cursorY >= 0);
-            assert(state.rowOffset >= 0);
-            if (state.cursorY < state.rowOffset) {
-                state.rowOffset = state.cursorY;
-            } else if (state.cursorY >= state.rowOffset + state.screenRows) {
-                state.rowOffset = state.cursorY - state.screenRows + 1;
+            assert(state->cursorY >= 0);
+            assert(state->rowOffset >= 0);
+            state->wrapOffset = 0;
+            if (state->cursorY < state->rowOffset) {
+                state->rowOffset = state->cursorY;
+            } else if (state->cursorY >= state->rowOffset + state->screenRows) {
+                state->rowOffset = state->cursorY - state->screenRows + 1;
             }
             // NOTE(sen) Horizontal
-            assert(state.cursorRenderX >= 0);
-            assert(state.colOffset >= 0);
-            if (state.cursorRenderX < state.colOffset) {
-                state.colOffset = state.cursorRenderX;
-            } else if (state.cursorRenderX >= state.colOffset + state.screenCols) {
-                state.colOffset = state.cursorRenderX - state.screenCols + 1;
+            assert(state->cursorRenderX >= 0);
+            assert(state->colOffset >= 0);
+            if (state->cursorRenderX < state->colOffset) {
+                state->colOffset = state->cursorRenderX;
+            } else if (state->cursorRenderX >= state->colOffset + state->screenCols) {
+                state->colOffset = state->cursorRenderX - state->screenCols + 1;
             }
         }
+        PROFILE_END(Rows);
 
         // NOTE(sen) Render
         {
+            PROFILE_BEGIN(Render);
             abAppend(&appendBuffer, "\x1b[?25l", 6); // NOTE(sen) Hide cursor
-            abAppend(&appendBuffer, "\x1b[H", 3); // NOTE(sen) Move cursor to top-left
 
-            // NOTE(sen) Draw rows
-            for (int rowIndex = 0; rowIndex < state.screenRows; rowIndex++) {
-                i32 fileRowIndex = rowIndex + state.rowOffset;
-                if (fileRowIndex < state.nRows) {
+            if (!shadow.valid) {
+                abAppend(&appendBuffer, "\x1b[2J", 4); // NOTE(sen) Clear screen
+                for (i32 lineIndex = 0; lineIndex < shadow.nLines; lineIndex++) {
+                    abReset(shadow.lines + lineIndex);
+                }
+                shadow.rowOffset = state->rowOffset;
+                shadow.colOffset = state->colOffset;
+                shadow.wrapOffset = state->wrapOffset;
+                shadow.valid = true;
+            }
+
+            // NOTE(sen) Let the terminal move rows that are still visible after a vertical scroll
+            {
+                i32 scrollBy = state->rowOffset - shadow.rowOffset;
+                if (state->wrap) {
+                    if (state->rowOffset > shadow.rowOffset
+                        || (state->rowOffset == shadow.rowOffset && state->wrapOffset >= shadow.wrapOffset)) {
+                        scrollBy = wrapLinesBetween(
+                            state, shadow.rowOffset, shadow.wrapOffset, state->rowOffset, state->wrapOffset,
+                            state->screenRows, tabChar, replacementsPerTab
+                        );
+                    } else {
+                        scrollBy = -wrapLinesBetween(
+                            state, state->rowOffset, state->wrapOffset, shadow.rowOffset, shadow.wrapOffset,
+                            state->screenRows, tabChar, replacementsPerTab
+                        );
+                    }
+                }
+                if (scrollBy != 0 && abs(scrollBy) < state->screenRows && state->colOffset == shadow.colOffset) {
+                    char buf[32];
+                    i32 bufLen = snprintf(buf, sizeof(buf), "\x1b[1;%dr", state->screenRows); // NOTE(sen) Scroll region
+                    abAppend(&appendBuffer, buf, bufLen);
+                    bufLen = snprintf(buf, sizeof(buf), "\x1b[%d%c", abs(scrollBy), scrollBy > 0 ? 'S' : 'T');
+                    abAppend(&appendBuffer, buf, bufLen);
+                    abAppend(&appendBuffer, "\x1b[r", 3); // NOTE(sen) Reset scroll region
+                    shadowScrollText(&shadow, state->screenRows, scrollBy);
+                }
+                shadow.rowOffset = state->rowOffset;
+                shadow.colOffset = state->colOffset;
+                shadow.wrapOffset = state->wrapOffset;
+            }
+
+            // NOTE(sen) Draw rows, each visible row is lexed from where the one above it left off
+            i32 hlState = HighlightState_Unknown;
+            if (state->highlight && state->rowOffset < state->nRows) {
+                hlState = highlightStartState(state, state->rowOffset);
+            }
+            // NOTE(sen) When wrapping, a row goes on for `subLine`s
+            i32 fileRowIndex = state->rowOffset;
+            i32 subLine = state->wrapOffset;
+            for (int rowIndex = 0; rowIndex < state->screenRows; rowIndex++) {
+                abReset(&lineBuffer);
+                if (fileRowIndex < state->nRows) {
                     // NOTE(sen) Print file rows
-                    Row* row = state.rows + fileRowIndex;
-                    if (row->renderSize > state.colOffset) {
-                        i32 len = row->renderSize - state.colOffset;
-                        if (len > state.screenCols) {
-                            len = state.screenCols;
+                    Row* row = getRow(state, fileRowIndex);
+                    i32 renderSize = rowRenderSize(row, tabChar, replacementsPerTab);
+                    i32 start = state->wrap ? subLine * state->wrapCols : state->colOffset;
+                    if (renderSize > start) {
+                        i32 len = renderSize - start;
+                        if (len > state->screenCols) {
+                            len = state->screenCols;
+                        }
+                        abAppendRender(
+                            &lineBuffer, &state->renderCache, row, start, len, tabChar, replacementsPerTab, hlState
+                        );
+                    } else if (hlState != HighlightState_Unknown && subLine == 0) {
+                        highlightRowState(row, hlState);
+                    }
+                    if (state->wrap && subLine + 1 < renderSize / state->wrapCols + 1) {
+                        subLine++;
+                    } else {
+                        if (hlState != HighlightState_Unknown) {
+                            hlState = row->hlEndState;
                         }
-                        abAppend(&appendBuffer, row->renderChars + state.colOffset, len);
+                        fileRowIndex++;
+                        subLine = 0;
                     }
-                } else if (rowIndex == state.screenRows / 3 && state.nRows == 0) {
+                } else if (rowIndex == state->screenRows / 3 && state->nRows == 0) {
                     // NOTE(sen) Welcome message
                     char welcome[80];
                     int welcomeLen = snprintf(welcome, sizeof(welcome), "Kilo editor -- version %s", KILO_VERSION);
-                    if (welcomeLen > state.screenCols) {
-                        welcomeLen = state.screenCols;
+                    if (welcomeLen > state->screenCols) {
+                        welcomeLen = state->screenCols;
                     }
-                    int padding = (state.screenCols - welcomeLen) / 2;
+                    int padding = (state->screenCols - welcomeLen) / 2;
                     if (padding) {
-                        abAppend(&appendBuffer, "~", 1);
+                        abAppend(&lineBuffer, "~", 1);
                         padding--;
                     }
-                    while (padding--) { abAppend(&appendBuffer, " ", 1); };
-                    abAppend(&appendBuffer, welcome, welcomeLen);
+                    abAppendFill(&lineBuffer, ' ', padding);
+                    abAppend(&lineBuffer, welcome, welcomeLen);
                 }
-
-                // NOTE(sen) Clear row after the cursor
-                abAppend(&appendBuffer, "\x1b[K", 3);
-
-                // NOTE(sen) Make sure there is no newline on the last line
-                abAppend(&appendBuffer, "\r\n", 2);
+                shadowEmitLine(&shadow, &appendBuffer, rowIndex, &lineBuffer);
             }
 
             // NOTE(sen) Draw status bar
-            char status[80];
-            i32 statusLen = snprintf(status, sizeof(status), "%.20s%s - %d lines", filename, state.dirty ? "*" : "", state.nRows);
-            if (statusLen > state.screenCols) {
-                statusLen = state.screenCols;
+            abReset(&lineBuffer);
+            char status[256];
+            i32 statusLen = 0;
+            if (PROFILER.enabled) {
+                statusLen = profileOverlay(status, sizeof(status) / 2);
             }
-            i32 statusPad = state.screenCols - statusLen;
-            while (statusPad > 0) {
-                abAppend(&appendBuffer, " ", 1);
-                statusPad--;
+            if (nBuffers > 1) {
+                statusLen += snprintf(status + statusLen, sizeof(status) - statusLen, "[%d/%d] ", bufferIndex + 1, nBuffers);
             }
-            abAppend(&appendBuffer, "\x1b[1m", 4); // NOTE(sen) Bold
-            abAppend(&appendBuffer, status, statusLen);
-            abAppend(&appendBuffer, "\x1b[m", 3); // NOTE(sen) Reset formatting
-
-            abAppend(&appendBuffer, "\r\n", 2);
-
-            // NOTE(sen) Draw user message
-            i32 messageLen = state.userMessageLen;
-            if (messageLen > state.screenCols) {
-                messageLen = state.screenCols;
+            statusLen += snprintf(
+                status + statusLen, sizeof(status) - statusLen, "%.20s%s - %d%s lines%s - %dB/frame",
+                filename, state->dirty ? "*" : "", state->nRows, rowsComplete(state) ? "" : "+",
+                follow.active ? " - following" : "", shadow.lastFrameBytes
+            );
+            if (save->running) {
+                usize written = __atomic_load_n(&save->bytesWritten, __ATOMIC_RELAXED);
+                i32 percent = save->totalBytes ? (i32)(written * 100 / save->totalBytes) : 100;
+                statusLen += snprintf(
+                    status + statusLen, sizeof(status) - statusLen, " - saving %d%% %.1fMB/s",
+                    percent, saveThroughputMBps(save)
+                );
+                if (statusLen > (i32)sizeof(status) - 1) {
+                    statusLen = sizeof(status) - 1;
+                }
             }
-            i32 messagePadTotal = state.screenCols - messageLen;
-            i32 messagePadSide = messagePadTotal / 2;
-            i32 messagePad = messagePadSide;
-            while (messagePad > 0) {
-                abAppend(&appendBuffer, " ", 1);
-                messagePad--;
+            if (statusLen > state->screenCols) {
+                statusLen = state->screenCols;
             }
-            abAppend(&appendBuffer, state.userMessage, messageLen);
-            messagePad = messagePadSide;
-            while (messagePad > 0) {
-                abAppend(&appendBuffer, " ", 1);
-                messagePad--;
+            abAppendFill(&lineBuffer, ' ', state->screenCols - statusLen);
+            abAppend(&lineBuffer, "\x1b[1m", 4); // NOTE(sen) Bold
+            abAppend(&lineBuffer, status, statusLen);
+            abAppend(&lineBuffer, "\x1b[m", 3); // NOTE(sen) Reset formatting
+            shadowEmitLine(&shadow, &appendBuffer, state->screenRows, &lineBuffer);
+
+            // NOTE(sen) Draw user message
+            abReset(&lineBuffer);
+            i32 messageLen = state->userMessageLen;
+            if (messageLen > state->screenCols) {
+                messageLen = state->screenCols;
             }
+            i32 messagePad = (state->screenCols - messageLen) / 2;
+            abAppendFill(&lineBuffer, ' ', messagePad);
+            abAppend(&lineBuffer, state->userMessage, messageLen);
+            abAppendFill(&lineBuffer, ' ', messagePad);
+            shadowEmitLine(&shadow, &appendBuffer, state->screenRows + 1, &lineBuffer);
 
             // NOTE(sen) Move cursor to the appropriate position
             char buf[32];
-            snprintf(buf, sizeof(buf), "\x1b[%d;%dH", state.cursorY - state.rowOffset + 1, state.cursorRenderX - state.colOffset + 1);
+            i32 cursorScreenY = state->cursorY - state->rowOffset;
+            if (state->wrap) {
+                cursorScreenY = wrapLinesBetween(
+                    state, state->rowOffset, state->wrapOffset, state->cursorY, cursorSubLine, state->screenRows, tabChar,
+                    replacementsPerTab
+                );
+            }
+            i32 cursorScreenX = state->cursorRenderX - state->colOffset - cursorSubLine * state->wrapCols;
+            snprintf(buf, sizeof(buf), "\x1b[%d;%dH", cursorScreenY + 1, cursorScreenX + 1);
             abAppend(&appendBuffer, buf, strlen(buf));
 
             abAppend(&appendBuffer, "\x1b[?25h", 6); // NOTE(sen) Show cursor
+            PROFILE_END(Render);
 
-            write(STDOUT_FILENO, appendBuffer.buf, appendBuffer.len);
+            PROFILE_BEGIN(Write);
+            write(outputFd, appendBuffer.buf, appendBuffer.len);
+            PROFILER.bytesWritten += appendBuffer.len;
+            PROFILE_END(Write);
+            shadow.lastFrameBytes = appendBuffer.len;
+            lastFrameTime = getTimeSeconds();
+            if (replay.active) {
+                replayFrameDone(&replay, appendBuffer.len);
+            }
 
             abReset(&appendBuffer);
         } // NOTE(sen) Render
 
-        // NOTE(sen) Get input
-        i32 key = 0;
-        {
-            // NOTE(sen) Read the first character input
-            {
-                i32 nread;
-                char ch;
-                while ((nread = read(STDIN_FILENO, &ch, 1)) != 1) {
-                    if (nread == -1 && errno != EAGAIN) { die("read"); }
-                }
-                key = ch;
-            }
-
-            // NOTE(sen) Process escape sequences
-            if (key == '\x1b') {
-                char seq[3];
-                if (read(STDIN_FILENO, seq, 3) >= 2) {
-                    if (seq[0] == '[') {
-                        switch (seq[1]) {
-                        case 'A': key = Key_ArrowUp; break;
-                        case 'B': key = Key_ArrowDown; break;
-                        case 'C': key = Key_ArrowRight; break;
-                        case 'D': key = Key_ArrowLeft; break;
-                        case 'H': key = Key_Home; break;
-                        case 'F': key = Key_End; break;
-                        case 'O': {
-                            switch (seq[2]) {
-                            case 'H': key = Key_Home; break;
-                            case 'F': key = Key_End; break;
-                            }
-                        } break;
-                        case '5': if (seq[2] == '~') { key = Key_PageUp; } break;
-                        case '6': if (seq[2] == '~') { key = Key_PageDown; } break;
-                        case '1': case '7': if (seq[2] == '~') { key = Key_Home; } break;
-                        case '4': case '8': if (seq[2] == '~') { key = Key_End; } break;
-                        case '3': if (seq[2] == '~') { key = Key_Delete; } break;
-                        }
+        // NOTE(sen) Get input, blocks until there is at least something. Wake up regularly while
+        // saving or indexing to show progress.
+        if (replay.active) {
+            PROFILE_BEGIN(Input);
+            b32 more = replayInject(&replay, &input, save);
+            PROFILE_END(Input);
+            if (!more) {
+                replayReport(&replay, filename, buffer->fileSize, state->screenRows + 2, state->screenCols);
+                for (i32 index = 0; index < nBuffers; index++) {
+                    swapDiscard(&buffers[index].swap);
+                }
+                exit(0);
+            }
+        } else {
+            b32 saving = false;
+            for (i32 index = 0; index < nBuffers; index++) {
+                saving = saving || buffers[index].save.running;
+            }
+            i32 timeoutMs = swapTimeoutMs(SWAP_FILE, saving || !rowsComplete(state) ? 100 : -1);
+            b32 ready;
+            if (follow.active) {
+                ready = followWaitForInput(&follow, state, filename, tabChar, replacementsPerTab);
+            } else if (state->stream && !rowsComplete(state)) {
+                ready = streamWaitForInput(state->stream, timeoutMs);
+            } else {
+                ready = pollInput(timeoutMs);
+            }
+            if (ready) {
+                PROFILE_BEGIN(Input);
+                readAvailableInput(&input);
+                PROFILE_END(Input);
+                // NOTE(sen) Keys that come in before the next frame is due are handled with these, so
+                // key repeat faster than the refresh rate doesn't draw frames that are never seen
+                while (input.len < (i32)sizeof(input.buf)) {
+                    f64 remaining = lastFrameTime + FRAME_SECONDS - getTimeSeconds();
+                    if (remaining <= 0 || !pollInput((i32)(remaining * 1000) + 1)) {
+                        break;
                     }
+                    PROFILE_BEGIN(Input);
+                    readAvailableInput(&input);
+                    PROFILE_END(Input);
                 }
             }
         }
+        swapCommitIfDue(SWAP_FILE);
 
-        // NOTE(sen) Handle quit
-        if (key == CTRL_KEY('q')) {
-            if (state.aboutToQuit || !state.dirty) {
-                write(STDOUT_FILENO, "\x1b[2J", 4); // NOTE(sen) Clear screen
-                write(STDOUT_FILENO, "\x1b[H", 3); // NOTE(sen) Move cursor to top-left
-                exit(0);
-            } else {
-                state.aboutToQuit = true;
-                state.userMessageLen =
-                    snprintf(state.userMessage, sizeof(state.userMessage), "Changes will be lost, press Ctrl-Q again to quit");
+        // NOTE(sen) Saves keep going in buffers that aren't on screen
+        for (i32 index = 0; index < nBuffers; index++) {
+            Buffer* saved = buffers + index;
+            EditorState* savedState = &saved->state;
+            if (checkSaveFinished(&saved->save)) {
+                if (saved->save.error) {
+                    savedState->dirty = true;
+                    savedState->userMessageLen = snprintf(
+                        savedState->userMessage, sizeof(savedState->userMessage), "Save failed: %s", strerror(saved->save.error)
+                    );
+                } else {
+                    swapSaveFinished(&saved->swap, saved->filename);
+                    savedState->userMessageLen = snprintf(
+                        savedState->userMessage, sizeof(savedState->userMessage), "Saved %zu bytes (%.1fMB/s)",
+                        saved->save.totalBytes, saveThroughputMBps(&saved->save)
+                    );
+                }
             }
-        } else {
-            state.aboutToQuit = false;
         }
 
-        // NOTE(sen) Handle all other input
-        switch (key) {
-            // NOTE(sen) Cursor move
-        case Key_ArrowDown: {
-            state.aboutToQuit = false;
-            if (state.cursorY < state.nRows) {
-                state.cursorY++;
-                if (state.cursorY == state.nRows) {
-                    state.cursorRenderX = 0;
-                    state.cursorFileX = 0;
-                } else {
-                    makeCursorXValidAfterRowChange(&state, tabChar, replacementsPerTab);
-                }
-            }
-        }; break;
-        case Key_ArrowUp: {
-            state.aboutToQuit = false;
-            if (state.cursorY > 0) {
-                state.cursorY--;
-                makeCursorXValidAfterRowChange(&state, tabChar, replacementsPerTab);
-            }
-        }; break;
-        case Key_ArrowRight: {
-            state.aboutToQuit = false;
-            if (state.cursorY < state.nRows) {
-                if (state.cursorFileX == state.rows[state.cursorY].charsSize) {
-                    state.cursorFileX = 0;
-                    state.cursorRenderX = 0;
-                    state.cursorY++;
+        // NOTE(sen) Handle everything that came in before drawing the next frame
+        PROFILE_BEGIN(Keys);
+        i32 key;
+        while ((key = nextKey(&input)) != Key_None) {
+            ensureRowsAroundCursor(state);
+
+            if (find.active) {
+                findHandleKey(state, &find, key, tabChar, replacementsPerTab);
+                continue;
+            }
+            if (gotoLine.active) {
+                gotoLineHandleKey(state, &gotoLine, key);
+                continue;
+            }
+            if (replace.active) {
+                replaceHandleKey(state, &replace, undo, key, tabChar, replacementsPerTab);
+                continue;
+            }
+
+            // NOTE(sen) Handle quit
+            if (key == CTRL_KEY('q')) {
+                i32 nDirty = 0;
+                for (i32 index = 0; index < nBuffers; index++) {
+                    nDirty += buffers[index].state.dirty != 0;
+                }
+                if (state->aboutToQuit || nDirty == 0) {
+                    for (i32 index = 0; index < nBuffers; index++) {
+                        Buffer* closing = buffers + index;
+                        // NOTE(sen) Let a save in progress finish, it's the only copy of the edits
+                        if (closing->save.running) {
+                            pthread_join(closing->save.thread, 0);
+                        }
+                        // NOTE(sen) Keep the edits around if they didn't make it into the file
+                        if (closing->save.running && closing->save.error && !state->aboutToQuit) {
+                            swapCommit(&closing->swap);
+                        } else {
+                            swapDiscard(&closing->swap);
+                        }
+                    }
+                    write(outputFd, "\x1b[2J", 4); // NOTE(sen) Clear screen
+                    write(outputFd, "\x1b[H", 3); // NOTE(sen) Move cursor to top-left
+                    if (replay.active) {
+                        replayReport(&replay, filename, buffer->fileSize, state->screenRows + 2, state->screenCols);
+                    }
+                    exit(0);
                 } else {
-                    if (state.rows[state.cursorY].fileChars[state.cursorFileX] == tabChar) {
-                        state.cursorRenderX += replacementsPerTab;
+                    state->aboutToQuit = true;
+                    if (nBuffers > 1) {
+                        state->userMessageLen = snprintf(
+                            state->userMessage, sizeof(state->userMessage),
+                            "Changes to %d file%s will be lost, press Ctrl-Q again to quit", nDirty,
+                            nDirty == 1 ? "" : "s"
+                        );
                     } else {
-                        state.cursorRenderX++;
+                        state->userMessageLen = snprintf(
+                            state->userMessage, sizeof(state->userMessage), "Changes will be lost, press Ctrl-Q again to quit"
+                        );
                     }
-                    state.cursorFileX++;
                 }
+            } else {
+                state->aboutToQuit = false;
+            }
+
+            // NOTE(sen) Only runs of typing or backspacing merge in the undo journal
+            b32 typing = key == Key_Backspace || key == '\t' || (key < Key_Backspace && !iscntrl((unsigned char)key));
+            if (!typing) {
+                undoSeal(undo);
+            }
+
+            // NOTE(sen) A followed file is read-only
+            b32 edits = typing || key == Key_Paste || key == CTRL_KEY('z') || key == CTRL_KEY('y') || key == CTRL_KEY('s')
+                || key == CTRL_KEY('r');
+            if (follow.active && edits) {
+                state->userMessageLen =
+                    snprintf(state->userMessage, sizeof(state->userMessage), "Read-only while following");
+                abReset(&input.paste);
+                continue;
+            }
+            // NOTE(sen) Lines of a pipe or a compressed file go on the end until it's all read, and a pipe
+            // has no file to save to
+            b32 pipeSave = key == CTRL_KEY('s') && state->stream && !state->stream->regularFile;
+            if (state->stream && ((edits && !rowsComplete(state)) || pipeSave)) {
+                state->userMessageLen = snprintf(
+                    state->userMessage, sizeof(state->userMessage), "%s",
+                    pipeSave                        ? "Piped input can't be saved"
+                        : state->stream->regularFile ? "Read-only until it's decompressed"
+                                                     : "Read-only until the input ends"
+                );
+                abReset(&input.paste);
+                continue;
             }
-        }; break;
-        case Key_ArrowLeft: {
-            if (state.cursorFileX == 0) {
-                if (state.cursorY > 0) {
-                    state.cursorY--;
-                    state.cursorFileX = state.rows[state.cursorY].charsSize;
-                    state.cursorRenderX = state.rows[state.cursorY].renderSize;
+
+            // NOTE(sen) Handle all other input
+            switch (key) {
+                // NOTE(sen) Cursor move
+            case Key_ArrowDown: {
+                state->aboutToQuit = false;
+                if (state->cursorY < state->nRows) {
+                    state->cursorY++;
+                    if (state->cursorY == state->nRows) {
+                        state->cursorRenderX = 0;
+                        state->cursorFileX = 0;
+                    } else {
+                        makeCursorXValidAfterRowChange(state, tabChar, replacementsPerTab);
+                    }
                 }
-            } else {
-                if (state.rows[state.cursorY].fileChars[state.cursorFileX - 1] == tabChar) {
-                    state.cursorRenderX -= replacementsPerTab;
+            }; break;
+            case Key_ArrowUp: {
+                state->aboutToQuit = false;
+                if (state->cursorY > 0) {
+                    state->cursorY--;
+                    makeCursorXValidAfterRowChange(state, tabChar, replacementsPerTab);
+                }
+            }; break;
+            case Key_ArrowRight: {
+                state->aboutToQuit = false;
+                if (state->cursorY < state->nRows) {
+                    Row* row = getRow(state, state->cursorY);
+                    if (state->cursorFileX == gbLen(&row->fileChars)) {
+                        state->cursorFileX = 0;
+                        state->cursorRenderX = 0;
+                        state->cursorY++;
+                    } else {
+                        i32 charLen;
+                        state->cursorRenderX +=
+                            gbCharWidth(&row->fileChars, state->cursorFileX, tabChar, replacementsPerTab, &charLen);
+                        state->cursorFileX += charLen;
+                    }
+                }
+            }; break;
+            case Key_ArrowLeft: {
+                if (state->cursorFileX == 0) {
+                    if (state->cursorY > 0) {
+                        state->cursorY--;
+                        Row* row = getRow(state, state->cursorY);
+                        state->cursorFileX = gbLen(&row->fileChars);
+                        state->cursorRenderX = rowRenderSize(row, tabChar, replacementsPerTab);
+                    }
                 } else {
-                    state.cursorRenderX--;
-                }
-                state.cursorFileX--;
-            }
-        }; break;
-        case Key_PageDown: {
-            i32 newY = state.cursorY + state.screenRows;
-            state.cursorY = clamp(newY, 0, state.nRows);
-            makeCursorXValidAfterRowChange(&state, tabChar, replacementsPerTab);
-        }; break;
-        case Key_PageUp: {
-            i32 newY = state.cursorY - state.screenRows;
-            state.cursorY = clamp(newY, 0, state.nRows);
-            makeCursorXValidAfterRowChange(&state, tabChar, replacementsPerTab);
-        }; break;
-        case Key_Home: {
-            state.cursorFileX = 0;
-            state.cursorRenderX = 0;
-        } break;
-        case Key_End: {
-            if (state.cursorY < state.nRows) {
-                Row* row = state.rows + state.cursorY;
-                state.cursorFileX = row->charsSize;
-                state.cursorRenderX = row->renderSize;
-            }
-        } break;
-
-            // NOTE(sen) Control characters
-        case '\r': {} break;
-        case '\x1b': {} break;
-        case Key_Backspace: {
-            state.dirty = true;
-            if (state.cursorY < state.nRows) {
-                Row* row = state.rows + state.cursorY;
-                i32 fileDeleteLen = 1;
-                if (state.cursorFileX >= fileDeleteLen) {
-                    char* fileSource = row->fileChars + state.cursorFileX;
-                    char* renderSource = row->renderChars + state.cursorRenderX;
-
-                    char* toDelete = row->fileChars + (state.cursorFileX - fileDeleteLen);
-                    i32 renderDeleteLen = 0;
-
-                    for (i32 deleteCharIndex = 0; deleteCharIndex < fileDeleteLen; deleteCharIndex++) {
-                        char deleteChar = toDelete[deleteCharIndex];
-                        if (deleteChar == tabChar) {
-                            renderDeleteLen += replacementsPerTab;
-                        } else {
-                            renderDeleteLen += 1;
+                    Row* row = getRow(state, state->cursorY);
+                    i32 charStart = gbCharStart(&row->fileChars, state->cursorFileX);
+                    state->cursorRenderX -=
+                        gbRenderWidth(&row->fileChars, charStart, state->cursorFileX, tabChar, replacementsPerTab);
+                    state->cursorFileX = charStart;
+                }
+            }; break;
+            case Key_PageDown:
+            case Key_PageUp: {
+                i32 direction = key == Key_PageDown ? 1 : -1;
+                if (state->wrap) {
+                    // NOTE(sen) A screen of lines, staying in the same column of the screen
+                    i32 subLine;
+                    state->cursorY = wrapMoveLines(
+                        state, state->cursorY, state->cursorRenderX / state->wrapCols, direction * state->screenRows,
+                        &subLine, tabChar, replacementsPerTab
+                    );
+                    state->cursorRenderX = subLine * state->wrapCols + state->cursorRenderX % state->wrapCols;
+                } else {
+                    state->cursorY = clamp(state->cursorY + direction * state->screenRows, 0, state->nRows);
+                }
+                makeCursorXValidAfterRowChange(state, tabChar, replacementsPerTab);
+            }; break;
+            case Key_Home: {
+                state->cursorFileX = 0;
+                state->cursorRenderX = 0;
+            } break;
+            case Key_End: {
+                if (state->cursorY < state->nRows) {
+                    Row* row = getRow(state, state->cursorY);
+                    state->cursorFileX = gbLen(&row->fileChars);
+                    state->cursorRenderX = rowRenderSize(row, tabChar, replacementsPerTab);
+                }
+            } break;
+
+                // NOTE(sen) Control characters
+            case '\r': {} break;
+            case '\x1b': {} break;
+            case Key_Backspace: {
+                state->dirty = true;
+                if (state->cursorY < state->nRows) {
+                    Row* row = getRow(state, state->cursorY);
+                    if (state->cursorFileX > 0) {
+                        // NOTE(sen) The whole character before the cursor goes
+                        i32 fileDeleteLen = state->cursorFileX - gbCharStart(&row->fileChars, state->cursorFileX);
+                        char deleted[4];
+                        for (i32 byteIndex = 0; byteIndex < fileDeleteLen; byteIndex++) {
+                            deleted[byteIndex] = gbAt(&row->fileChars, state->cursorFileX - fileDeleteLen + byteIndex);
                         }
+                        undoRecord(
+                            undo, UndoKind_Delete, state->cursorY, state->cursorFileX - fileDeleteLen,
+                            state->cursorY, state->cursorFileX, deleted, fileDeleteLen
+                        );
+                        i32 renderDeleteLen = gbRenderWidth(
+                            &row->fileChars, state->cursorFileX - fileDeleteLen, state->cursorFileX, tabChar, replacementsPerTab
+                        );
+                        assert(state->cursorRenderX >= renderDeleteLen);
+
+                        state->cursorFileX -= fileDeleteLen;
+                        state->cursorRenderX -= renderDeleteLen;
+
+                        rowDelete(row, state->cursorFileX, fileDeleteLen, tabChar, replacementsPerTab);
+                        rowsEdited(state, state->cursorY, state->cursorY);
+                    } else if (state->cursorY > 0) {
+                        Row* prevRow = getRow(state, state->cursorY - 1);
+                        undoRecord(
+                            undo, UndoKind_Delete, state->cursorY - 1, gbLen(&prevRow->fileChars),
+                            state->cursorY, 0, "\n", 1
+                        );
+                        state->cursorY -= 1;
+                        state->cursorFileX = gbLen(&prevRow->fileChars);
+                        state->cursorRenderX = rowRenderSize(prevRow, tabChar, replacementsPerTab);
+                        rowInsert(
+                            prevRow, state->cursorFileX, gbContiguous(&row->fileChars), gbLen(&row->fileChars),
+                            tabChar, replacementsPerTab
+                        );
+                        deleteRow(state, state->cursorY + 1);
+                        rowsEdited(state, state->cursorY, state->cursorY);
                     }
-                    assert(state.cursorRenderX >= renderDeleteLen);
-
-                    char* fileDest = row->fileChars + state.cursorFileX - fileDeleteLen;
-                    char* renderDest = row->renderChars + state.cursorRenderX - renderDeleteLen;
-
-                    i32 fileMoveLen = row->charsSize - state.cursorFileX + 1;
-                    i32 renderMoveLen = row->renderSize - state.cursorRenderX + 1;
-
-                    memmove(fileDest, fileSource, fileMoveLen);
-                    memmove(renderDest, renderSource, renderMoveLen);
-
-                    row->charsSize -= fileDeleteLen;
-                    state.cursorFileX -= fileDeleteLen;
-
-                    row->renderSize -= renderDeleteLen;
-                    state.cursorRenderX -= renderDeleteLen;
-                } else if (state.cursorY > 0) {
-                    Row* prevRow = state.rows + state.cursorY - 1;
-                    state.cursorY -= 1;
-                    state.cursorFileX = prevRow->charsSize;
-                    state.cursorRenderX = prevRow->renderSize;
-                    insert(&prevRow->fileChars, &prevRow->charsSize, row->fileChars, row->charsSize, prevRow->charsSize);
-                    insert(&prevRow->renderChars, &prevRow->renderSize, row->renderChars, row->renderSize, prevRow->renderSize);
-                    free(row->fileChars);
-                    free(row->renderChars);
-                    memcpy(row, row + 1, (state.nRows - state.cursorY) * sizeof(Row));
-                    state.nRows -= 1;
-                }
-            }
-        } break;
-        case Key_Delete: {} break;
-        case CTRL_KEY('h'): {} break;
-        case CTRL_KEY('l'): {} break;
-        case CTRL_KEY('s'): {
-            for (i32 rowIndex = 0; rowIndex < state.nRows; rowIndex++) {
-                Row* row = state.rows + rowIndex;
-                abAppend(&appendBuffer, row->fileChars, row->charsSize);
-                abAppend(&appendBuffer, "\n", 1);
-            }
-            FILE* file = fopen(filename, "w");
-            fwrite(appendBuffer.buf, appendBuffer.len, 1, file);
-            fclose(file);
-            abReset(&appendBuffer);
-            state.dirty = false;
-        } break;
-
-        default: {
-            // NOTE(sen) Insert into text
-            state.dirty = true;
-            Row* row;
-            if (state.cursorY == state.nRows) {
-                row = addRow(&state);
-            } else {
-                row = state.rows + state.cursorY;
-            }
-            char newFileChar = (char)key;
-            char* newRenderChars = 0;
-            i32 newRenderCharsLen = 0;
-            constructRenderChars(&newRenderChars, &newRenderCharsLen, &newFileChar, 1, tabChar, replacementsPerTab);
-            insert(&row->fileChars, &row->charsSize, &newFileChar, 1, state.cursorFileX);
-            insert(&row->renderChars, &row->renderSize, newRenderChars, newRenderCharsLen, state.cursorRenderX);
-            free(newRenderChars);
-            state.cursorRenderX += newRenderCharsLen;
-            state.cursorFileX++;
-        }
-        } // NOTE(sen) switch(key)
+                }
+            } break;
+            case Key_Delete: {} break;
+            case Key_Paste: {
+                // NOTE(sen) A paste past the last row starts a new one, journal that as a line break
+                // at the end of the last row so the whole paste is one undo step
+                i32 y = state->cursorY;
+                i32 x = state->cursorFileX;
+                b32 newRow = state->cursorY == state->nRows && state->nRows > 0;
+                if (newRow) {
+                    y--;
+                    x = gbLen(&getRow(state, y)->fileChars);
+                }
+                UndoRecord* record = undoAdd(undo, UndoKind_Insert, y, x, 0, 0, input.paste.len + newRow, false);
+                memcpy(undoText(record), "\n", newRow);
+                memcpy(undoText(record) + newRow, input.paste.buf, input.paste.len);
+                insertText(state, input.paste.buf, input.paste.len, tabChar, replacementsPerTab);
+                record->endY = state->cursorY;
+                record->endX = state->cursorFileX;
+                swapAdd(SWAP_FILE, record, undoText(record));
+                undoSeal(undo);
+                abReset(&input.paste);
+            } break;
+            case CTRL_KEY('z'): {
+                if (!undoStep(undo, state, tabChar, replacementsPerTab)) {
+                    state->userMessageLen = snprintf(state->userMessage, sizeof(state->userMessage), "Nothing to undo");
+                }
+            } break;
+            case CTRL_KEY('y'): {
+                if (!redoStep(undo, state, tabChar, replacementsPerTab)) {
+                    state->userMessageLen = snprintf(state->userMessage, sizeof(state->userMessage), "Nothing to redo");
+                }
+            } break;
+            case CTRL_KEY('f'): {
+                findStart(state, &find);
+            } break;
+            case CTRL_KEY('r'): {
+                replaceStart(state, &replace);
+            } break;
+            case CTRL_KEY('n'): {
+                // NOTE(sen) The next buffer is shown as it was left, its rows and render cache are
+                // still there. The screen is diffed against what's on it like any other frame.
+                if (nBuffers > 1) {
+                    swapCommit(SWAP_FILE);
+                    bufferIndex = (bufferIndex + 1) % nBuffers;
+                    buffer = buffers + bufferIndex;
+                    state = &buffer->state;
+                    undo = &buffer->undo;
+                    save = &buffer->save;
+                    filename = buffer->filename;
+                    SWAP_FILE = &buffer->swap;
+                    shadow.rowOffset = state->rowOffset;
+                    shadow.colOffset = state->colOffset;
+                    shadow.wrapOffset = state->wrapOffset;
+                    state->userMessageLen = snprintf(
+                        state->userMessage, sizeof(state->userMessage), "%.100s [%d/%d]", filename, bufferIndex + 1, nBuffers
+                    );
+                }
+            } break;
+            case CTRL_KEY('w'): {
+                state->wrap = !state->wrap;
+                shadow.valid = false;
+                state->userMessageLen = snprintf(
+                    state->userMessage, sizeof(state->userMessage), "Soft wrap %s", state->wrap ? "on" : "off"
+                );
+            } break;
+            case CTRL_KEY('p'): {
+                PROFILER.enabled = !PROFILER.enabled;
+                state->userMessageLen = snprintf(
+                    state->userMessage, sizeof(state->userMessage), "Profiling %s", PROFILER.enabled ? "on" : "off"
+                );
+            } break;
+            case CTRL_KEY('g'): {
+                gotoLine.active = true;
+                gotoLine.nDigits = 0;
+                setGotoLineMessage(state, &gotoLine);
+            } break;
+            // NOTE(sen) Repeat the last search
+            case CTRL_KEY('h'): {
+                findStep(state, &find, state->cursorY, state->cursorFileX, true, tabChar, replacementsPerTab);
+            } break;
+            case CTRL_KEY('l'): {
+                findStep(state, &find, state->cursorY, state->cursorFileX + 1, false, tabChar, replacementsPerTab);
+            } break;
+            case CTRL_KEY('s'): {
+                if (save->running) {
+                    state->userMessageLen =
+                        snprintf(state->userMessage, sizeof(state->userMessage), "Already saving");
+                } else if (startSave(save, state, filename)) {
+                    // NOTE(sen) Edits made while the save runs make the buffer dirty again
+                    state->dirty = false;
+                } else {
+                    state->userMessageLen =
+                        snprintf(state->userMessage, sizeof(state->userMessage), "Failed to start saving");
+                }
+            } break;
+
+            default: {
+                // NOTE(sen) Insert into text
+                PROFILE_BEGIN(InsertChar);
+                state->dirty = true;
+                Row* row;
+                // NOTE(sen) The rest of a UTF-8 character goes in with its first byte when it's there
+                char newFileChars[4] = {(char)key};
+                i32 nNewFileChars = 1;
+                u8 lead = (u8)key;
+                i32 expected = lead >= 0xF0 ? 4 : lead >= 0xE0 ? 3 : lead >= 0xC0 ? 2 : 1;
+                while (nNewFileChars < expected && inputPending(&input) && !input.inPaste
+                       && ((u8)input.buf[input.pos] & 0xC0) == 0x80) {
+                    newFileChars[nNewFileChars++] = input.buf[input.pos++];
+                }
+                if (state->cursorY == state->nRows && state->nRows > 0) {
+                    // NOTE(sen) Typing past the last row starts a new one
+                    Row* lastRow = getRow(state, state->nRows - 1);
+                    undoRecord(
+                        undo, UndoKind_Insert, state->nRows - 1, gbLen(&lastRow->fileChars), state->nRows, 0, "\n", 1
+                    );
+                }
+                undoRecord(
+                    undo, UndoKind_Insert, state->cursorY, state->cursorFileX, state->cursorY,
+                    state->cursorFileX + nNewFileChars, newFileChars, nNewFileChars
+                );
+                if (state->cursorY == state->nRows) {
+                    row = addRow(state);
+                } else {
+                    row = getRow(state, state->cursorY);
+                }
+                rowInsert(row, state->cursorFileX, newFileChars, nNewFileChars, tabChar, replacementsPerTab);
+                rowsEdited(state, state->cursorY, state->cursorY);
+                state->cursorFileX += nNewFileChars;
+                // NOTE(sen) Measured in place, the bytes might finish a character typed earlier
+                state->cursorRenderX = renderXForFileX(row, state->cursorFileX, tabChar, replacementsPerTab);
+                PROFILE_END(InsertChar);
+            }
+            } // NOTE(sen) switch(key)
+        } // NOTE(sen) Input batch
+        PROFILE_END(Keys);
 
     } // NOTE(sen) Mainloop
 